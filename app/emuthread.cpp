@@ -159,9 +159,11 @@ void EmuThread::doStuff(bool wait)
     {
         if(do_suspend)
         {
-            bool success = emu_suspend(snapshot_path.c_str());
             do_suspend = false;
-            emit suspended(success);
+            // Emulation continues while the snapshot is written
+            auto done = [](bool success, void *thread) { emit static_cast<EmuThread *>(thread)->suspended(success); };
+            if(!emu_suspend_async(snapshot_path.c_str(), false, done, this))
+                emit suspended(false);
         }
 
         if(enter_debugger)
@@ -253,7 +255,11 @@ void EmuThread::setPaused(bool paused)
 bool EmuThread::stop()
 {
     if(!isRunning())
+    {
+        // The last snapshot may still be written
+        emu_suspend_wait();
         return true;
+    }
 
     exiting = true;
     setPaused(false);
@@ -21,7 +21,7 @@ signals:
     // State
     void started(bool success); // Not called on resume
     void resumed(bool success);
-    void suspended(bool success);
+    void suspended(bool success); // From the thread writing the snapshot
     void stopped();
     void paused(bool b);
 
@@ -4,6 +4,7 @@
 #include "cpu/cpu.h"
 #include "cpu/cpudefs.h"
 #include "debug.h"
+#include "memory/mem.h"
 #include "memory/mmu.h"
 
 // Detect overflow after an addition or subtraction
@@ -133,15 +134,11 @@ static inline void set_nz_flags_64(uint64_t value) {
     arm.cpsr_z = value == 0;
 }
 
-void do_arm_instruction(Instruction i)
+// Whether the condition code (other than CC_NV) is met
+static inline bool condition_passed(uint8_t cond)
 {
-    bool exec = true;
-
-    // Shortcut for unconditional instructions
-    if(likely(i.cond == CC_AL))
-        goto always;
-
-    switch(i.cond)
+    bool exec;
+    switch(cond)
     {
     case CC_EQ: case CC_NE: exec = arm.cpsr_z; break;
     case CC_CS: case CC_CC: exec = arm.cpsr_c; break;
@@ -150,7 +147,61 @@ void do_arm_instruction(Instruction i)
     case CC_HI: case CC_LS: exec = !arm.cpsr_z && arm.cpsr_c; break;
     case CC_GE: case CC_LT: exec = arm.cpsr_n == arm.cpsr_v; break;
     case CC_GT: case CC_LE: exec = !arm.cpsr_z && arm.cpsr_n == arm.cpsr_v; break;
-    case CC_NV:
+    default: return true;
+    }
+
+    return exec ^ (cond & 1);
+}
+
+// carry is the C flag before the shifter operand was computed
+static inline __attribute__((always_inline)) void data_processing(uint8_t op, uint8_t rd, bool setcc, bool carry, uint32_t left, uint32_t right)
+{
+    uint32_t res = 0;
+
+    switch(op)
+    {
+    case OP_AND: res = left & right; break;
+    case OP_EOR: res = left ^ right; break;
+    case OP_SUB: res = add( left, ~right, 1, setcc); break;
+    case OP_RSB: res = add(~left,  right, 1, setcc); break;
+    case OP_ADD: res = add( left,  right, 0, setcc); break;
+    case OP_ADC: res = add( left,  right, carry, setcc); break;
+    case OP_SBC: res = add( left, ~right, carry, setcc); break;
+    case OP_RSC: res = add(~left,  right, carry, setcc); break;
+    case OP_TST: res = left & right; break;
+    case OP_TEQ: res = left ^ right; break;
+    case OP_CMP: res = add( left, ~right, 1, setcc); break;
+    case OP_CMN: res = add( left,  right, 0, setcc); break;
+    case OP_ORR: res = left | right; break;
+    case OP_MOV: res = right; break;
+    case OP_BIC: res = left & ~right; break;
+    case OP_MVN: res = ~right; break;
+    }
+
+    if(op < OP_TST || op > OP_CMN)
+        set_reg_pc(rd, res);
+
+    if(setcc)
+    {
+        // Used for returning from exceptions, for instance
+        if(rd == 15)
+            set_cpsr_full(get_spsr());
+        else
+        {
+            arm.cpsr_n = res >> 31;
+            arm.cpsr_z = res == 0;
+        }
+    }
+}
+
+void do_arm_instruction(Instruction i)
+{
+    // Shortcut for unconditional instructions
+    if(likely(i.cond == CC_AL))
+        goto always;
+
+    if(i.cond == CC_NV)
+    {
         if((i.raw & 0xFD70F000) == 0xF550F000)
             return;
         else if((i.raw & 0xFE000000) == 0xFA000000)
@@ -167,9 +218,7 @@ void do_arm_instruction(Instruction i)
         return;
     }
 
-    exec ^= i.cond & 1;
-
-    if(!exec)
+    if(!condition_passed(i.cond))
         return;
 
     always:
@@ -389,43 +438,9 @@ void do_arm_instruction(Instruction i)
              setcc = i.data_proc.s;
 
         uint32_t left = reg_pc(i.data_proc.rn),
-                 right = addr_mode_1(i, setcc),
-                 res = 0;
-
-        switch(i.data_proc.op)
-        {
-        case OP_AND: res = left & right; break;
-        case OP_EOR: res = left ^ right; break;
-        case OP_SUB: res = add( left, ~right, 1, setcc); break;
-        case OP_RSB: res = add(~left,  right, 1, setcc); break;
-        case OP_ADD: res = add( left,  right, 0, setcc); break;
-        case OP_ADC: res = add( left,  right, carry, setcc); break;
-        case OP_SBC: res = add( left, ~right, carry, setcc); break;
-        case OP_RSC: res = add(~left,  right, carry, setcc); break;
-        case OP_TST: res = left & right; break;
-        case OP_TEQ: res = left ^ right; break;
-        case OP_CMP: res = add( left, ~right, 1, setcc); break;
-        case OP_CMN: res = add( left,  right, 0, setcc); break;
-        case OP_ORR: res = left | right; break;
-        case OP_MOV: res = right; break;
-        case OP_BIC: res = left & ~right; break;
-        case OP_MVN: res = ~right; break;
-        }
-
-        if(i.data_proc.op < OP_TST || i.data_proc.op > OP_CMN)
-            set_reg_pc(i.data_proc.rd, res);
+                 right = addr_mode_1(i, setcc);
 
-        if(setcc)
-        {
-            // Used for returning from exceptions, for instance
-            if(i.data_proc.rd == 15)
-                set_cpsr_full(get_spsr());
-            else
-            {
-                arm.cpsr_n = res >> 31;
-                arm.cpsr_z = res == 0;
-            }
-        }
+        data_processing(i.data_proc.op, i.data_proc.rd, setcc, carry, left, right);
     }
     else if((insn & 0xFF000F0) == 0x7F000F0)
         undefined_instruction();
@@ -535,3 +550,187 @@ void do_arm_instruction(Instruction i)
     else
         undefined_instruction();
 }
+
+/* Cache of pre-decoded instructions. The most common instructions are decoded
+ * once into the form below, so that executing them again only costs a tag check
+ * and a switch on the type. Entries are tagged with the location and the
+ * instruction word they were decoded from, so overwritten code is simply
+ * decoded again and no invalidation is necessary. */
+enum DecodedType : uint8_t {
+    DI_GENERIC = 0, // Not pre-decoded, handled by do_arm_instruction
+    DI_DATA,        // Data processing with an immediate or a register shifted by an immediate,
+    DI_DATA_LAST = DI_DATA + OP_MVN, // one type per operation
+    DI_LOAD,        // LDR(B) with an immediate offset
+    DI_STORE,       // STR(B) with an immediate offset
+    DI_BRANCH,      // B and BL
+};
+
+enum DecodedFlags : uint8_t {
+    DF_SETCC = 1 << 0,
+    DF_IMM = 1 << 1,          // operand is the (rotated) immediate
+    DF_IMM_CARRY = 1 << 2,    // The immediate is rotated, so it sets C
+    DF_BYTE = 1 << 3,
+    DF_PRE = 1 << 4,          // Offset or pre-indexed addressing
+    DF_WRITEBACK = 1 << 5,
+    DF_LINK = 1 << 6,
+};
+
+struct DecodedInstruction {
+    uint32_t tag;      // Offset in mem_and_flags | 1, so that an empty entry never matches
+    uint32_t raw;      // Instruction word this was decoded from
+    uint32_t operand;  // Immediate, shift count, signed offset or branch displacement
+    uint8_t type;      // DecodedType
+    uint8_t cond, flags;
+    uint8_t rd, rn, rm, shift;
+};
+
+#define DECODE_CACHE_SIZE (1 << 14)
+static DecodedInstruction decode_cache[DECODE_CACHE_SIZE];
+
+static void decode_arm_instruction(DecodedInstruction *d, uint32_t offset, Instruction i)
+{
+    uint32_t insn = i.raw;
+
+    d->tag = offset | 1;
+    d->raw = insn;
+    d->type = DI_GENERIC;
+    d->cond = i.cond;
+    d->flags = 0;
+
+    // Same order of checks as in do_arm_instruction.
+    // Everything involving the PC is left to it as well.
+    if(i.cond == CC_NV
+       || (insn & 0xE000090) == 0x0000090
+       || (insn & 0xD900000) == 0x1000000)
+        return;
+    else if((insn & 0xC000000) == 0x0000000)
+    {
+        if(i.data_proc.rn == 15)
+            return;
+
+        if(i.data_proc.imm)
+        {
+            uint32_t imm = i.data_proc.immed_8;
+            uint8_t count = i.data_proc.rotate_imm << 1;
+            if(count)
+            {
+                imm = (imm >> count) | (imm << (32 - count));
+                d->flags |= DF_IMM_CARRY;
+            }
+            d->operand = imm;
+            d->flags |= DF_IMM;
+        }
+        else if(i.data_proc.reg_shift || i.data_proc.rm == 15)
+            return;
+        else
+        {
+            d->rm = i.data_proc.rm;
+            d->shift = i.data_proc.shift;
+            d->operand = i.data_proc.shift_imm;
+        }
+
+        d->type = DI_DATA + i.data_proc.op;
+        d->rd = i.data_proc.rd;
+        d->rn = i.data_proc.rn;
+        if(i.data_proc.s)
+            d->flags |= DF_SETCC;
+    }
+    else if((insn & 0xE000000) == 0x4000000)
+    {
+        bool writeback = !i.mem_proc.p || i.mem_proc.w;
+        if(i.mem_proc.rd == 15
+           || (!i.mem_proc.p && i.mem_proc.w) // Usermode access
+           || (writeback && i.mem_proc.rn == 15))
+            return;
+
+        d->type = i.mem_proc.l ? DI_LOAD : DI_STORE;
+        d->rd = i.mem_proc.rd;
+        d->rn = i.mem_proc.rn;
+        d->operand = i.mem_proc.u ? i.mem_proc.immed : -i.mem_proc.immed;
+        if(i.mem_proc.b)
+            d->flags |= DF_BYTE;
+        if(i.mem_proc.p)
+            d->flags |= DF_PRE;
+        if(writeback)
+            d->flags |= DF_WRITEBACK;
+    }
+    else if((insn & 0xE000000) == 0xA000000)
+    {
+        d->type = DI_BRANCH;
+        d->operand = ((int32_t) (i.branch.immed << 8) >> 6) + 4;
+        if(i.branch.l)
+            d->flags |= DF_LINK;
+    }
+}
+
+// Inlined with a constant op, so that each operation gets its own copy
+static inline __attribute__((always_inline)) void do_data_processing_decoded(const DecodedInstruction *d, uint8_t op)
+{
+    bool carry = arm.cpsr_c,
+         setcc = d->flags & DF_SETCC;
+    uint32_t right;
+
+    if(d->flags & DF_IMM)
+    {
+        right = d->operand;
+        if(setcc && (d->flags & DF_IMM_CARRY))
+            arm.cpsr_c = right >> 31;
+    }
+    else
+        right = shift(arm.reg[d->rm], d->shift, d->operand, setcc, false);
+
+    data_processing(op, d->rd, setcc, carry, arm.reg[d->rn], right);
+}
+
+void do_arm_instruction_cached(Instruction *p)
+{
+    uint32_t offset = (uint8_t*) p - mem_and_flags;
+    DecodedInstruction *d = &decode_cache[(offset >> 2) & (DECODE_CACHE_SIZE - 1)];
+    if(unlikely(d->tag != (offset | 1) || d->raw != p->raw))
+        decode_arm_instruction(d, offset, *p);
+
+    if(d->type == DI_GENERIC)
+    {
+        do_arm_instruction(*p);
+        return;
+    }
+
+    if(d->cond != CC_AL && !condition_passed(d->cond))
+        return;
+
+    switch(d->type)
+    {
+    #define DATA_CASE(op) case DI_DATA + op: do_data_processing_decoded(d, op); break;
+    DATA_CASE(OP_AND) DATA_CASE(OP_EOR) DATA_CASE(OP_SUB) DATA_CASE(OP_RSB)
+    DATA_CASE(OP_ADD) DATA_CASE(OP_ADC) DATA_CASE(OP_SBC) DATA_CASE(OP_RSC)
+    DATA_CASE(OP_TST) DATA_CASE(OP_TEQ) DATA_CASE(OP_CMP) DATA_CASE(OP_CMN)
+    DATA_CASE(OP_ORR) DATA_CASE(OP_MOV) DATA_CASE(OP_BIC) DATA_CASE(OP_MVN)
+    #undef DATA_CASE
+    case DI_LOAD:
+    case DI_STORE:
+    {
+        // PC-relative loads are the only ones with rn == 15
+        uint32_t base = d->rn == 15 ? arm.reg[15] + 4 : arm.reg[d->rn],
+                 addr = (d->flags & DF_PRE) ? base + d->operand : base;
+
+        if(d->type == DI_LOAD)
+            arm.reg[d->rd] = (d->flags & DF_BYTE) ? read_byte(addr) : read_word(addr);
+        else if(d->flags & DF_BYTE)
+            write_byte(addr, arm.reg[d->rd]);
+        else
+            write_word(addr, arm.reg[d->rd]);
+
+        if(d->flags & DF_WRITEBACK)
+            arm.reg[d->rn] = base + d->operand;
+        break;
+    }
+    case DI_BRANCH:
+        if(d->flags & DF_LINK)
+            arm.reg[14] = arm.reg[15];
+        arm.reg[15] += d->operand;
+        break;
+    default:
+        do_arm_instruction(*p);
+        break;
+    }
+}
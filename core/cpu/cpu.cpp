@@ -12,6 +12,8 @@
 #include "jit/asmcode.h"
 #include "cpu/cpu.h"
 #include "cpu/cpudefs.h"
+#include "cpu/fallback_stats.h"
+#include "cpu/lockstep.h"
 #include "debug.h"
 #include "debug_api.h"
 #include "emu.h"
@@ -88,9 +90,17 @@ void cpu_arm_loop()
         else if(do_translate && !(*flags_ptr & DONT_TRANSLATE) && (*flags_ptr & RF_CODE_EXECUTED))
             translate(arm.reg[15], &p->raw);
 
+        // A block may have been translated in the background meanwhile
+        if(unlikely(translate_background_done()))
+            translate_background_publish();
+
         // If the instruction is translated, use the translation
-        if((~cpu_events & EVENT_DEBUG_STEP) && *flags_ptr & RF_CODE_TRANSLATED)
+        if((~cpu_events & EVENT_DEBUG_STEP) && *flags_ptr & RF_CODE_TRANSLATED
+           && translation_can_enter(p, arm.reg[15], false))
         {
+            if (unlikely(lockstep_enabled))
+                lockstep_enter(p);
+            else
             #if TRANSLATION_ENTER_HAS_PTR
                 translation_enter(p);
             #else
@@ -102,9 +112,12 @@ void cpu_arm_loop()
 	*flags_ptr |= RF_CODE_EXECUTED;
 #endif
 
+        if (unlikely(fallback_stats_enabled))
+            fallback_stats_interpreted(p->raw, false);
+
         arm.reg[15] += 4; // Increment now to account for the pipeline
         ++cycle_count_delta;
-        do_arm_instruction(*p);
+        do_arm_instruction_cached(p);
     }
 }
 
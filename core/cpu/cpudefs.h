@@ -149,6 +149,10 @@ enum DataOp {
 
 // Defined in arm_interpreter.cpp
 void do_arm_instruction(Instruction i);
+// Same, but uses the cache of pre-decoded instructions. p has to point into mem_and_flags.
+void do_arm_instruction_cached(Instruction *p);
+// Defined in thumb_interpreter.cpp. arm.reg[15] has to point to the next instruction already.
+void do_thumb_instruction(uint16_t insn);
 // Defined in coproc.cpp
 void do_cp15_instruction(Instruction i);
 
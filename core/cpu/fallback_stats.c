@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu.h"
+#include "cpu/fallback_stats.h"
+
+bool fallback_stats_enabled;
+
+enum insn_class {
+    ARM_DATA, ARM_DATA_SHIFT_REG, ARM_DATA_PC, ARM_MUL, ARM_MUL_LONG, ARM_SWP,
+    ARM_HALF, ARM_DOUBLE, ARM_PSR, ARM_BX, ARM_MISC, ARM_LDR_STR, ARM_LDR_PC,
+    ARM_LDM_STM, ARM_LDM_STM_S, ARM_BRANCH, ARM_COPROC, ARM_SWI, ARM_UNCOND, ARM_UNDEF,
+    THUMB_SHIFT, THUMB_ADD_SUB, THUMB_IMM, THUMB_ALU, THUMB_HI_REG, THUMB_BX,
+    THUMB_LDR_PC, THUMB_LDR_STR_REG, THUMB_LDR_STR_IMM, THUMB_LDRH_STRH_IMM,
+    THUMB_LDR_STR_SP, THUMB_ADD_PC_SP, THUMB_MISC, THUMB_LDM_STM, THUMB_B_COND,
+    THUMB_SWI, THUMB_B, THUMB_BL,
+    CLASS_COUNT
+};
+
+static const char *const class_names[CLASS_COUNT] = {
+    [ARM_DATA]              = "ARM data processing",
+    [ARM_DATA_SHIFT_REG]    = "ARM data processing, shift by register",
+    [ARM_DATA_PC]           = "ARM data processing to PC",
+    [ARM_MUL]               = "ARM MUL/MLA",
+    [ARM_MUL_LONG]          = "ARM UMULL/UMLAL/SMULL/SMLAL",
+    [ARM_SWP]               = "ARM SWP/SWPB",
+    [ARM_HALF]              = "ARM LDRH/STRH/LDRSB/LDRSH",
+    [ARM_DOUBLE]            = "ARM LDRD/STRD",
+    [ARM_PSR]               = "ARM MRS/MSR",
+    [ARM_BX]                = "ARM BX/BLX register",
+    [ARM_MISC]              = "ARM CLZ/QADD/SMULxy/BKPT",
+    [ARM_LDR_STR]           = "ARM LDR/STR/LDRB/STRB",
+    [ARM_LDR_PC]            = "ARM LDR to PC",
+    [ARM_LDM_STM]           = "ARM LDM/STM",
+    [ARM_LDM_STM_S]         = "ARM LDM/STM with S bit",
+    [ARM_BRANCH]            = "ARM B/BL",
+    [ARM_COPROC]            = "ARM coprocessor",
+    [ARM_SWI]               = "ARM SWI",
+    [ARM_UNCOND]            = "ARM unconditional (BLX, PLD)",
+    [ARM_UNDEF]             = "ARM undefined",
+    [THUMB_SHIFT]           = "THUMB shift by immediate",
+    [THUMB_ADD_SUB]         = "THUMB ADD/SUB 3 operands",
+    [THUMB_IMM]             = "THUMB MOV/CMP/ADD/SUB immediate",
+    [THUMB_ALU]             = "THUMB ALU operation",
+    [THUMB_HI_REG]          = "THUMB high register operation",
+    [THUMB_BX]              = "THUMB BX/BLX register",
+    [THUMB_LDR_PC]          = "THUMB LDR PC-relative",
+    [THUMB_LDR_STR_REG]     = "THUMB load/store register offset",
+    [THUMB_LDR_STR_IMM]     = "THUMB LDR/STR/LDRB/STRB immediate",
+    [THUMB_LDRH_STRH_IMM]   = "THUMB LDRH/STRH immediate",
+    [THUMB_LDR_STR_SP]      = "THUMB LDR/STR SP-relative",
+    [THUMB_ADD_PC_SP]       = "THUMB ADD to PC/SP",
+    [THUMB_MISC]            = "THUMB SP adjust/PUSH/POP/BKPT",
+    [THUMB_LDM_STM]         = "THUMB LDMIA/STMIA",
+    [THUMB_B_COND]          = "THUMB conditional branch",
+    [THUMB_SWI]             = "THUMB SWI",
+    [THUMB_B]               = "THUMB B",
+    [THUMB_BL]              = "THUMB BL/BLX immediate",
+};
+
+static const char *const block_end_names[BLOCK_END_COUNT] = {
+    [BLOCK_END_BRANCH]          = "branch or other exit",
+    [BLOCK_END_PAGE]            = "end of page",
+    [BLOCK_END_TRANSLATED]      = "reached translated code",
+    [BLOCK_END_NO_TRANSLATE]    = "reached untranslatable code",
+    [BLOCK_END_BREAKPOINT]      = "breakpoint",
+    [BLOCK_END_UNIMPLEMENTED]   = "unimplemented instruction",
+    [BLOCK_END_COND_TOO_LONG]   = "conditional code over 0x7F bytes",
+    [BLOCK_END_CODE_SPACE]      = "translation cache full",
+};
+
+static uint64_t block_ends[BLOCK_END_COUNT];
+static uint64_t stopped_by[CLASS_COUNT];    // Unimplemented or too long to be conditional
+static uint64_t interpreted[CLASS_COUNT];
+
+static enum insn_class arm_class(uint32_t insn) {
+    if (insn >> 28 == 0xF)
+        return ARM_UNCOND;
+
+    switch (insn >> 25 & 7) {
+        case 0: case 1:
+            if ((insn & 0xE000090) == 0x0000090) {
+                if (insn & 0x60)
+                    return (insn & 0x0100040) == 0x0000040 ? ARM_DOUBLE : ARM_HALF;
+                if ((insn & 0xFC000F0) == 0x0000090)
+                    return ARM_MUL;
+                if ((insn & 0xF8000F0) == 0x0800090)
+                    return ARM_MUL_LONG;
+                if ((insn & 0xFB00FF0) == 0x1000090)
+                    return ARM_SWP;
+                return ARM_UNDEF;
+            }
+            if ((insn & 0xD900000) == 0x1000000) {
+                // Compare opcodes without S: miscellaneous instructions
+                if ((insn & 0xFFFFFD0) == 0x12FFF10)
+                    return ARM_BX;
+                if ((insn & 0xFBF0FFF) == 0x10F0000 || (insn & 0xFB0FFF0) == 0x120F000
+                        || (insn & 0xFB0F000) == 0x320F000)
+                    return ARM_PSR;
+                return ARM_MISC;
+            }
+            if ((insn >> 12 & 15) == 15 && (insn & 0x1800000) != 0x1000000)
+                return ARM_DATA_PC;
+            if (!(insn & (1 << 25)) && (insn & (1 << 4)))
+                return ARM_DATA_SHIFT_REG;
+            return ARM_DATA;
+        case 2: case 3:
+            if ((insn & 0x2000010) == 0x2000010)
+                return ARM_UNDEF;
+            if ((insn & 0x010F000) == 0x010F000)
+                return ARM_LDR_PC;
+            return ARM_LDR_STR;
+        case 4:
+            return (insn & (1 << 22)) ? ARM_LDM_STM_S : ARM_LDM_STM;
+        case 5:
+            return ARM_BRANCH;
+        case 6:
+            return ARM_COPROC;
+        default:
+            return (insn & (1 << 24)) ? ARM_SWI : ARM_COPROC;
+    }
+}
+
+static enum insn_class thumb_class(uint16_t insn) {
+    switch (insn >> 11) {
+        case 0x00: case 0x01: case 0x02:
+            return THUMB_SHIFT;
+        case 0x03:
+            return THUMB_ADD_SUB;
+        case 0x04: case 0x05: case 0x06: case 0x07:
+            return THUMB_IMM;
+        case 0x08:
+            if (insn < 0x4400)
+                return THUMB_ALU;
+            return (insn & 0xFF00) == 0x4700 ? THUMB_BX : THUMB_HI_REG;
+        case 0x09:
+            return THUMB_LDR_PC;
+        case 0x0A: case 0x0B:
+            return THUMB_LDR_STR_REG;
+        case 0x0C: case 0x0D: case 0x0E: case 0x0F:
+            return THUMB_LDR_STR_IMM;
+        case 0x10: case 0x11:
+            return THUMB_LDRH_STRH_IMM;
+        case 0x12: case 0x13:
+            return THUMB_LDR_STR_SP;
+        case 0x14: case 0x15:
+            return THUMB_ADD_PC_SP;
+        case 0x16: case 0x17:
+            return THUMB_MISC;
+        case 0x18: case 0x19:
+            return THUMB_LDM_STM;
+        case 0x1A: case 0x1B:
+            return (insn >> 8 & 15) == 15 ? THUMB_SWI : THUMB_B_COND;
+        case 0x1C:
+            return THUMB_B;
+        default:
+            return THUMB_BL;
+    }
+}
+
+static enum insn_class insn_class(uint32_t insn, bool thumb) {
+    return thumb ? thumb_class(insn) : arm_class(insn);
+}
+
+void fallback_stats_block_end(enum block_end reason, const void *insnp, bool thumb) {
+    block_ends[reason]++;
+    if (reason == BLOCK_END_UNIMPLEMENTED || reason == BLOCK_END_COND_TOO_LONG)
+        stopped_by[thumb ? thumb_class(*(const uint16_t *)insnp) : arm_class(*(const uint32_t *)insnp)]++;
+}
+
+void fallback_stats_interpreted(uint32_t insn, bool thumb) {
+    interpreted[insn_class(insn, thumb)]++;
+}
+
+void fallback_stats_reset() {
+    memset(block_ends, 0, sizeof block_ends);
+    memset(stopped_by, 0, sizeof stopped_by);
+    memset(interpreted, 0, sizeof interpreted);
+}
+
+static const uint64_t *sort_counts;
+
+static int count_compare(const void *a, const void *b) {
+    uint64_t left = sort_counts[*(const int *)a], right = sort_counts[*(const int *)b];
+    return left > right ? -1 : left < right;
+}
+
+// Prints the nonzero counts, most frequent first
+static void dump_counts(const char *title, const uint64_t *counts, const char *const *names, int count) {
+    int order[CLASS_COUNT];
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+        total += counts[i];
+    }
+    sort_counts = counts;
+    qsort(order, count, sizeof(*order), count_compare);
+
+    gui_debug_printf("%s: %llu\n", title, (unsigned long long) total);
+    for (int i = 0; i < count && counts[order[i]]; i++)
+        gui_debug_printf("  %-40s %12llu %5.1f%%\n", names[order[i]],
+                         (unsigned long long) counts[order[i]], counts[order[i]] * 100.0 / total);
+}
+
+void fallback_stats_dump() {
+    if (!fallback_stats_enabled)
+        gui_debug_printf("Fallback statistics are off, enable them with \"fs on\".\n");
+    dump_counts("Translated blocks ended by", block_ends, block_end_names, BLOCK_END_COUNT);
+    dump_counts("Instructions stopping translation", stopped_by, class_names, CLASS_COUNT);
+    dump_counts("Instructions interpreted", interpreted, class_names, CLASS_COUNT);
+}
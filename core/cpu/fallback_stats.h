@@ -0,0 +1,43 @@
+/* Declarations for fallback_stats.c */
+
+#ifndef FALLBACK_STATS_H
+#define FALLBACK_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counts why translated blocks end and which kinds of instructions the
+ * interpreter runs instead, to see what keeps code out of the translator.
+ * Nothing is counted unless fallback_stats_enabled is set, by the debugger
+ * command "fs on" or firebird-headless --fallback-stats. */
+extern bool fallback_stats_enabled;
+
+enum block_end {
+    BLOCK_END_BRANCH,           // Instruction leaving the block, like a branch
+    BLOCK_END_PAGE,             // End of the 1 KB page
+    BLOCK_END_TRANSLATED,       // Reached code which is translated already
+    BLOCK_END_NO_TRANSLATE,     // Reached code which couldn't be translated before
+    BLOCK_END_BREAKPOINT,       // Breakpoint or debugger stepping
+    BLOCK_END_UNIMPLEMENTED,    // Instruction the translator doesn't handle
+    BLOCK_END_COND_TOO_LONG,    // Conditional instruction too long to jump over
+    BLOCK_END_CODE_SPACE,       // Translation cache full
+    BLOCK_END_COUNT
+};
+
+// Counts the end of a block. insnp points to the instruction which stopped it,
+// only looked at for BLOCK_END_UNIMPLEMENTED and BLOCK_END_COND_TOO_LONG.
+void fallback_stats_block_end(enum block_end reason, const void *insnp, bool thumb);
+// Counts an instruction run by the interpreter
+void fallback_stats_interpreted(uint32_t insn, bool thumb);
+void fallback_stats_reset();
+void fallback_stats_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
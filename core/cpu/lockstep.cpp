@@ -0,0 +1,380 @@
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "jit/asmcode.h"
+#include "cpu/cpu.h"
+#include "cpu/cpudefs.h"
+#include "cpu/lockstep.h"
+#include "cpu/translate.h"
+#include "disassembly/disasm.h"
+#include "emu.h"
+#include "memory/fastmem.h"
+#include "memory/mem.h"
+#include "memory/mmu.h"
+
+bool lockstep_enabled, lockstep_recording, lockstep_io;
+struct lockstep_stats lockstep_stats;
+
+// The interpreter gives up following a block after this many instructions
+#define LOCKSTEP_MAX_STEPS 0x1000
+// Differences are only counted after this many were reported
+#define LOCKSTEP_MAX_REPORTS 20
+
+#ifndef NO_TRANSLATION
+
+// A write to RAM during a run
+struct lockstep_write {
+    uint8_t *ptr;
+    uint32_t old_value, new_value;
+    int size;
+    int step;   // Instruction of the interpreter run which did it
+};
+
+struct lockstep_state {
+    arm_state cpu;
+    uint32_t events;
+};
+
+enum lockstep_phase { PHASE_NONE, PHASE_TRANSLATED, PHASE_INTERPRETED, PHASE_SEARCH };
+
+static lockstep_phase phase;
+static std::vector<lockstep_write> translated_writes, interpreted_writes, *journal;
+// RAM as the translated run left it, for each byte it wrote
+static std::map<uint8_t *, uint8_t> translated_bytes;
+// State before each instruction of the interpreter run
+static std::vector<lockstep_state> states;
+static lockstep_state interpreted;
+static int step, steps;
+static uint32_t block_pc;
+static int32_t start_cycles, cycles;
+
+static inline uint8_t write_byte_at(uint32_t value, const lockstep_write &w, uint8_t *ptr) {
+    return value >> (8 * (ptr - w.ptr));
+}
+
+static inline bool write_covers(const lockstep_write &w, uint8_t *ptr) {
+    return ptr >= w.ptr && ptr < w.ptr + w.size;
+}
+
+static void store(uint8_t *ptr, uint32_t value, int size) {
+    for (int i = 0; i < size; i++)
+        ptr[i] = value >> (8 * i);
+}
+
+// Memory is written directly: write_action was done by the writes themselves
+static void undo(const std::vector<lockstep_write> &writes) {
+    for (auto w = writes.rbegin(); w != writes.rend(); ++w)
+        store(w->ptr, w->old_value, w->size);
+}
+
+static void redo(const std::vector<lockstep_write> &writes, int from_step, int to_step) {
+    for (const lockstep_write &w : writes)
+        if (w.step >= from_step && w.step < to_step)
+            store(w.ptr, w.new_value, w.size);
+}
+
+void lockstep_record_write(void *ptr, uint32_t value, int size) {
+    uint8_t *p = (uint8_t *)ptr;
+    uint32_t old_value = 0;
+    for (int i = 0; i < size; i++)
+        old_value |= p[i] << (8 * i);
+    journal->push_back({ p, old_value, value, size, step });
+}
+
+static void start_recording(std::vector<lockstep_write> *writes) {
+    writes->clear();
+    journal = writes;
+    step = 0;
+    lockstep_io = false;
+    lockstep_recording = true;
+}
+
+// Runs one translated block from the current state, recording its writes
+static void run_translated(void *ptr) {
+    start_recording(&translated_writes);
+    // Leave at the end of the first block
+    cycle_count_delta = -1;
+#if TRANSLATION_ENTER_HAS_PTR
+    translation_enter(ptr);
+#else
+    (void) ptr;
+    translation_enter();
+#endif
+    lockstep_recording = false;
+
+    translated_bytes.clear();
+    for (const lockstep_write &w : translated_writes)
+        for (int i = 0; i < w.size; i++)
+            translated_bytes[w.ptr + i] = w.ptr[i];
+}
+
+// Runs one instruction like cpu_arm_loop and cpu_thumb_loop do
+static bool interpret_step() {
+    if (arm.cpsr_low28 & 0x20) {
+        uint16_t *insnp = (uint16_t *)read_instruction(arm.reg[15] & ~1);
+        if (!insnp)
+            return false;
+        arm.reg[15] += 2;
+        do_thumb_instruction(*insnp);
+    } else {
+        arm.reg[15] &= ~3;
+        Instruction *p = (Instruction *)read_instruction(arm.reg[15]);
+        if (!p)
+            return false;
+        arm.reg[15] += 4;
+        do_arm_instruction(*p);
+    }
+    return true;
+}
+
+/* Interprets the block from the current state. A translated block runs
+ * straight through until it branches or stops at end_pc, so the
+ * interpreter stops there as well. */
+static void interpret_block(uint32_t end_pc, bool end_thumb) {
+    start_recording(&interpreted_writes);
+    states.clear();
+    for (steps = 0; steps < LOCKSTEP_MAX_STEPS; ) {
+        uint32_t pc = arm.reg[15];
+        bool thumb = arm.cpsr_low28 & 0x20;
+        states.push_back({ arm, cpu_events });
+        if (!interpret_step())
+            break;
+        step = ++steps;
+
+        bool now_thumb = arm.cpsr_low28 & 0x20;
+        if (now_thumb != thumb || arm.reg[15] != pc + (thumb ? 2 : 4))
+            break;
+        if (now_thumb == end_thumb && arm.reg[15] == end_pc)
+            break;
+    }
+    lockstep_recording = false;
+    interpreted = { arm, cpu_events };
+}
+
+// Value of the byte at ptr before the interpreter ran instruction before_step
+static uint8_t interpreted_byte(uint8_t *ptr, int before_step) {
+    const lockstep_write *first = nullptr, *last = nullptr;
+    for (const lockstep_write &w : interpreted_writes) {
+        if (!write_covers(w, ptr))
+            continue;
+        if (!first)
+            first = &w;
+        if (w.step < before_step)
+            last = &w;
+    }
+    if (last)
+        return write_byte_at(last->new_value, *last, ptr);
+    if (first)
+        return write_byte_at(first->old_value, *first, ptr);
+    return *ptr;
+}
+
+static uint32_t state_cpsr(const arm_state &s) {
+    return s.cpsr_low28 | s.cpsr_n << 31 | s.cpsr_z << 30 | s.cpsr_c << 29 | s.cpsr_v << 28;
+}
+
+/* Compares the results of the translated run starting at instruction
+ * start_step of the interpreter run with those of the interpreter. RAM has
+ * to be as the interpreter left it. */
+static bool results_match(const lockstep_state &translated, int start_step, bool report) {
+    bool match = true;
+    const arm_state &t = translated.cpu, &i = interpreted.cpu;
+    for (int r = 0; r < 16; r++) {
+        if (t.reg[r] != i.reg[r]) {
+            match = false;
+            if (report)
+                gui_debug_printf("  %-4s translated %08x, interpreted %08x\n", reg_name[r], t.reg[r], i.reg[r]);
+        }
+    }
+    if (state_cpsr(t) != state_cpsr(i)) {
+        match = false;
+        if (report)
+            gui_debug_printf("  cpsr translated %08x, interpreted %08x\n", state_cpsr(t), state_cpsr(i));
+    }
+    if (memcmp(&t.control, &i.control, sizeof(arm_state) - offsetof(arm_state, control))) {
+        match = false;
+        if (report)
+            gui_debug_printf("  banked registers or CP15 state differ\n");
+    }
+    if (translated.events != interpreted.events) {
+        match = false;
+        if (report)
+            gui_debug_printf("  cpu_events translated %x, interpreted %x\n", translated.events, interpreted.events);
+    }
+
+    // What RAM looks like after the translated run, where either run wrote
+    std::map<uint8_t *, uint8_t> bytes;
+    for (const lockstep_write &w : interpreted_writes)
+        for (int b = 0; b < w.size; b++)
+            bytes[w.ptr + b] = interpreted_byte(w.ptr + b, start_step);
+    for (const auto &b : translated_bytes)
+        bytes[b.first] = b.second;
+
+    int reported = 0;
+    for (const auto &b : bytes) {
+        if (b.second == *b.first)
+            continue;
+        match = false;
+        if (report && reported++ < 16)
+            gui_debug_printf("  byte at %08x translated %02x, interpreted %02x\n", phys_mem_addr(b.first), b.second, *b.first);
+    }
+    return match;
+}
+
+/* Finds the instruction whose translation gives a different result than the
+ * interpreter, by entering the translation after each instruction with the
+ * state the interpreter had there. Returns its index. If there are several,
+ * this is the last one. */
+static int find_wrong_instruction() {
+    phase = PHASE_SEARCH;
+    for (step = 1; step < steps; step++) {
+        const lockstep_state &s = states[step];
+        bool thumb = s.cpu.cpsr_low28 & 0x20;
+        uint32_t pc = s.cpu.reg[15] & (thumb ? ~1 : ~3);
+        void *ptr = read_instruction(pc);
+        if (s.events || !ptr || !(RAM_FLAGS((uintptr_t)ptr & ~3) & RF_CODE_TRANSLATED)
+            || !translation_can_enter(ptr, pc, thumb))
+            continue;
+
+        undo(interpreted_writes);
+        redo(interpreted_writes, 0, step);
+        arm = s.cpu;
+        cpu_events = s.events;
+        int search_step = step;
+        run_translated(ptr);
+        step = search_step;
+        lockstep_state translated = { arm, cpu_events };
+        bool io = lockstep_io;
+        undo(translated_writes);
+        redo(interpreted_writes, step, steps);
+
+        // From here on the translation is right, so the instruction before wasn't
+        if (!io && results_match(translated, step, false))
+            break;
+    }
+    return step - 1;
+}
+
+static void report_wrong_instruction(int index) {
+    const arm_state &s = states[index].cpu;
+    char buf[80];
+    uint32_t raw = 0;
+    if (s.cpsr_low28 & 0x20) {
+        if (!disasm_thumb_insn_buf(s.reg[15] & ~1, buf, sizeof(buf), &raw))
+            strcpy(buf, "?");
+    } else if (!disasm_arm_insn_buf(s.reg[15] & ~3, buf, sizeof(buf), &raw)) {
+        strcpy(buf, "?");
+    }
+    gui_debug_printf("  wrong instruction at %08x: %08x %s\n", s.reg[15], raw, buf);
+}
+
+static void finish() {
+    phase = PHASE_NONE;
+    arm = interpreted.cpu;
+    cpu_events = interpreted.events;
+    cycle_count_delta = cycles;
+}
+
+void lockstep_enter(void *ptr) {
+    lockstep_state start = { arm, cpu_events };
+    block_pc = arm.reg[15];
+    start_cycles = cycle_count_delta;
+
+    phase = PHASE_TRANSLATED;
+    run_translated(ptr);
+    // Account for the block like translation_enter would
+    cycles = cycle_count_delta = start_cycles + cycle_count_delta + 1;
+    if (lockstep_io) {
+        phase = PHASE_NONE;
+        lockstep_stats.skipped++;
+        return;
+    }
+    lockstep_state translated = { arm, cpu_events };
+
+    // Run it again with the interpreter
+    undo(translated_writes);
+    arm = start.cpu;
+    cpu_events = start.events;
+    phase = PHASE_INTERPRETED;
+    interpret_block(translated.cpu.reg[15], translated.cpu.cpsr_low28 & 0x20);
+
+    if (results_match(translated, 0, false)) {
+        lockstep_stats.compared++;
+        finish();
+        return;
+    }
+
+    if (lockstep_stats.diverged++ < LOCKSTEP_MAX_REPORTS) {
+        gui_debug_printf("Lockstep: block at %08x gave different results translated and interpreted\n", block_pc);
+        results_match(translated, 0, true);
+        // Instructions accessing MMIO can't be run again
+        if (!lockstep_io && steps > 0)
+            report_wrong_instruction(find_wrong_instruction());
+    }
+    finish();
+}
+
+void lockstep_cancel() {
+    lockstep_recording = false;
+    switch (phase) {
+    case PHASE_NONE:
+        return;
+    case PHASE_TRANSLATED:
+        // It simply ran translated
+        cycle_count_delta = start_cycles + cycle_count_delta + 1;
+        lockstep_stats.skipped++;
+        break;
+    case PHASE_INTERPRETED:
+        if (lockstep_stats.diverged++ < LOCKSTEP_MAX_REPORTS)
+            gui_debug_printf("Lockstep: block at %08x faulted at %08x only when interpreted\n", block_pc, arm.reg[15]);
+        break;
+    case PHASE_SEARCH:
+        // Go on with the results of the interpreter
+        undo(translated_writes);
+        redo(interpreted_writes, 0, steps);
+        finish();
+        break;
+    }
+    phase = PHASE_NONE;
+}
+
+#else
+
+void lockstep_record_write(void *ptr, uint32_t value, int size) {
+    (void) ptr;
+    (void) value;
+    (void) size;
+}
+
+void lockstep_enter(void *ptr) {
+    (void) ptr;
+}
+
+void lockstep_cancel() {
+    lockstep_recording = false;
+}
+
+#endif
+
+bool lockstep_enable(bool enable) {
+    if (enable && fastmem_base) {
+        gui_debug_printf("Lockstep testing doesn't work with fastmem.\n");
+        return false;
+    }
+    lockstep_enabled = enable;
+    // Writes cached in addr_cache wouldn't be recorded
+    addr_cache_flush_writes();
+    return true;
+}
+
+void lockstep_reset() {
+    memset(&lockstep_stats, 0, sizeof(lockstep_stats));
+}
+
+void lockstep_dump() {
+    gui_debug_printf("Lockstep: %llu blocks gave the same results, %llu skipped (MMIO or faults), %llu diverged\n",
+                     (unsigned long long)lockstep_stats.compared, (unsigned long long)lockstep_stats.skipped,
+                     (unsigned long long)lockstep_stats.diverged);
+}
@@ -0,0 +1,52 @@
+/* Declarations for lockstep.cpp */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lockstep testing runs each translated block twice from the same state,
+ * translated and with the interpreter, and compares the CPU state and the
+ * RAM written by both. A difference is reported with the instruction which
+ * caused it, then execution goes on with the results of the interpreter.
+ * Blocks accessing anything but RAM or faulting can't be run twice, those
+ * only run translated and get counted as skipped.
+ *
+ * While enabled, writes to RAM aren't cached in addr_cache, so that all of
+ * them go through memory_write_* and get recorded. Fastmem can't be used.
+ * Enabled by the debugger command "lockstep on" or firebird-headless
+ * --lockstep, which exits with status 1 if any block diverged. */
+extern bool lockstep_enabled;
+// Whether memory_write_* has to call lockstep_record_write
+extern bool lockstep_recording;
+// Set by accesses to anything but RAM while recording
+extern bool lockstep_io;
+
+struct lockstep_stats {
+    uint64_t compared;  // Blocks which gave the same results both ways
+    uint64_t skipped;   // Blocks which accessed MMIO or faulted
+    uint64_t diverged;  // Blocks which didn't
+};
+extern struct lockstep_stats lockstep_stats;
+
+// Returns false if it can't be enabled now
+bool lockstep_enable(bool enable);
+// Used instead of translation_enter while enabled, ptr points to the current instruction
+void lockstep_enter(void *ptr);
+// Called by memory_write_* before writing value to ptr
+void lockstep_record_write(void *ptr, uint32_t value, int size);
+// Called when an exception or error leaves the current run
+void lockstep_cancel();
+void lockstep_reset();
+void lockstep_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,6 +4,7 @@
 #define _H_TRANSLATE
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -26,6 +27,61 @@ void flush_translations();
 void invalidate_translation(int index);
 void translate_fix_pc();
 
+// Counters of the translation cache, shown by the debugger
+struct translation_stats {
+    uint64_t translations;     // Blocks translated
+    uint64_t evictions;        // Blocks thrown out to make space for new ones
+    uint64_t flushes;          // Whole cache flushed because it was full
+    uint64_t flushes_avoided;  // MMU changes which didn't need a flush
+    uint64_t remaps;           // Blocks dropped because their code moved to another virtual address
+    uint64_t page_crossings;   // Blocks continued into the next 1 KB page
+    uint64_t fastmem_patches;  // Fastmem accesses turned into calls of the memory access functions
+    uint64_t background;       // Blocks translated by the worker thread
+    uint64_t background_stale; // Blocks from the worker thread dropped as their code changed meanwhile
+    size_t code_size, code_size_peak;         // Bytes of code in use
+    uint32_t live_translations, live_peak;     // Blocks in use
+};
+extern struct translation_stats translation_stats;
+
+// Where a translation starts, saved in snapshots to translate it again right after resuming
+struct translation_entry {
+    uint32_t phys_addr;
+    uint32_t pc;        // Virtual address, bit 0 set for THUMB
+};
+
+#if defined(__x86_64__)
+// THUMB code can be translated as well
+#define TRANSLATION_HAS_THUMB 1
+void translate_thumb(uint32_t start_pc, uint16_t *insnp);
+// Translations are only entered at the virtual address they were done for,
+// so they survive changes of the MMU state
+#define TRANSLATION_CHECKS_PC 1
+// Whether the translation flagged at ptr covers it and was done for the given
+// state and virtual address pc. If not for pc, the translation is dropped.
+bool translation_can_enter(void *ptr, uint32_t pc, bool thumb);
+// Fills entries with up to max live translations, returns how many
+size_t translation_entries(struct translation_entry *entries, size_t max);
+// Translates the given entries which aren't translated yet
+void translate_warm_start(const struct translation_entry *entries, size_t count);
+// Turns the fastmem access faulting at rip into a call of the memory access
+// function, returns where to continue or NULL if it's no fastmem access
+void *translate_fastmem_fallback(void *rip);
+// Set by the worker thread when it translated a block, see translate_background_done
+extern bool translation_background_done;
+// Whether the interpreter should call translate_background_publish
+static inline bool translate_background_done() { return __atomic_load_n(&translation_background_done, __ATOMIC_ACQUIRE); }
+// Enters the block translated by the worker thread and gives it the next one
+void translate_background_publish();
+#else
+#define TRANSLATION_HAS_THUMB 0
+#define TRANSLATION_CHECKS_PC 0
+static inline bool translation_can_enter(void *ptr, uint32_t pc, bool thumb) { (void) ptr; (void) pc; (void) thumb; return true; }
+static inline size_t translation_entries(struct translation_entry *entries, size_t max) { (void) entries; (void) max; return 0; }
+static inline void translate_warm_start(const struct translation_entry *entries, size_t count) { (void) entries; (void) count; }
+static inline bool translate_background_done() { return false; }
+static inline void translate_background_publish() {}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -79,6 +79,7 @@ uint32_t *jump_table[MAX_TRANSLATIONS*2],
          **jump_table_current = jump_table;
 static constexpr size_t JUMP_TABLE_CAPACITY = sizeof(jump_table) / sizeof(jump_table[0]);
 static unsigned int next_translation_index = 0;
+struct translation_stats translation_stats;
 
 static void emit(const uint32_t instruction)
 {
@@ -227,12 +228,22 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	if(next_translation_index >= MAX_TRANSLATIONS)
 	{
 		warn("Out of translation slots!");
+		flush_translations();
+		translation_stats.flushes++;
+		return;
+	}
+	if(size_t((translate_current + 0x100) - translate_buffer) > (INSN_BUFFER_SIZE / sizeof(*translate_buffer)))
+	{
+		warn("Out of translation space!");
+		flush_translations();
+		translation_stats.flushes++;
 		return;
 	}
 	if((size_t)(jump_table_current - jump_table) + 0x100 > JUMP_TABLE_CAPACITY)
 	{
 		warn("Out of jump table space!");
 		flush_translations();
+		translation_stats.flushes++;
 		return;
 	}
 
@@ -317,11 +328,36 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 						goto instruction_translated;
 					}
 
-					goto unimpl; // UMULL, UMLAL, SMULL, SMLAL not implemented
+					if ((i.raw & 0xF8000F0) == 0x0800090)
+					{
+						// UMULL, UMLAL, SMULL, SMLAL
+						if (i.mult.rdlo == i.mult.rdhi)
+							goto unimpl;
+
+						uint32_t instruction = (i.raw & (1 << 22)) ? 0x9B200000 : 0x9BA00000; // smaddl/umaddl x0, w0, w0, x0
+						instruction |= (mapreg(i.mult.rs) << 16) | (mapreg(i.mult.rm) << 5) | X0;
+						if (i.mult.a)
+						{
+							// Accumulator into x1
+							emit_mov_reg(W1, mapreg(i.mult.rdlo));
+							emit(0xAA008021 | (mapreg(i.mult.rdhi) << 16)); // orr x1, x1, xhi, lsl #32
+							instruction |= X1 << 10;
+						}
+						else
+							instruction |= X31 << 10;
+
+						emit(instruction);
+						emit_mov_reg(mapreg(i.mult.rdlo), W0);
+						emit(0xd360fc00); // lsr x0, x0, #32
+						emit_mov_reg(mapreg(i.mult.rdhi), W0);
+						goto instruction_translated;
+					}
+
+					goto unimpl;
 				}
 
-				if (i.mem_proc2.s || !i.mem_proc2.h)
-					goto unimpl; // Signed byte/halfword and doubleword not implemented
+				if (!i.mem_proc2.l && i.mem_proc2.s)
+					goto unimpl; // Doubleword not implemented
 
 				if (i.mem_proc2.rn == PC || i.mem_proc2.rd == PC || i.mem_proc2.rm == PC)
 					goto unimpl; // PC as operand or dest. not implemented
@@ -358,8 +394,21 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 
 				if (i.mem_proc2.l)
 				{
-					emit_call(reinterpret_cast<void *>(read_half_asm));
-					emit_mov_reg(mapreg(i.mem_proc2.rd), W0);
+					if (!i.mem_proc2.s) // LDRH
+					{
+						emit_call(reinterpret_cast<void *>(read_half_asm));
+						emit_mov_reg(mapreg(i.mem_proc2.rd), W0);
+					}
+					else if (!i.mem_proc2.h) // LDRSB
+					{
+						emit_call(reinterpret_cast<void *>(read_byte_asm));
+						emit(0x13001c00 | mapreg(i.mem_proc2.rd)); // sxtb wd, w0
+					}
+					else // LDRSH
+					{
+						emit_call(reinterpret_cast<void *>(read_half_asm));
+						emit(0x13003c00 | mapreg(i.mem_proc2.rd)); // sxth wd, w0
+					}
 				}
 				else
 				{
@@ -832,6 +881,13 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	this_translation->unused = reinterpret_cast<uintptr_t>(translate_current);
 
 	next_translation_index += 1;
+	translation_stats.translations++;
+	translation_stats.live_translations = next_translation_index;
+	if(translation_stats.live_translations > translation_stats.live_peak)
+		translation_stats.live_peak = translation_stats.live_translations;
+	translation_stats.code_size = (translate_current - translate_buffer) * sizeof(uint32_t);
+	if(translation_stats.code_size > translation_stats.code_size_peak)
+		translation_stats.code_size_peak = translation_stats.code_size;
 
 	// Flush the instruction cache
 	#ifdef IS_IOS_BUILD
@@ -869,6 +925,8 @@ void flush_translations()
 	next_translation_index = 0;
 	translate_current = translate_buffer;
 	jump_table_current = jump_table;
+	translation_stats.code_size = 0;
+	translation_stats.live_translations = 0;
 }
 
 void invalidate_translation(int index)
@@ -0,0 +1,307 @@
+#include <string.h>
+
+#include "cpu/translate_analysis.h"
+#include "memory/mem.h"
+
+// Flags read by each condition code
+static const uint8_t cond_flags[16] = {
+    BA_FLAG_Z, BA_FLAG_Z, BA_FLAG_C, BA_FLAG_C, BA_FLAG_N, BA_FLAG_N, BA_FLAG_V, BA_FLAG_V,
+    BA_FLAG_C | BA_FLAG_Z, BA_FLAG_C | BA_FLAG_Z, BA_FLAG_N | BA_FLAG_V, BA_FLAG_N | BA_FLAG_V,
+    BA_FLAG_N | BA_FLAG_Z | BA_FLAG_V, BA_FLAG_N | BA_FLAG_Z | BA_FLAG_V, 0, BA_FLAGS_ALL
+};
+
+// Pointer to the word at the virtual address addr, if it's in the page of the block
+static void *ba_literal_ptr(const struct ba_block *block, uint32_t addr) {
+    if (((addr ^ block->pc) & ~0x3FF) || (addr & 3))
+        return NULL;
+    return (uint8_t *)block->ptr + (int32_t)(addr - block->pc);
+}
+
+// Marks a branch-like instruction, which doesn't go on to the next one if it always runs
+static void ba_leave_block(struct ba_insn *info, bool always) {
+    info->attrs |= BA_ENDS;
+    if (always)
+        info->attrs |= BA_NO_FALLTHROUGH;
+}
+
+// Flags used by ARM data processing, like the translators set them
+static void ba_decode_arm_data(struct ba_insn *info, uint32_t insn, bool always) {
+    int op = insn >> 21 & 15;
+    bool logical = 0xF303 >> op & 1;
+    int written = BA_FLAG_N | BA_FLAG_Z;
+    if (!logical)
+        written |= BA_FLAG_C | BA_FLAG_V;
+    if (op == 5 || op == 6 || op == 7)
+        info->flags_read |= BA_FLAG_C; // ADC, SBC, RSC
+
+    if (insn & (1 << 25)) {
+        // Rotated immediates set the carry in logical operations
+        if (logical && (insn & 0xF00))
+            written |= BA_FLAG_C;
+    } else if (!(insn & (1 << 4))) {
+        int shift_type = insn >> 5 & 3;
+        int count = insn >> 7 & 31;
+        if (count == 0 && shift_type == 3)
+            info->flags_read |= BA_FLAG_C; // RRX
+        else if (logical && (insn & 15) != 15 && (count != 0 || shift_type != 0))
+            written |= BA_FLAG_C;
+    }
+    // Shifts by register leave the carry alone if the count is 0
+
+    if ((insn & (1 << 20)) && always)
+        info->flags_written = written;
+}
+
+static void ba_decode_arm(const struct ba_block *block, struct ba_insn *info, uint32_t insn, uint32_t pc) {
+    int cond = insn >> 28;
+    bool always = cond == 0xE;
+    int rd = insn >> 12 & 15;
+    info->flags_read = cond_flags[cond];
+    if (cond == 0xF) {
+        if ((insn & 0xE000000) == 0xA000000)
+            info->attrs |= BA_ENDS; // BLX
+        return;
+    }
+
+    switch (insn >> 25 & 7) {
+        case 0: case 1:
+            if ((insn & 0xE000090) == 0x0000090) {
+                if ((insn & 0xFC000F0) == 0x0000090 || (insn & 0xF8000F0) == 0x0800090) {
+                    // Multiplies set N and Z
+                    if ((insn & (1 << 20)) && always)
+                        info->flags_written = BA_FLAG_N | BA_FLAG_Z;
+                } else {
+                    // SWP, halfword and doubleword loads and stores
+                    info->flags_read = BA_FLAGS_ALL;
+                    if (!(insn & (1 << 20)) || (insn & 0x60) == 0)
+                        info->attrs |= BA_STORE;
+                    else if (rd == 15)
+                        ba_leave_block(info, always);
+                }
+            } else if ((insn & 0xD900000) == 0x1000000) {
+                // Miscellaneous instructions, like MRS/MSR and BX
+                info->flags_read = BA_FLAGS_ALL;
+                if ((insn & 0xFFFFFD0) == 0x12FFF10)
+                    ba_leave_block(info, always && !(insn & 0x20));
+            } else if (rd == 15 && (insn & 0x1800000) != 0x1000000) {
+                info->flags_read = BA_FLAGS_ALL;
+                ba_leave_block(info, always);
+            } else {
+                ba_decode_arm_data(info, insn, always);
+            }
+            break;
+        case 2: case 3:
+            info->flags_read = BA_FLAGS_ALL;
+            if (!(insn & (1 << 20)))
+                info->attrs |= BA_STORE;
+            else if (rd == 15)
+                ba_leave_block(info, always);
+            else if ((insn & 0x0F7F0000) == 0x051F0000) // LDR Rd, [PC, #imm]
+                info->literal = ba_literal_ptr(block, pc + 8 + ((insn & (1 << 23)) ? (insn & 0xFFF) : -(insn & 0xFFF)));
+            break;
+        case 4:
+            info->flags_read = BA_FLAGS_ALL;
+            if (!(insn & (1 << 20)))
+                info->attrs |= BA_STORE;
+            else if (insn & (1 << 15))
+                ba_leave_block(info, always);
+            break;
+        case 5:
+            info->flags_read = BA_FLAGS_ALL;
+            ba_leave_block(info, always && !(insn & (1 << 24)));
+            break;
+        default:
+            info->flags_read = BA_FLAGS_ALL;
+            if ((insn & 0xF000000) == 0xF000000)
+                ba_leave_block(info, false); // SWI
+            else
+                info->attrs |= BA_STORE; // Coprocessor, may be STC
+            break;
+    }
+}
+
+static void ba_decode_thumb(const struct ba_block *block, struct ba_insn *info, uint16_t insn, uint32_t pc) {
+    switch (insn >> 11) {
+        case 0x00: case 0x01: case 0x02: // LSL/LSR/ASR Rd, Rm, #imm
+            info->flags_written = (insn >> 6 & 31) ? BA_FLAG_N | BA_FLAG_Z | BA_FLAG_C : BA_FLAG_N | BA_FLAG_Z;
+            break;
+        case 0x03: // ADD/SUB Rd, Rn, Rm/#imm
+        case 0x05: case 0x06: case 0x07: // CMP/ADD/SUB Rd, #imm
+            info->flags_written = BA_FLAGS_ALL;
+            break;
+        case 0x04: // MOV Rd, #imm
+            info->flags_written = BA_FLAG_N | BA_FLAG_Z;
+            break;
+        case 0x08:
+            if (insn < 0x4400) {
+                switch (insn >> 6 & 15) {
+                    case 0x5: case 0x6: // ADC, SBC
+                        info->flags_read = BA_FLAG_C;
+                        info->flags_written = BA_FLAGS_ALL;
+                        break;
+                    case 0x9: case 0xA: case 0xB: // NEG, CMP, CMN
+                        info->flags_written = BA_FLAGS_ALL;
+                        break;
+                    default: // Shifts by register leave the carry alone for 0
+                        info->flags_written = BA_FLAG_N | BA_FLAG_Z;
+                        break;
+                }
+            } else if ((insn & 0xFF00) == 0x4500) { // CMP with high registers
+                info->flags_written = BA_FLAGS_ALL;
+            } else if ((insn & 0xFF00) == 0x4700) { // BX, BLX
+                info->flags_read = BA_FLAGS_ALL;
+                ba_leave_block(info, !(insn & 0x80));
+            } else if ((insn & 0x87) == 0x87) { // ADD/MOV to PC
+                info->flags_read = BA_FLAGS_ALL;
+                ba_leave_block(info, true);
+            }
+            break;
+        case 0x09: // LDR Rd, [PC, #imm]
+            info->flags_read = BA_FLAGS_ALL;
+            info->literal = ba_literal_ptr(block, ((pc + 4) & ~3) + ((insn & 0xFF) << 2));
+            break;
+        case 0x14: case 0x15: // ADD Rd, PC/SP, #imm
+        case 0x1E: // First half of BL
+            break;
+        case 0x16: case 0x17:
+            if ((insn & 0xFF00) == 0xB000)
+                break; // Adjust SP
+            info->flags_read = BA_FLAGS_ALL;
+            if ((insn & 0xFE00) == 0xB400)
+                info->attrs |= BA_STORE; // PUSH
+            else if ((insn & 0xFF00) == 0xBD00)
+                ba_leave_block(info, true); // POP with PC
+            else if ((insn & 0xFF00) == 0xBE00)
+                ba_leave_block(info, false); // BKPT
+            break;
+        case 0x1A: case 0x1B: // Conditional branch, SWI
+        case 0x1D: case 0x1F: // Second half of BL
+            info->flags_read = BA_FLAGS_ALL;
+            ba_leave_block(info, false);
+            break;
+        case 0x1C: // B
+            info->flags_read = BA_FLAGS_ALL;
+            ba_leave_block(info, true);
+            break;
+        case 0x0A: case 0x0B: // Loads and stores with register offset
+            info->flags_read = BA_FLAGS_ALL;
+            if ((insn >> 9 & 7) < 3)
+                info->attrs |= BA_STORE;
+            break;
+        default: // Loads and stores with immediate offset, LDMIA/STMIA
+            info->flags_read = BA_FLAGS_ALL;
+            if (!(insn & (1 << 11)))
+                info->attrs |= BA_STORE;
+            break;
+    }
+}
+
+/* Finds the flag updates which get overwritten before anything reads them.
+ * All flags have to be stored when leaving the block, which is also what
+ * reading all of them means. */
+static void ba_pass_dead_flags(struct ba_block *block) {
+    int live = BA_FLAGS_ALL;
+    for (int i = block->count - 1; i >= 0; i--) {
+        struct ba_insn *info = &block->insns[i];
+        info->flags_dead = info->flags_written & ~live;
+        live = (live & ~info->flags_written) | info->flags_read;
+    }
+}
+
+/* Folds PC-relative loads into constants, if the literal is in a pool right
+ * after the block, which doesn't fall through into it. The translation then
+ * flags the words in literals as well, so that writing one invalidates
+ * it. Words which ran as code before are no literals. Repeated loads of
+ * the same literal all go away.
+ * A translation can't be invalidated while it runs, so blocks which may
+ * write to memory themselves are left alone. */
+static void ba_pass_literals(struct ba_block *block) {
+    block->literals = 0;
+    bool stores = false;
+    for (int i = 0; i < block->count; i++) {
+        block->insns[i].attrs &= ~BA_CONSTANT;
+        stores |= block->insns[i].attrs & BA_STORE;
+    }
+    if (!block->count || stores || !(block->insns[block->count - 1].attrs & BA_NO_FALLTHROUGH))
+        return;
+
+    int insn_size = block->thumb ? 2 : 4;
+    uint8_t *end = (uint8_t *)block->ptr + block->count * insn_size;
+    uint32_t *pool = (uint32_t *)(((uintptr_t)end + 3) & ~3);
+    uint32_t *page_end = (uint32_t *)((uint8_t *)block->ptr + 0x400 - (block->pc & 0x3FF));
+    uint32_t *pool_end = pool;
+    while (pool_end < page_end && pool_end - pool < BA_MAX_POOL_WORDS
+           && !(block->insn_flags(pool_end) & (DONT_TRANSLATE | RF_CODE_EXECUTED)))
+        pool_end++;
+
+    for (int i = 0; i < block->count; i++) {
+        struct ba_insn *info = &block->insns[i];
+        uint32_t *literal = info->literal;
+        if (literal < pool || literal >= pool_end)
+            continue;
+        info->attrs |= BA_CONSTANT;
+        info->value = *literal;
+        block->literals |= 1ull << (literal - pool);
+    }
+}
+
+static void ba_run_passes(struct ba_block *block) {
+    ba_pass_dead_flags(block);
+    ba_pass_literals(block);
+}
+
+void ba_build(struct ba_block *block, uint32_t pc, void *ptr, bool thumb, int max_count,
+              uint32_t (*insn_flags)(void *ptr)) {
+    block->pc = pc;
+    block->ptr = ptr;
+    block->thumb = thumb;
+    block->insn_flags = insn_flags;
+    if (max_count > BA_MAX_INSNS)
+        max_count = BA_MAX_INSNS;
+
+    int count = 0;
+    uint8_t *p = ptr;
+    while (count < max_count && !((pc ^ block->pc) & ~0x3FF)) {
+        // Flags are per word, the translator looks at them at its start
+        if ((!thumb || !(pc & 2)) && (insn_flags(p) & DONT_TRANSLATE))
+            break;
+        struct ba_insn *info = &block->insns[count++];
+        memset(info, 0, sizeof(*info));
+        if (thumb) {
+            ba_decode_thumb(block, info, *(uint16_t *)p, pc);
+            pc += 2;
+            p += 2;
+        } else {
+            ba_decode_arm(block, info, *(uint32_t *)p, pc);
+            pc += 4;
+            p += 4;
+        }
+        if (info->attrs & BA_ENDS)
+            break;
+    }
+    block->count = count;
+    ba_run_passes(block);
+}
+
+bool ba_truncate(struct ba_block *block, int count) {
+    if (count >= block->count)
+        return false;
+
+    /* The flags of the last instruction are stored when the translation
+     * stops, the others must have been left out the same way. Cut short,
+     * the block doesn't end with a branch anymore, so there are no
+     * literals to fold. */
+    bool changed = false;
+    int live = BA_FLAGS_ALL;
+    for (int i = count - 1; i >= 0; i--) {
+        struct ba_insn *info = &block->insns[i];
+        if (i < count - 1 && (info->flags_written & ~live) != info->flags_dead)
+            changed = true;
+        if (info->attrs & BA_CONSTANT)
+            changed = true;
+        live = (live & ~info->flags_written) | info->flags_read;
+    }
+    block->count = count;
+    ba_run_passes(block);
+    return changed;
+}
@@ -0,0 +1,86 @@
+/* Declarations for translate_analysis.c */
+
+#ifndef TRANSLATE_ANALYSIS_H
+#define TRANSLATE_ANALYSIS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Analysis of the guest instructions of a block in a single 1 KB page for
+ * the x86_64 translator, done before translating them. Each instruction is
+ * summarized by the flags it reads and writes, whether it leaves the block
+ * or stores, and the literal it loads. Two passes over that find what the
+ * translator can leave out: flag updates which get overwritten before
+ * anything reads them, and loads of PC-relative literals which can be
+ * folded into constants. The translator looks up the results by the
+ * position of the instruction in the block.
+ *
+ * The results only hold if the block really ends where the analysis does.
+ * If the translator stops earlier, ba_truncate tells whether it has to
+ * start over. */
+
+// Each page has at most 512 THUMB instructions
+#define BA_MAX_INSNS 512
+// Literal pools longer than this aren't looked at
+#define BA_MAX_POOL_WORDS 64
+
+enum { BA_FLAG_N = 1, BA_FLAG_Z = 2, BA_FLAG_C = 4, BA_FLAG_V = 8, BA_FLAGS_ALL = 15 };
+
+enum {
+    BA_ENDS = 1,            // The block ends after it, like after a branch
+    BA_NO_FALLTHROUGH = 2,  // Never goes on to the next instruction
+    BA_STORE = 4,           // May write to memory
+    BA_CONSTANT = 8,        // Loads value, found by ba_pass_literals
+};
+
+struct ba_insn {
+    uint8_t flags_read;     // Flags it reads, all of them if it can leave the block
+    uint8_t flags_written;  // Flags it overwrites whenever it runs
+    uint8_t flags_dead;     // Flags it writes which get overwritten before anything reads them
+    uint8_t attrs;          // BA_*
+    void *literal;          // Word loaded by a PC-relative load in the same page, or NULL
+    uint32_t value;
+};
+
+struct ba_block {
+    uint32_t pc;
+    void *ptr;
+    bool thumb;
+    int count;
+    /* The words after the block which were folded into constants: bit n
+     * for the nth word from the end of the block, rounded up to a word */
+    uint64_t literals;
+    // Returns the RAM_FLAGS of the word at ptr, as the translator sees them
+    uint32_t (*insn_flags)(void *ptr);
+    struct ba_insn insns[BA_MAX_INSNS];
+};
+
+/* Analyzes the block at pc, ptr: up to the end of the page, the
+ * first instruction ending the block or with DONT_TRANSLATE flags, or
+ * after max_count instructions. */
+void ba_build(struct ba_block *block, uint32_t pc, void *ptr, bool thumb, int max_count,
+              uint32_t (*insn_flags)(void *ptr));
+/* Cuts the block after count instructions, where the translation stopped.
+ * Returns whether that changes what the instructions before could leave
+ * out, so that they have to be translated again. */
+bool ba_truncate(struct ba_block *block, int count);
+
+// Flags which the instruction at index can leave out, 0 if it isn't in the block
+static inline int ba_flags_dead(const struct ba_block *block, int index) {
+    return index >= 0 && index < block->count ? block->insns[index].flags_dead : 0;
+}
+
+// Whether the instruction at index loads the constant insns[index].value
+static inline bool ba_constant(const struct ba_block *block, int index) {
+    return index >= 0 && index < block->count && (block->insns[index].attrs & BA_CONSTANT);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -57,6 +57,7 @@ uint32_t *translate_buffer = nullptr,
 #include "jit/literalpool.h"
 
 static unsigned int next_translation_index = 0;
+struct translation_stats translation_stats;
 
 static inline void emit(uint32_t instruction)
 {
@@ -508,6 +509,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
     {
         gui_debug_printf("Out of translation slots!");
         flush_translations();
+        translation_stats.flushes++;
         return;
     }
 
@@ -515,12 +517,14 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
     {
         gui_debug_printf("Out of translation space!");
         flush_translations();
+        translation_stats.flushes++;
         return;
     }
     if((size_t)(jump_table_current - jump_table) + 0x100 > JUMP_TABLE_CAPACITY)
     {
         gui_debug_printf("Out of jump table space!");
         flush_translations();
+        translation_stats.flushes++;
         return;
     }
 
@@ -1134,6 +1138,13 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 
     // This effectively flushes this_translation, as it won't get used next time
     next_translation_index += 1;
+    translation_stats.translations++;
+    translation_stats.live_translations = next_translation_index;
+    if(translation_stats.live_translations > translation_stats.live_peak)
+        translation_stats.live_peak = translation_stats.live_translations;
+    translation_stats.code_size = (translate_current - translate_buffer) * sizeof(uint32_t);
+    if(translation_stats.code_size > translation_stats.code_size_peak)
+        translation_stats.code_size_peak = translation_stats.code_size;
 
     // Flush the instruction cache
 #ifdef IS_IOS_BUILD
@@ -1167,6 +1178,8 @@ void flush_translations()
     next_translation_index = 0;
     translate_current = translate_buffer;
     jump_table_current = jump_table;
+    translation_stats.code_size = 0;
+    translation_stats.live_translations = 0;
 }
 
 void invalidate_translation(int index)
@@ -23,6 +23,7 @@ uint8_t *insn_buffer = NULL;
 uint8_t *insn_bufptr = NULL;
 static uint8_t *jtbl_buffer[500000];
 static uint8_t **jtbl_bufptr = jtbl_buffer;
+struct translation_stats translation_stats;
 static uint8_t *out;
 static uint8_t **outj;
 
@@ -253,21 +254,25 @@ void translate_deinit()
 }
 
 void translate(uint32_t start_pc, uint32_t *start_insnp) {
-    out = insn_bufptr;
-    outj = jtbl_bufptr;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
+    // Only called outside of translated code, so everything can go if full
+    if (next_index >= MAX_TRANSLATIONS
+        || insn_bufptr >= &insn_buffer[INSN_BUFFER_SIZE - 1000]
+        || jtbl_bufptr >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer]) {
+        flush_translations();
+        translation_stats.flushes++;
+    }
+    out = insn_bufptr;
+    outj = jtbl_bufptr;
 
     uint8_t *insn_start;
     int stop_here = 0;
     while (1) {
-        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000])
-            error("Out of instruction space");
-        if (outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
-            error("Out of jump table space");
+        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000]
+            || outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
+            goto branch_conditional;
 
         insn_start = out;
 
@@ -954,6 +959,13 @@ branch_unconditional:
     insn_bufptr = out;
     jtbl_bufptr = outj;
 
+    translation_stats.translations++;
+    translation_stats.live_translations = next_index;
+    if (translation_stats.live_translations > translation_stats.live_peak)
+        translation_stats.live_peak = translation_stats.live_translations;
+    translation_stats.code_size = insn_bufptr - insn_buffer;
+    if (translation_stats.code_size > translation_stats.code_size_peak)
+        translation_stats.code_size_peak = translation_stats.code_size;
     return;
 }
 
@@ -968,6 +980,8 @@ void flush_translations() {
     next_index = 0;
     insn_bufptr = insn_buffer;
     jtbl_bufptr = jtbl_buffer;
+    translation_stats.code_size = 0;
+    translation_stats.live_translations = 0;
 }
 
 void invalidate_translation(int index) {
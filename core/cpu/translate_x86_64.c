@@ -1,29 +1,100 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "emu.h"
+#include "memory/fastmem.h"
 #include "memory/mem.h"
+#include "memory/mmu.h"
 #include "cpu/cpu.h"
 #include "jit/asmcode.h"
+#include "jit/perf_map.h"
 #include "cpu/translate.h"
+#include "cpu/fallback_stats.h"
+#include "cpu/lockstep.h"
+#include "cpu/translate_analysis.h"
 #include "debug.h"
 #include "os/os.h"
 
 extern void translation_next() __asm__("translation_next");
 extern void translation_next_bx() __asm__("translation_next_bx");
+extern void translation_next_thumb() __asm__("translation_next_thumb");
 extern uintptr_t arm_shift_proc[2][4] __asm__("arm_shift_proc");
 void **in_translation_rsp __asm__("in_translation_rsp");
 void *in_translation_pc_ptr __asm__("in_translation_pc_ptr");
 
 #define MAX_TRANSLATIONS 262144
 struct translation translation_table[MAX_TRANSLATIONS];
+// Nonzero if the translation with that index is of THUMB code.
+// Its start_ptr and end_ptr are then halfword pointers.
+uint8_t translation_thumb[MAX_TRANSLATIONS] __asm__("translation_thumb");
+// Code to load the cached registers of the translation and then jump to %rcx
+void *translation_loader[MAX_TRANSLATIONS] __asm__("translation_loader");
+// Virtual address the translation was done for. The code is found by its
+// physical address, so this is checked before entering.
+uint32_t translation_pc[MAX_TRANSLATIONS] __asm__("translation_pc");
 
 static int next_index = 0;
+// Indices below next_index of invalidated translations, to be reused
+static int free_indices[MAX_TRANSLATIONS];
+static int free_index_count = 0;
+struct translation_stats translation_stats;
 uint8_t *insn_buffer = NULL;
 uint8_t *insn_bufptr = NULL;
-static uint8_t *jtbl_buffer[500000];
-static uint8_t **jtbl_bufptr = jtbl_buffer;
-static uint8_t *out;
-static uint8_t **outj;
+// Per thread, as the worker thread translates while the emulation thread patches code
+static __thread uint8_t *out;
+// Space found by code_alloc_begin
+static uint8_t *out_start, *out_limit;
+
+/* A block translated by the worker thread, see background_queue_block.
+ * Its words are flagged RF_CODE_NO_TRANSLATE from ptr up to marked_end
+ * while it waits and gets translated, a write clears that again. */
+struct background_job {
+    uint32_t pc;
+    void *ptr, *marked_end;
+    bool thumb;
+    bool stale;     // Part of it got marked again after a write
+    // Taken when the worker gets the job
+    int index;
+    uint8_t *code_start;
+    // Set by the worker
+    void *end_ptr, *no_translate_ptr;
+    uint64_t literals;
+    enum block_end end_reason;
+    void **jump_table;
+    uint8_t *code_end;
+};
+// The job the worker thread translates, NULL on the emulation thread
+static __thread struct background_job *worker_job;
+
+/* A block normally ends with its 1 KB page, but goes on into the next one
+ * if that's where its code runs next, see superblock_can_continue. */
+#define SUPERBLOCK_MAX_PAGES 4
+// Each page has at most 512 THUMB instructions
+#define MAX_BLOCK_INSNS (SUPERBLOCK_MAX_PAGES * 512)
+
+/* Jump tables are collected here during translation and then put after
+ * the translated code, so that a translation occupies a single area of
+ * insn_buffer, which is reused after the translation gets invalidated. */
+static void *jtbl_scratch[MAX_BLOCK_INSNS];
+static void **outj;
+
+// Upper bound of the code emitted for a single instruction
+#define MAX_INSN_CODE_SIZE 1000
+
+/* Areas of insn_buffer below insn_bufptr freed by invalidated translations,
+ * sorted by address. Adjacent holes are merged. */
+struct code_hole { uint8_t *start, *end; };
+static struct code_hole *code_holes = NULL;
+static int code_hole_count = 0, code_hole_capacity = 0;
+// Smaller holes aren't worth starting a translation in
+#define MIN_CODE_HOLE_SIZE 0x800
+
+/* If insn_buffer or the translation indices run out, the translations in
+ * the next part of insn_buffer get evicted, going round the buffer. */
+#define EVICT_SIZE (INSN_BUFFER_SIZE / 8)
+static uint8_t *evict_ptr = NULL;
 
 #define REG_ARG1 EDI
 #define REG_ARG2 ESI
@@ -58,25 +129,36 @@ void got_init(void *start, size_t size)
     got_end = got_start + (size / sizeof(*got_start));
 }
 
+static pthread_mutex_t got_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Finds or puts value in the GOT and returns the location of the entry. */
 uintptr_t got_entry(uintptr_t value)
 {
+    // Both the worker thread and the emulation thread emit code
+    pthread_mutex_lock(&got_mutex);
+
     // Is the address in the GOT already?
     for(uintptr_t *entry = got_start; entry < got_tail; ++entry)
     {
         if(*entry == value)
+        {
+            pthread_mutex_unlock(&got_mutex);
             return (uintptr_t) entry;
+        }
     }
 
     // Add a new entry
     if(got_tail == got_end)
     {
+        pthread_mutex_unlock(&got_mutex);
         error("GOT full, please increase the size");
         return (uintptr_t) NULL;
     }
 
     *got_tail = value;
-    return (uintptr_t) got_tail++;
+    uintptr_t entry = (uintptr_t) got_tail++;
+    pthread_mutex_unlock(&got_mutex);
+    return entry;
 }
 
 /*This is a hack:
@@ -155,9 +237,162 @@ static void emit_modrm_base_offset(int r, int basex86reg, int offset) {
     }
 }
 
+/* ARM registers used often in a translation are kept in host registers
+ * r12-r15 during all of it. Every entry into the translation goes through
+ * its loader, which loads them from arm.reg. They're written back before
+ * leaving the translation and before calling anything that could look at
+ * arm.reg, like the memory access functions, which may cause an abort. */
+#define REG_CACHE_COUNT 4
+// Host register holding the ARM register, or -1
+static int8_t reg_cache[15];
+// Cached registers possibly modified since they were last written back
+static uint16_t reg_dirty;
+
+static inline bool armreg_cached(int armreg) {
+    return armreg >= 0 && armreg < 15 && reg_cache[armreg] >= 0;
+}
+
+// Emits the REX prefix needed for a cached register, before the opcode
+static inline void emit_rex_armreg(int armreg) {
+    if (armreg_cached(armreg))
+        emit_byte(0x41); // REX.B
+}
+
 static void emit_modrm_armreg(int r, int armreg) {
     if (armreg < 0 || armreg > 14) error("translation f***up");
-    emit_modrm_base_offset(r, EBX, (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm);
+    if (reg_cache[armreg] >= 0)
+        emit_modrm_x86reg(r, reg_cache[armreg] & 7);
+    else
+        emit_modrm_base_offset(r, EBX, (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm);
+}
+
+/* Identifies the register assignment. Two translations with the same one
+ * can jump to each other without going through the loader. */
+static uint32_t reg_cache_key() {
+    uint32_t key = 0;
+    for (int armreg = 0; armreg < 15; armreg++) {
+        if (reg_cache[armreg] >= 0)
+            key |= (armreg + 1) << (reg_cache[armreg] - 12) * 4;
+    }
+    return key;
+}
+
+static void emit_reg_writeback() {
+    for (int armreg = 0; armreg < 15; armreg++) {
+        if (reg_cache[armreg] < 0 || !(reg_dirty >> armreg & 1))
+            continue;
+        emit_byte(0x44); // REX.R
+        emit_byte(0x89);
+        emit_modrm_base_offset(reg_cache[armreg] & 7, EBX, (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm);
+    }
+    reg_dirty = 0;
+}
+
+static void emit_reg_load() {
+    for (int armreg = 0; armreg < 15; armreg++) {
+        if (reg_cache[armreg] < 0)
+            continue;
+        emit_byte(0x44); // REX.R
+        emit_byte(0x8B);
+        emit_modrm_base_offset(reg_cache[armreg] & 7, EBX, (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm);
+    }
+}
+#define MAX_REG_LOADER_SIZE (REG_CACHE_COUNT * 7 + 2)
+
+/* Accesses through the fastmem window: the instruction doing the access,
+ * which follows loading fastmem_base into R8, and the asmcode function it
+ * stands for. Writes are followed by the test of the flags, see
+ * emit_fastmem_access. translate_fastmem_fallback identifies accesses by
+ * the instruction. */
+static const struct fastmem_insn {
+    uint8_t code[5];
+    uint8_t size;
+    bool write, aligned_flags;
+    void *function;
+} fastmem_insns[] = {
+    { { 0x41, 0x8B, 0x04, 0x38 },       4, false, false, (void *)read_word_asm },  // mov (%r8,%rdi), %eax
+    { { 0x41, 0x0F, 0xB7, 0x04, 0x38 }, 5, false, false, (void *)read_half_asm },  // movzwl (%r8,%rdi), %eax
+    { { 0x41, 0x0F, 0xB6, 0x04, 0x38 }, 5, false, false, (void *)read_byte_asm },  // movzbl (%r8,%rdi), %eax
+    { { 0x41, 0x89, 0x34, 0x38 },       4, true,  false, (void *)write_word_asm }, // mov %esi, (%r8,%rdi)
+    { { 0x66, 0x41, 0x89, 0x34, 0x38 }, 5, true,  true,  (void *)write_half_asm }, // mov %si, (%r8,%rdi)
+    { { 0x41, 0x88, 0x34, 0x38 },       4, true,  true,  (void *)write_byte_asm }, // mov %sil, (%r8,%rdi)
+};
+// Loading fastmem_base into R8
+#define FASTMEM_BASE_SIZE 10
+// Code between the write and the JZ over the call of fastmem_write_action_asm
+#define FASTMEM_FLAGS_TEST_SIZE(aligned) (5 + ((aligned) ? 5 : 0) + 8)
+
+/* Does the access of the asmcode function directly in the fastmem window,
+ * with the same registers: address in EDI, value in ESI, result in EAX. */
+static void emit_fastmem_access(const struct fastmem_insn *insn) {
+    if (insn->function == (void *)read_half_asm || insn->function == (void *)write_half_asm) {
+        emit_byte(0x83); // and $-2, %edi
+        emit_modrm_x86reg(AND, EDI);
+        emit_byte(-2);
+    }
+    emit_byte(0x49); // mov $fastmem_base, %r8
+    emit_byte(0xB8);
+    *(uint64_t *)out = (uintptr_t)fastmem_base; out += 8;
+    memcpy(out, insn->code, insn->size);
+    out += insn->size;
+    // With code page protection, the page wouldn't be writable
+    if (!insn->write || code_page_protection)
+        return;
+
+    // Writes which need write_action are found by the flags
+    uint8_t *flags_start = out;
+    emit_byte(0x49); // bts $32, %r8: the window is aligned, this is where the flags are
+    emit_byte(0x0F);
+    emit_byte(0xBA);
+    emit_modrm_x86reg(5, 0);
+    emit_byte(32);
+    int index = EDI;
+    if (insn->aligned_flags) {
+        emit_byte(0x89); // mov %edi, %eax
+        emit_modrm_x86reg(EDI, EAX);
+        emit_byte(0x83); // and $-4, %eax
+        emit_modrm_x86reg(AND, EAX);
+        emit_byte(-4);
+        index = EAX;
+    }
+    emit_byte(0x41); // testl $DO_WRITE_ACTION, (%r8,index)
+    emit_byte(0xF7);
+    emit_byte(0x04);
+    emit_byte(index << 3);
+    emit_dword(DO_WRITE_ACTION);
+    assert(out - flags_start == FASTMEM_FLAGS_TEST_SIZE(insn->aligned_flags));
+    emit_byte(JZ);
+    uint8_t *jz_offset = out++;
+    emit_call_nosave((uintptr_t)fastmem_write_action_asm);
+    *jz_offset = out - (jz_offset + 1);
+}
+
+// Calls one of the memory access functions in asmcode, or does it with fastmem
+static inline void emit_call_memory(uintptr_t target) {
+    emit_reg_writeback();
+    if (fastmem_base) {
+        for (unsigned int i = 0; i < sizeof(fastmem_insns) / sizeof(*fastmem_insns); i++) {
+            if (fastmem_insns[i].function == (void *)target) {
+                emit_fastmem_access(&fastmem_insns[i]);
+                return;
+            }
+        }
+    }
+    if (code_page_protection) {
+        if (target == (uintptr_t)write_word_asm)
+            target = (uintptr_t)write_word_unchecked_asm;
+        else if (target == (uintptr_t)write_half_asm)
+            target = (uintptr_t)write_half_unchecked_asm;
+        else if (target == (uintptr_t)write_byte_asm)
+            target = (uintptr_t)write_byte_unchecked_asm;
+    }
+    emit_call_nosave(target);
+}
+
+// Leaves the translation through one of the translation_next* entry points
+static inline void emit_leave(uintptr_t target) {
+    emit_reg_writeback();
+    emit_jump(target);
 }
 
 // ----------------------------------------------------------------------
@@ -183,12 +418,17 @@ static void emit_alu_x86reg_immediate(int aluop, int x86reg, int imm) {
 }
 
 static void emit_mov_armreg_immediate(int armreg, int imm) {
+    reg_dirty |= 1 << armreg;
+    emit_rex_armreg(armreg);
     emit_byte(0xC7);
     emit_modrm_armreg(0, armreg);
     emit_dword(imm);
 }
 
 static void emit_alu_armreg_immediate(int aluop, int armreg, int imm) {
+    if (aluop != CMP)
+        reg_dirty |= 1 << armreg;
+    emit_rex_armreg(armreg);
     if (imm >= -0x80 && imm < 0x80) {
         emit_byte(0x83);
         emit_modrm_armreg(aluop, armreg);
@@ -211,21 +451,28 @@ static inline void emit_alu_x86reg_x86reg(int aluop, int dest, int src) {
 }
 
 static inline void emit_mov_x86reg_armreg(int x86reg, int armreg) {
+    emit_rex_armreg(armreg);
     emit_byte(0x8B);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_alu_x86reg_armreg(int aluop, int x86reg, int armreg) {
+    emit_rex_armreg(armreg);
     emit_byte(0x03 | aluop << 3);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_mov_armreg_x86reg(int armreg, int x86reg) {
+    reg_dirty |= 1 << armreg;
+    emit_rex_armreg(armreg);
     emit_byte(0x89);
     emit_modrm_armreg(x86reg, armreg);
 }
 
 static inline void emit_alu_armreg_x86reg(int aluop, int armreg, int x86reg) {
+    if (aluop != CMP)
+        reg_dirty |= 1 << armreg;
+    emit_rex_armreg(armreg);
     emit_byte(0x01 | aluop << 3);
     emit_modrm_armreg(x86reg, armreg);
 }
@@ -236,17 +483,22 @@ static inline void emit_unary_x86reg(int unop, int x86reg) {
 }
 
 static inline void emit_unary_armreg(int unop, int armreg) {
+    if (unop == NOT || unop == NEG)
+        reg_dirty |= 1 << armreg;
+    emit_rex_armreg(armreg);
     emit_byte(0xF7);
     emit_modrm_armreg(unop, armreg);
 }
 
 static inline void emit_test_armreg_immediate(int armreg, int imm) {
+    emit_rex_armreg(armreg);
     emit_byte(0xF7);
     emit_modrm_armreg(0, armreg);
     emit_dword(imm);
 }
 
 static inline void emit_test_armreg_x86reg(int armreg, int x86reg) {
+    emit_rex_armreg(armreg);
     emit_byte(0x85);
     emit_modrm_armreg(x86reg, armreg);
 }
@@ -274,6 +526,10 @@ static void emit_shift_x86reg(int shiftop, int x86reg, int count) {
 }
 
 static void emit_shift_armreg(int shiftop, int armreg, int count) {
+    if (count != 0) {
+        reg_dirty |= 1 << armreg;
+        emit_rex_armreg(armreg);
+    }
     if (count == SHIFT_BY_CL) {
         emit_byte(0xD3);
         emit_modrm_armreg(shiftop, armreg);
@@ -319,6 +575,610 @@ static inline void emit_setcc_flag(int setcc, void *flagptr) {
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
 
+/* Emits a short conditional jump taken if the ARM condition cond is not met.
+ * Returns the location after the jump, to be used for filling in its offset,
+ * or NULL for AL. */
+static uint8_t *emit_cond_skip(int cond) {
+    int jcc = JZ;
+    switch (cond >> 1) {
+        case 0: /* EQ (Z), NE (!Z) */
+            emit_cmp_flag_immediate(&arm.cpsr_z, 0);
+            break;
+        case 1: /* CS (C), CC (!C) */
+            emit_cmp_flag_immediate(&arm.cpsr_c, 0);
+            break;
+        case 2: /* MI (N), PL (!N) */
+            emit_cmp_flag_immediate(&arm.cpsr_n, 0);
+            break;
+        case 3: /* VS (V), VC (!V) */
+            emit_cmp_flag_immediate(&arm.cpsr_v, 0);
+            break;
+        case 4: /* HI (!Z & C), LS (Z | !C) */
+            emit_mov_x86reg8_flag(AL, &arm.cpsr_z);
+            emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
+            jcc = JAE; // execute if Z is less than C
+            break;
+        case 5: /* GE (N = V), LT (N != V) */
+            emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
+            emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_v);
+            jcc = JNZ;
+            break;
+        case 6: /* GT (!Z & N = V), LE (Z | N != V) */
+            emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
+            emit_alu_x86reg8_flag(XOR, AL, &arm.cpsr_v);
+            emit_alu_x86reg8_flag(OR, AL, &arm.cpsr_z);
+            jcc = JNZ;
+            break;
+        default: /* AL */
+            return NULL;
+    }
+    /* If condition not met, jump around code.
+     * (If ARM condition code is inverted, invert x86 code too) */
+    emit_byte(jcc ^ (cond & 1));
+    emit_byte(0);
+    return out;
+}
+
+/* The flag updates at the end of an instruction are deferred to the start of
+ * the next one, which leaves out those it overwrites anyway.
+ * Each entry (N, Z, C, V) is a SETcc opcode, FLAG_IMM | value, or 0. */
+#define FLAG_IMM 0x100
+enum { FLAG_N = 1, FLAG_Z = 2, FLAG_C = 4, FLAG_V = 8 };
+static int flags_pending[4];
+// Flags left out by the last flush, stored after all if the instruction isn't translated
+static int flags_killed[4];
+// SETcc opcodes of the flags still found in the host EFLAGS after the last flush
+static int flags_host[4];
+
+static inline void defer_setcc_flag(int setcc, void *flagptr) {
+    flags_pending[(uint8_t *)flagptr - &arm.cpsr_n] = setcc;
+}
+static inline void defer_mov_flag_immediate(void *flagptr, int imm) {
+    flags_pending[(uint8_t *)flagptr - &arm.cpsr_n] = FLAG_IMM | imm;
+}
+
+/* Stores the deferred flag updates, except for those in kill. */
+static void emit_flags_flush(int kill) {
+    for (int i = 0; i < 4; i++) {
+        int flag = flags_pending[i];
+        flags_pending[i] = 0;
+        flags_killed[i] = (kill >> i & 1) ? flag : 0;
+        flags_host[i] = (flag & FLAG_IMM) ? 0 : flag;
+        if (!flag || (kill >> i & 1))
+            continue;
+        if (flag & FLAG_IMM)
+            emit_mov_flag_immediate(&arm.cpsr_n + i, flag & 1);
+        else
+            emit_setcc_flag(flag, &arm.cpsr_n + i);
+    }
+}
+
+/* Emits the flag updates left out by the last flush. */
+static void emit_flags_unkill() {
+    memcpy(flags_pending, flags_killed, sizeof flags_pending);
+    emit_flags_flush(0);
+}
+
+/* Right after a flush, emits a short conditional jump taken if the ARM
+ * condition cond is not met, testing the host flags instead of the stored
+ * ones. Returns the location after the jump, or NULL if the host flags don't
+ * hold the condition.
+ * Entering the instruction through the jump table, the host flags are
+ * garbage, so the jump table points to a stub testing the stored flags. */
+static uint8_t *emit_cond_skip_host(int cond) {
+    int n = flags_host[0], z = flags_host[1], c = flags_host[2], v = flags_host[3];
+    int jcc;
+    switch (cond >> 1) {
+        case 0: /* EQ, NE */
+            if (!z) return NULL;
+            jcc = z - SETO + JO;
+            break;
+        case 1: /* CS, CC */
+            if (!c) return NULL;
+            jcc = c - SETO + JO;
+            break;
+        case 2: /* MI, PL */
+            if (!n) return NULL;
+            jcc = n - SETO + JO;
+            break;
+        case 3: /* VS, VC */
+            if (!v) return NULL;
+            jcc = v - SETO + JO;
+            break;
+        case 4: /* HI, LS: only with an x86 borrow as the carry */
+            if (z != SETZ || c != SETAE) return NULL;
+            jcc = JA;
+            break;
+        case 5: /* GE, LT */
+            if (n != SETS || v != SETO) return NULL;
+            jcc = JGE;
+            break;
+        case 6: /* GT, LE */
+            if (n != SETS || z != SETZ || v != SETO) return NULL;
+            jcc = JG;
+            break;
+        default:
+            return NULL;
+    }
+    emit_byte(jcc ^ (cond & 1) ^ 1);
+    emit_byte(0);
+    return out;
+}
+
+/* An instruction testing its condition in the host flags, see above */
+struct host_cond_entry {
+    void **jump;    // Its jump table entry
+    uint8_t *body;  // Code after the condition test
+    uint8_t *end;   // Code after the instruction
+    int cond;
+    uint8_t *stub;  // Test of the stored flags, for the jump table
+};
+static struct host_cond_entry host_cond_scratch[MAX_BLOCK_INSNS];
+static struct host_cond_entry *out_host_cond;
+// Test of the stored flags, jump to the body and jump to the end
+#define MAX_HOST_COND_STUB_SIZE (11 + 5 + 5)
+
+/* A block exit to a known address in the same 1 KB page, which can be
+ * linked to the translation covering that address. */
+struct translation_exit {
+    uint8_t *code;  // Short jump over the chain code to translation_next
+    void *target;   // Instruction jumped to
+    int linked;     // Translation jumped to directly, or -1
+};
+static struct translation_exit exit_scratch[MAX_BLOCK_INSNS + 1];
+static struct translation_exit *out_exit;
+
+/* Bookkeeping not needed by asmcode */
+static struct translation_info {
+    // Doubly linked list of the translations in the same 1 KB page (index + 1, 0 = none)
+    int page_prev, page_next;
+    // Put after the jump table
+    struct translation_exit *exits;
+    int exit_count;
+    // Which ARM registers are cached in which host registers, see reg_cache_key
+    uint32_t reg_cache_key;
+    // Code of each instruction, if the jump table has host flag stubs (else NULL)
+    void **insn_code;
+    // Words after end_ptr folded into it as literals, see ba_block
+    uint64_t literals;
+} translation_info[MAX_TRANSLATIONS];
+// First translation in each 1 KB page of RAM (index + 1, 0 = none)
+static int page_translations[MEM_MAXSIZE >> 10];
+
+// Whether the globals used by chained exits can be addressed relative to &arm
+static bool chaining_possible = false;
+#define CHAIN_CODE_SIZE 63
+
+/* Code to enter the translation of target directly from a block exit,
+ * with the same checks translation_next does. The target PC is in EAX.
+ * Always the same size, so that it can be rewritten in place. */
+static void emit_chain(void *target, int insns_left, void *code, void *loader) {
+    int32_t cycle_count_offset = (intptr_t)&cycle_count_delta - (intptr_t)&arm;
+    int32_t cpu_events_offset = (intptr_t)&cpu_events - (intptr_t)&arm;
+    int32_t pc_ptr_offset = (intptr_t)&in_translation_pc_ptr - (intptr_t)&arm;
+
+    uint8_t *chain_start = out;
+    emit_byte(0x83); // cmp $0, cycle_count_delta
+    emit_byte(0x80 | CMP << 3 | EBX);
+    emit_dword(cycle_count_offset);
+    emit_byte(0);
+    emit_byte(JNS);
+    uint8_t *jns_offset = out++;
+    emit_byte(0x83); // cmp $0, cpu_events
+    emit_byte(0x80 | CMP << 3 | EBX);
+    emit_dword(cpu_events_offset);
+    emit_byte(0);
+    emit_byte(JNZ);
+    uint8_t *jnz_offset = out++;
+    emit_byte(0x89); // mov %eax, arm.reg[15]
+    emit_modrm_base_offset(EAX, EBX, (uint8_t *)&arm.reg[15] - (uint8_t *)&arm);
+    emit_byte(0x81); // add $insns_left, cycle_count_delta
+    emit_byte(0x80 | ADD << 3 | EBX);
+    emit_dword(cycle_count_offset);
+    emit_dword(insns_left);
+    emit_byte(0x48); // mov $target, %rcx
+    emit_byte(0xB8 | ECX);
+    *(uint64_t *)out = (uintptr_t)target; out += 8;
+    emit_byte(0x48); // mov %rcx, in_translation_pc_ptr
+    emit_byte(0x89);
+    emit_byte(0x80 | ECX << 3 | EBX);
+    emit_dword(pc_ptr_offset);
+    emit_byte(0x48); // mov $code, %rcx
+    emit_byte(0xB8 | ECX);
+    *(uint64_t *)out = (uintptr_t)code; out += 8;
+    emit_byte(0xE9); // jmp loader, which jumps to %rcx
+    emit_dword((uint8_t *)loader - (out + 4));
+
+    *jns_offset = out - (jns_offset + 1);
+    *jnz_offset = out - (jnz_offset + 1);
+    assert(out - chain_start == CHAIN_CODE_SIZE);
+}
+
+// Pointer to the instruction at pc if it's in the page being translated, otherwise NULL
+#define PAGE_INSN_PTR(pc) (((pc) ^ page_pc) & ~0x3FF ? NULL : (uint8_t *)page_insnp + (int32_t)((pc) - page_pc))
+
+/* Leaves the translation to target_pc, a constant. If the target is in the
+ * same 1 KB page, this gets recorded as an exit which can be linked directly
+ * to the translation of the target later. */
+static void emit_exit(uint32_t target_pc, void *target, bool thumb) {
+    emit_reg_writeback();
+    emit_mov_x86reg_immediate(EAX, target_pc);
+    if (chaining_possible && target) {
+        out_exit->code = out;
+        out_exit->target = target;
+        out_exit->linked = -1;
+        out_exit++;
+        emit_byte(0xEB); // jmp over the chain code
+        emit_byte(CHAIN_CODE_SIZE);
+        emit_chain(target, 0, out, out);
+    }
+    emit_jump(thumb ? (uintptr_t)translation_next_thumb : (uintptr_t)translation_next);
+}
+
+/* Whether a block reaching the start of the next 1 KB page at pc, insnp can
+ * go on into it: the page has to be mapped to the physically next page of
+ * RAM right now, and its first instruction must have run before, so that
+ * blocks only get longer on paths which are actually taken. */
+static bool superblock_can_continue(uint32_t pc, void *insnp) {
+    // The worker thread can't look at addr_cache
+    if (worker_job)
+        return false;
+    ac_entry entry = addr_cache[(pc >> 10) << 1];
+    if (((uintptr_t)entry & AC_FLAGS) || entry + pc != insnp)
+        return false;
+    uint32_t flags = RAM_FLAGS((uintptr_t)insnp & ~3);
+    return (flags & RF_CODE_EXECUTED) && !(flags & DONT_TRANSLATE);
+}
+
+/* Continues a block into the next page at pc, insnp. Only the virtual
+ * address of the page a block is entered in gets checked, so the mapping
+ * of this one is checked here, leaving the block if it changed. */
+static void emit_page_guard(uint32_t pc, void *insnp, bool thumb) {
+    emit_flags_flush(0); // The comparison overwrites the host flags
+    emit_byte(0x48); // mov $&addr_cache, %rax
+    emit_byte(0xB8 | EAX);
+    *(uint64_t *)out = (uintptr_t)&addr_cache; out += 8;
+    emit_byte(0x48); // mov (%rax), %rax
+    emit_byte(0x8B);
+    emit_byte(EAX << 3 | EAX);
+    emit_byte(0x48); // mov $entry, %rcx
+    emit_byte(0xB8 | ECX);
+    *(uint64_t *)out = (uintptr_t)insnp - pc; out += 8;
+    emit_byte(0x48); // cmp %rcx, entry(%rax)
+    emit_byte(0x39);
+    emit_byte(0x80 | ECX << 3 | EAX);
+    emit_dword((pc >> 10) * 2 * sizeof(ac_entry));
+    emit_byte(JZ);
+    uint8_t *jz_offset = out++;
+    // The registers stay cached on the path going on
+    uint16_t dirty = reg_dirty;
+    emit_exit(pc, NULL, thumb);
+    reg_dirty = dirty;
+    *jz_offset = out - (jz_offset + 1);
+    translation_stats.page_crossings++;
+}
+
+// Starts a translation at the space found by code_alloc_begin
+static void code_alloc_restart() {
+    out = out_start;
+    outj = jtbl_scratch;
+    out_exit = exit_scratch;
+    out_host_cond = host_cond_scratch;
+}
+
+/* Determines where the next translation goes: into the first hole large
+ * enough, otherwise at insn_bufptr. */
+static void code_alloc_begin() {
+    out_start = insn_bufptr;
+    out_limit = &insn_buffer[INSN_BUFFER_SIZE - GOT_SIZE];
+    for (int i = 0; i < code_hole_count; i++) {
+        if (code_holes[i].end - code_holes[i].start >= MIN_CODE_HOLE_SIZE) {
+            out_start = code_holes[i].start;
+            out_limit = code_holes[i].end;
+            break;
+        }
+    }
+    code_alloc_restart();
+}
+
+// Whether another instruction, the block exit, the host flag stubs, the loader,
+// the jump table (twice with stubs) and the exits still fit
+static inline bool code_space_left() {
+    return out + MAX_INSN_CODE_SIZE + MAX_REG_LOADER_SIZE + 2 * (outj - jtbl_scratch + 1) * sizeof(void *)
+            + (out_host_cond - host_cond_scratch + 1) * MAX_HOST_COND_STUB_SIZE
+            + (out_exit - exit_scratch + 2) * sizeof(struct translation_exit) < out_limit;
+}
+
+/* Puts the host flag stubs, the loader, the jump table and the exits after
+ * the translated code. Returns the jump table. */
+static void **code_alloc_tail(int index) {
+    for (struct host_cond_entry *e = host_cond_scratch; e < out_host_cond; e++) {
+        e->stub = out;
+        uint8_t *cond_jmp_offset = emit_cond_skip(e->cond);
+        emit_jump((uintptr_t)e->body);
+        cond_jmp_offset[-1] = out - cond_jmp_offset;
+        emit_jump((uintptr_t)e->end);
+    }
+
+    translation_loader[index] = out;
+    translation_info[index].reg_cache_key = reg_cache_key();
+    emit_reg_load();
+    emit_word(0xE1FF); // jmp *%rcx
+
+    out = (uint8_t *)(((uintptr_t)out + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+    void **jump_table = (void **)out;
+    memcpy(jump_table, jtbl_scratch, (outj - jtbl_scratch) * sizeof(void *));
+    out += (outj - jtbl_scratch) * sizeof(void *);
+    translation_info[index].insn_code = NULL;
+    if (out_host_cond > host_cond_scratch) {
+        // The jump table gets the stubs, fixing the PC needs the instructions
+        translation_info[index].insn_code = (void **)out;
+        memcpy(out, jtbl_scratch, (outj - jtbl_scratch) * sizeof(void *));
+        out += (outj - jtbl_scratch) * sizeof(void *);
+        for (struct host_cond_entry *e = host_cond_scratch; e < out_host_cond; e++)
+            jump_table[e->jump - jtbl_scratch] = e->stub;
+    }
+
+    translation_info[index].exits = (struct translation_exit *)out;
+    translation_info[index].exit_count = out_exit - exit_scratch;
+    memcpy(out, exit_scratch, (out_exit - exit_scratch) * sizeof(struct translation_exit));
+    out += (out_exit - exit_scratch) * sizeof(struct translation_exit);
+    return jump_table;
+}
+
+static void code_free(uint8_t *start, uint8_t *end);
+
+/* Marks start to end, where code_alloc_begin found space, as used. That's
+ * a hole or the space at insn_bufptr, but for a background translation
+ * code_free may have made the free space start earlier in the meantime. */
+static void code_alloc_mark(uint8_t *start, uint8_t *end) {
+    uint8_t *free_start;
+    int i = 0;
+    while (i < code_hole_count && !(code_holes[i].start <= start && start < code_holes[i].end))
+        i++;
+    if (i < code_hole_count) {
+        free_start = code_holes[i].start;
+        if (end < code_holes[i].end) {
+            code_holes[i].start = end;
+        } else {
+            code_hole_count--;
+            memmove(&code_holes[i], &code_holes[i + 1], (code_hole_count - i) * sizeof(*code_holes));
+        }
+    } else {
+        free_start = insn_bufptr;
+        insn_bufptr = end;
+    }
+    assert(free_start <= start);
+    if (free_start < start)
+        code_free(free_start, start);
+}
+
+// Gives an area of insn_buffer back
+static void code_free(uint8_t *start, uint8_t *end) {
+    if (end == insn_bufptr) {
+        insn_bufptr = start;
+        // The hole before might now touch insn_bufptr as well
+        if (code_hole_count && code_holes[code_hole_count - 1].end == insn_bufptr)
+            insn_bufptr = code_holes[--code_hole_count].start;
+        return;
+    }
+
+    int i = 0;
+    while (i < code_hole_count && code_holes[i].start < start)
+        i++;
+
+    bool merge_prev = i > 0 && code_holes[i - 1].end == start;
+    bool merge_next = i < code_hole_count && code_holes[i].start == end;
+    if (merge_prev && merge_next) {
+        code_holes[i - 1].end = code_holes[i].end;
+        code_hole_count--;
+        memmove(&code_holes[i], &code_holes[i + 1], (code_hole_count - i) * sizeof(*code_holes));
+    } else if (merge_prev) {
+        code_holes[i - 1].end = end;
+    } else if (merge_next) {
+        code_holes[i].start = start;
+    } else {
+        if (code_hole_count == code_hole_capacity) {
+            int capacity = code_hole_capacity ? code_hole_capacity * 2 : 256;
+            struct code_hole *holes = realloc(code_holes, capacity * sizeof(*code_holes));
+            if (!holes)
+                return; // Just lose the space until the next flush
+            code_holes = holes;
+            code_hole_capacity = capacity;
+        }
+        memmove(&code_holes[i + 1], &code_holes[i], (code_hole_count - i) * sizeof(*code_holes));
+        code_holes[i].start = start;
+        code_holes[i].end = end;
+        code_hole_count++;
+    }
+}
+
+// Index for the next translation, see translation_take_index
+static inline int translation_next_index() {
+    return free_index_count ? free_indices[free_index_count - 1] : next_index;
+}
+
+static inline int ptr_page(void *ptr) {
+    return ((uint8_t *)ptr - mem_and_flags) >> 10;
+}
+
+static inline int translation_page(int index) {
+    return ptr_page(translation_table[index].start_ptr);
+}
+
+// First page whose translations may have exits into page, see translation_commit
+static inline int exit_source_page(int page) {
+    return page < SUPERBLOCK_MAX_PAGES - 1 ? 0 : page - (SUPERBLOCK_MAX_PAGES - 1);
+}
+
+// Virtual address of ptr in the translation
+static inline uint32_t translation_ptr_pc(int index, void *ptr) {
+    return translation_pc[index] + ((uint8_t *)ptr - (uint8_t *)translation_table[index].start_ptr);
+}
+
+// Whether the translation covers ptr and was done for the given state and virtual address
+static bool translation_covers(int index, void *ptr, uint32_t pc, bool thumb) {
+    return translation_thumb[index] == thumb
+            && ptr >= (void *) translation_table[index].start_ptr
+            && ptr < (void *) translation_table[index].end_ptr
+            && translation_ptr_pc(index, ptr) == pc;
+}
+
+// Links the exit of translation from with the translation covering its target
+static void translation_exit_link(struct translation_exit *e, int from, int index) {
+    struct translation *t = &translation_table[index];
+    int insn_size = translation_thumb[index] ? 2 : 4;
+    int insn = ((uint8_t *)e->target - (uint8_t *)t->start_ptr) / insn_size;
+    int insns = ((uint8_t *)t->end_ptr - (uint8_t *)t->start_ptr) / insn_size;
+
+    uint8_t *out_save = out;
+    out = e->code + 2;
+    // The registers are written back before the exit, so loading them is only
+    // needed if they're cached differently
+    bool same_regs = translation_info[from].reg_cache_key == translation_info[index].reg_cache_key;
+    emit_chain(e->target, insns - insn, t->jump_table[insn],
+               same_regs ? t->jump_table[insn] : translation_loader[index]);
+    out = out_save;
+    e->code[1] = 0; // Fall through into the chain code
+    e->linked = index;
+}
+
+static void translation_exit_unlink(struct translation_exit *e) {
+    e->code[1] = CHAIN_CODE_SIZE;
+    e->linked = -1;
+}
+
+// Takes index, as returned by translation_next_index, off the free ones
+static void translation_take_index(int index) {
+    if (free_index_count && index == free_indices[free_index_count - 1])
+        free_index_count--;
+    else
+        next_index++;
+}
+
+// The word after end_ptr which bit n of literals stands for
+static inline uint32_t *literal_word(void *end_ptr, int n) {
+    return (uint32_t *)(((uintptr_t)end_ptr + 3) & ~3) + n;
+}
+
+/* Enters the translation with the code emitted up to code_end into the
+ * tables, flags its words and the literals folded into it and links its
+ * exits. The literals are flagged RF_CODE_LITERAL as well, so that they
+ * don't get entered as code of the translation. */
+static void translation_add(int index, uint32_t start_pc, void *start_ptr, void *end_ptr, uint64_t literals,
+                            bool thumb, void **jump_table, uint8_t *code_end) {
+    translation_table[index].jump_table = jump_table;
+    translation_table[index].start_ptr  = start_ptr;
+    translation_table[index].end_ptr    = end_ptr;
+    translation_thumb[index] = thumb;
+    translation_pc[index] = start_pc;
+    translation_info[index].literals = literals;
+    // THUMB translations may start or end in the middle of a word
+    uint32_t *word = (uint32_t *)((uintptr_t)start_ptr & ~3);
+    for (; word < (uint32_t *)(((uintptr_t)end_ptr + 3) & ~3); word++)
+        RAM_FLAGS(word) |= (RF_CODE_TRANSLATED | index << RFS_TRANSLATION_INDEX);
+    for (uintptr_t p = (uintptr_t)start_ptr & ~0x3FF; p < (uintptr_t)end_ptr; p += 0x400)
+        protect_code_page((void *)p);
+    for (int n = 0; n < BA_MAX_POOL_WORDS; n++) {
+        if (literals >> n & 1) {
+            word = literal_word(end_ptr, n);
+            RAM_FLAGS(word) |= (RF_CODE_TRANSLATED | RF_CODE_LITERAL | index << RFS_TRANSLATION_INDEX);
+            protect_code_page(word);
+        }
+    }
+
+    uint8_t *code = jump_table[0];
+    translation_stats.translations++;
+    translation_stats.code_size += code_end - code;
+    if (translation_stats.code_size > translation_stats.code_size_peak)
+        translation_stats.code_size_peak = translation_stats.code_size;
+    if (++translation_stats.live_translations > translation_stats.live_peak)
+        translation_stats.live_peak = translation_stats.live_translations;
+
+    if (perf_map_enabled())
+        perf_map_add(code, code_end - code, start_pc,
+                     start_pc + ((uint8_t *)end_ptr - (uint8_t *)start_ptr), thumb);
+
+    int page = translation_page(index);
+    struct translation_info *info = &translation_info[index];
+    info->page_prev = 0;
+    info->page_next = page_translations[page];
+    if (info->page_next)
+        translation_info[info->page_next - 1].page_prev = index + 1;
+    page_translations[page] = index + 1;
+
+    /* Link exits to and from this translation. They never leave the page
+     * of the code they're in, but the page may have been translated for
+     * another virtual address. An exit only gets linked to a translation
+     * starting in the page of its target, which can only have been reached
+     * by translations starting at most SUPERBLOCK_MAX_PAGES - 1 pages before,
+     * so that invalidate_translation finds all links to it. */
+    for (int p = exit_source_page(page); p <= page; p++) {
+        for (int i = page_translations[p]; i; i = translation_info[i - 1].page_next) {
+            struct translation_info *other = &translation_info[i - 1];
+            for (int j = 0; j < other->exit_count; j++) {
+                struct translation_exit *e = &other->exits[j];
+                if (e->linked >= 0)
+                    continue;
+                uint32_t target_pc = translation_ptr_pc(i - 1, e->target);
+                if (i - 1 == index) {
+                    uint32_t flags = RAM_FLAGS((uintptr_t)e->target & ~3);
+                    int target = flags >> RFS_TRANSLATION_INDEX;
+                    if ((flags & RF_CODE_TRANSLATED) && translation_page(target) == ptr_page(e->target)
+                            && translation_covers(target, e->target, target_pc, thumb))
+                        translation_exit_link(e, index, target);
+                } else if (ptr_page(e->target) == page
+                           && translation_covers(index, e->target, target_pc, translation_thumb[i - 1])) {
+                    translation_exit_link(e, i - 1, index);
+                }
+            }
+        }
+    }
+}
+
+static void translation_commit(int index, uint32_t start_pc, void *start_ptr, void *end_ptr, uint64_t literals,
+                               bool thumb) {
+    translation_take_index(index);
+    void **jump_table = code_alloc_tail(index);
+    code_alloc_mark(out_start, out);
+    translation_add(index, start_pc, start_ptr, end_ptr, literals, thumb, jump_table, out);
+}
+
+// Evicts the translations starting in the next EVICT_SIZE bytes of insn_buffer
+static void translation_evict() {
+    if (!evict_ptr || evict_ptr >= insn_bufptr)
+        evict_ptr = insn_buffer;
+    uint8_t *evict_end = evict_ptr + EVICT_SIZE;
+
+    for (int index = 0; index < next_index; index++) {
+        struct translation *t = &translation_table[index];
+        if (t->start_ptr && (uint8_t *)t->jump_table[0] >= evict_ptr && (uint8_t *)t->jump_table[0] < evict_end) {
+            invalidate_translation(index);
+            translation_stats.evictions++;
+        }
+    }
+    evict_ptr = evict_end;
+}
+
+/* Finds space and an index for the next translation, evicting others if
+ * needed. Only called outside of translated code, so everything can go. */
+static void translation_make_room() {
+    assert(!in_translation_rsp);
+    for (int i = 0; i < INSN_BUFFER_SIZE / EVICT_SIZE; i++) {
+        code_alloc_begin();
+        if ((free_index_count || next_index < MAX_TRANSLATIONS) && code_space_left())
+            return;
+        translation_evict();
+    }
+
+    flush_translations();
+    translation_stats.flushes++;
+    code_alloc_begin();
+}
+
+static void background_init();
+static void background_deinit();
+
 bool translate_init()
 {
     if(!insn_buffer)
@@ -333,6 +1193,23 @@ bool translate_init()
     // This is setup once and then keeps its entries until the insn_buffer is freed
     got_init(&insn_buffer[INSN_BUFFER_SIZE - GOT_SIZE], GOT_SIZE);
 
+    memset(reg_cache, -1, sizeof reg_cache);
+    // Lockstep testing has to see all writes
+    if (!lockstep_enabled)
+        fastmem_init();
+    const char *env = getenv("FIREBIRD_PROTECT_CODE_PAGES");
+    code_page_protection = env && *env && strcmp(env, "0");
+    // Before the background thread can translate anything
+    perf_map_init();
+    background_init();
+
+    intptr_t offsets[] = { (intptr_t)&cycle_count_delta - (intptr_t)&arm,
+                           (intptr_t)&cpu_events - (intptr_t)&arm,
+                           (intptr_t)&in_translation_pc_ptr - (intptr_t)&arm };
+    chaining_possible = true;
+    for (unsigned int i = 0; i < sizeof(offsets) / sizeof(*offsets); i++)
+        chaining_possible &= offsets[i] >= INT32_MIN && offsets[i] <= INT32_MAX;
+
     return true;
 }
 
@@ -341,82 +1218,208 @@ void translate_deinit()
     if(!insn_buffer)
         return;
 
+    background_deinit();
     os_free(insn_buffer, INSN_BUFFER_SIZE);
     insn_buffer = NULL;
 }
 
-void translate(uint32_t start_pc, uint32_t *start_insnp) {
-    out = insn_bufptr;
-    outj = jtbl_bufptr;
+/* The flags of the word at ptr for the translation going on. The words
+ * reserved for a background translation don't stop it. */
+static inline uint32_t insn_flags(void *ptr) {
+    uint32_t flags = RAM_FLAGS((uintptr_t)ptr & ~3);
+    if (worker_job && ptr >= worker_job->ptr && ptr < worker_job->marked_end)
+        flags &= ~RF_CODE_NO_TRANSLATE;
+    return flags;
+}
+
+/* Flags the word at ptr as untranslatable. The worker thread leaves that
+ * to background_publish, the code may have changed in the meantime. */
+static void flag_no_translate(void *ptr) {
+    if (worker_job) {
+        worker_job->no_translate_ptr = ptr;
+        return;
+    }
+    RAM_FLAGS((uintptr_t)ptr & ~3) |= RF_CODE_NO_TRANSLATE;
+    protect_code_page(ptr);
+}
+
+// Ends a block translated by the worker thread at end_ptr
+static void background_done(void *end_ptr, uint64_t literals, enum block_end reason) {
+    worker_job->end_ptr = end_ptr;
+    worker_job->literals = literals;
+    worker_job->end_reason = reason;
+    if (end_ptr != worker_job->ptr)
+        worker_job->jump_table = code_alloc_tail(worker_job->index);
+    worker_job->code_end = out;
+}
+
+/* Picks the registers to cache, counting how often the instructions up to
+ * the end of the page or a branch use each one. Only an estimate: the
+ * translation may well end earlier. */
+static void reg_alloc(void *start_insnp, uint32_t start_pc, bool thumb) {
+    int uses[15] = { 0 };
+    uint32_t pc = start_pc;
+    uint8_t *insnp = start_insnp;
+    for (int i = 0; i < 64 && !((pc ^ start_pc) & ~0x3FF); i++) {
+        if (insn_flags(insnp) & DONT_TRANSLATE)
+            break;
+        int regs[3] = { -1, -1, -1 };
+        bool branch = false;
+        if (!thumb) {
+            uint32_t insn = *(uint32_t *)insnp;
+            if ((insn & 0xE000000) == 0xA000000) {
+                branch = true;
+            } else if ((insn & 0xE000000) == 0x8000000) {
+                regs[0] = insn >> 16 & 15;
+            } else {
+                regs[0] = insn >> 16 & 15;
+                regs[1] = insn >> 12 & 15;
+                if (!(insn & 0x2000000))
+                    regs[2] = insn & 15;
+            }
+            branch |= (insn >> 12 & 15) == 15 && (insn & 0xC100000) == 0x4100000;
+            pc += 4;
+            insnp += 4;
+        } else {
+            uint16_t insn = *(uint16_t *)insnp;
+            switch (insn >> 12) {
+                case 0x0: case 0x1: case 0x4: case 0x5: case 0x6: case 0x7: case 0x8:
+                    regs[0] = insn & 7;
+                    regs[1] = insn >> 3 & 7;
+                    if ((insn & 0xFF00) == 0x4700)
+                        branch = true;
+                    else if ((insn & 0xFC00) == 0x4400)
+                        regs[0] = (insn >> 4 & 8) | (insn & 7), regs[1] = insn >> 3 & 15;
+                    break;
+                case 0x2: case 0x3:
+                    regs[0] = insn >> 8 & 7;
+                    break;
+                case 0x9: case 0xA: case 0xB:
+                    regs[0] = insn >> 8 & 7;
+                    regs[1] = 13;
+                    break;
+                case 0xC:
+                    regs[0] = insn >> 8 & 7;
+                    break;
+                default:
+                    branch = (insn >> 11) != 0x1E;
+                    break;
+            }
+            pc += 2;
+            insnp += 2;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (regs[j] >= 0 && regs[j] < 15)
+                uses[regs[j]]++;
+        }
+        if (branch)
+            break;
+    }
+
+    memset(reg_cache, -1, sizeof reg_cache);
+    reg_dirty = 0;
+    for (int host = 12; host < 12 + REG_CACHE_COUNT; host++) {
+        int best = -1;
+        for (int armreg = 0; armreg < 15; armreg++) {
+            if (reg_cache[armreg] < 0 && uses[armreg] >= 2 && (best < 0 || uses[armreg] > uses[best]))
+                best = armreg;
+        }
+        if (best < 0)
+            break;
+        reg_cache[best] = host;
+    }
+}
+
+/* Returns the user mode register reg (8-14) for LDM/STM with the S bit */
+static uint32_t *user_reg_ptr(uint32_t reg) {
+    int mode = arm.cpsr_low28 & 0x1F;
+    if (reg >= 13) {
+        if (mode != MODE_USR && mode != MODE_SYS)
+            return &arm.r13_usr[reg - 13];
+    } else if (mode == MODE_FIQ) {
+        return &arm.r8_usr[reg - 8];
+    }
+    return &arm.reg[reg];
+}
+
+/* The analysis of the instructions being translated in the current page,
+ * see translate_analysis.h. The flags which they write and nothing reads are
+ * left out, see emit_flags_flush, and literals are folded into constants. */
+static struct ba_block analysis;
+
+// Why a block stops at an instruction with DONT_TRANSLATE flags
+static enum block_end dont_translate_reason(uint32_t flags) {
+    if (flags & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT))
+        return BLOCK_END_BREAKPOINT;
+    return (flags & RF_CODE_TRANSLATED) ? BLOCK_END_TRANSLATED : BLOCK_END_NO_TRANSLATE;
+}
+
+// Translates the ARM block at start_pc as translation index, into the space found by code_alloc_begin
+static void translate_arm_block(uint32_t start_pc, uint32_t *start_insnp, int index) {
+    /* If the block ends before its analysis, it may have to be translated
+     * again with the analysis of that page cut there, see ba_truncate */
+    bool retried = false;
+    uint32_t retry_pc = 0;
+    int retry_count = 0;
+    enum block_end retry_reason = BLOCK_END_UNIMPLEMENTED;
+retry:;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
+    // Start of the page being translated, and how many pages the block covers
+    uint32_t page_pc = start_pc;
+    uint32_t *page_insnp = start_insnp;
+    int pages = 1;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
+    code_alloc_restart();
+    reg_alloc(start_insnp, start_pc, false);
+    memset(flags_pending, 0, sizeof flags_pending);
+    ba_build(&analysis, pc, insnp, false, retried && pc == retry_pc ? retry_count : BA_MAX_INSNS, insn_flags);
 
     uint8_t *insn_start;
+    uint16_t insn_dirty = 0;
     int stop_here = 0;
+    enum block_end end_reason = BLOCK_END_UNIMPLEMENTED;
     while (1) {
-        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000 - GOT_SIZE])
-            error("Out of instruction space");
-        if (outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
-            error("Out of jump table space");
-
-        insn_start = out;
-
-        if ((pc ^ start_pc) & ~0x3FF) {
-            //printf("stopping translation - end of page\n");
+        if (!code_space_left()) {
+            end_reason = BLOCK_END_CODE_SPACE;
             goto branch_conditional;
         }
-        if (RAM_FLAGS(insnp) & DONT_TRANSLATE) {
+
+        if ((pc ^ page_pc) & ~0x3FF) {
+            if (pages == SUPERBLOCK_MAX_PAGES || !superblock_can_continue(pc, insnp)) {
+                //printf("stopping translation - end of page\n");
+                end_reason = BLOCK_END_PAGE;
+                goto branch_conditional;
+            }
+            emit_page_guard(pc, insnp, false);
+            page_pc = pc;
+            page_insnp = insnp;
+            pages++;
+            ba_build(&analysis, pc, insnp, false, retried && pc == retry_pc ? retry_count : BA_MAX_INSNS, insn_flags);
+        }
+        if (insn_flags(insnp) & DONT_TRANSLATE) {
             //printf("stopping translation - at breakpoint %x (%x)\n", pc);
+            end_reason = dont_translate_reason(insn_flags(insnp));
             goto branch_conditional;
         }
         uint32_t insn = *insnp;
+        int cond = insn >> 28;
+        int ba_index = (pc - analysis.pc) >> 2;
+
+        /* Store the flags of the previous instruction,
+         * except for those overwritten before anything reads them */
+        emit_flags_flush(ba_flags_dead(&analysis, ba_index - 1));
+
+        insn_start = out;
+        insn_dirty = reg_dirty;
 
         /* Condition code */
-        int cond = insn >> 28;
-        int jcc = JZ;
-        uint8_t *cond_jmp_offset = NULL;
-        switch (cond >> 1) {
-            case 0: /* EQ (Z), NE (!Z) */
-                emit_cmp_flag_immediate(&arm.cpsr_z, 0);
-                break;
-            case 1: /* CS (C), CC (!C) */
-                emit_cmp_flag_immediate(&arm.cpsr_c, 0);
-                break;
-            case 2: /* MI (N), PL (!N) */
-                emit_cmp_flag_immediate(&arm.cpsr_n, 0);
-                break;
-            case 3: /* VS (V), VC (!V) */
-                emit_cmp_flag_immediate(&arm.cpsr_v, 0);
-                break;
-            case 4: /* HI (!Z & C), LS (Z | !C) */
-                emit_mov_x86reg8_flag(AL, &arm.cpsr_z);
-                emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
-                jcc = JAE; // execute if Z is less than C
-                break;
-            case 5: /* GE (N = V), LT (N != V) */
-                emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
-                emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_v);
-                jcc = JNZ;
-                break;
-            case 6: /* GT (!Z & N = V), LE (Z | N != V) */
-                emit_mov_x86reg8_flag(AL, &arm.cpsr_n);
-                emit_alu_x86reg8_flag(XOR, AL, &arm.cpsr_v);
-                emit_alu_x86reg8_flag(OR, AL, &arm.cpsr_z);
-                jcc = JNZ;
-                break;
-            case 7: /* AL */
-                if (cond & 1) goto unimpl;
-                goto no_condition;
-        }
-        /* If condition not met, jump around code.
-         * (If ARM condition code is inverted, invert x86 code too) */
-        emit_byte(jcc ^ (cond & 1));
-        emit_byte(0);
-        cond_jmp_offset = out;
-no_condition:
+        if (cond == 0xF)
+            goto unimpl;
+        uint8_t *cond_jmp_offset = emit_cond_skip_host(cond);
+        bool host_cond = cond_jmp_offset != NULL;
+        if (!host_cond)
+            cond_jmp_offset = emit_cond_skip(cond);
 
         if ((insn & 0xE000090) == 0x0000090) {
             if ((insn & 0xFC000F0) == 0x0000090) {
@@ -437,8 +1440,8 @@ no_condition:
                 if (insn & 0x0100000) {
                     if (!(insn & 0x0200000))
                         emit_test_x86reg_x86reg(EAX, EAX);
-                    emit_setcc_flag(SETS, &arm.cpsr_n);
-                    emit_setcc_flag(SETZ, &arm.cpsr_z);
+                    defer_setcc_flag(SETS, &arm.cpsr_n);
+                    defer_setcc_flag(SETZ, &arm.cpsr_z);
                 }
             } else if ((insn & 0xF8000F0) == 0x0800090) {
                 /* UMULL, UMLAL, SMULL, SMLAL: 32x32 to 64 multiplications */
@@ -451,8 +1454,6 @@ no_condition:
                     goto unimpl;
                 if (reg_lo == reg_hi)
                     goto unimpl;
-                if (insn & 0x0100000) // set flags
-                    goto unimpl;
 
                 emit_mov_x86reg_armreg(EAX, left_reg);
                 emit_unary_armreg((insn & 0x0400000) ? IMUL : MUL, right_reg);
@@ -464,54 +1465,113 @@ no_condition:
                     emit_mov_armreg_x86reg(reg_lo, EAX);
                     emit_mov_armreg_x86reg(reg_hi, EDX);
                 }
+
+                if (insn & 0x0100000) {
+                    /* N and Z of the 64-bit result: test it in RAX */
+                    emit_mov_x86reg_armreg(EAX, reg_lo);
+                    emit_mov_x86reg_armreg(EDX, reg_hi);
+                    emit_byte(0x48); // shl $32, %rdx
+                    emit_shift_x86reg(SHL, EDX, 32);
+                    emit_byte(0x48); // or %rdx, %rax
+                    emit_alu_x86reg_x86reg(OR, EAX, EDX);
+                    defer_setcc_flag(SETS, &arm.cpsr_n);
+                    defer_setcc_flag(SETZ, &arm.cpsr_z);
+                }
+            } else if ((insn & 0xFB00FF0) == 0x1000090) {
+                /* SWP, SWPB */
+                int base_reg = insn >> 16 & 15;
+                int data_reg = insn >> 12 & 15;
+                int src_reg  = insn & 15;
+                int is_byteop = insn & (1 << 22);
+                if (base_reg == 15 || data_reg == 15 || src_reg == 15)
+                    goto unimpl;
+
+                // EDX and ECX survive the memory access functions
+                emit_mov_x86reg_armreg(EDX, base_reg);
+                emit_mov_x86reg_x86reg(REG_ARG1, EDX);
+                emit_call_memory(is_byteop ? (uintptr_t)read_byte_asm : (uintptr_t)read_word_asm);
+                emit_mov_x86reg_x86reg(ECX, EAX);
+                emit_mov_x86reg_x86reg(REG_ARG1, EDX);
+                emit_mov_x86reg_armreg(REG_ARG2, src_reg);
+                emit_call_memory(is_byteop ? (uintptr_t)write_byte_asm : (uintptr_t)write_word_asm);
+                emit_mov_armreg_x86reg(data_reg, ECX);
             } else {
+                /* Load/store halfword, signed byte/halfword, or doubleword */
                 enum { INVALID, H, SB, SH } type;
                 int is_load = insn & (1 << 20);
                 type = insn >> 5 & 3;
-                if (type == INVALID || (!is_load && type != H))
-                    // multiply, SWP, or doubleword access
+                if (type == INVALID)
                     goto unimpl;
+                // Without the load bit, SB and SH are LDRD and STRD
+                int is_double = !is_load && type != H;
+                if (is_double)
+                    is_load = type == SB;
 
                 int post_index = !(insn & (1 << 24));
                 int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-                int pre_index = insn & (1 << 21);
+                int offset_is_imm = insn & (1 << 22);
+                int writeback = post_index || (insn & (1 << 21));
                 int base_reg = insn >> 16 & 15;
                 int data_reg = insn >> 12 & 15;
+                int offset_reg = insn & 15;
+                int offset = (insn & 0x0F) | (insn >> 4 & 0xF0);
+                int data_regs = (is_double ? 3 : 1) << data_reg;
 
-                if (base_reg == 15 || data_reg == 15)
+                if (data_reg == 15 || (is_double && (data_reg & 1 || data_reg == 14)))
                     goto unimpl;
-
-                if (pre_index || post_index) {
-                    if (pre_index && post_index) goto unimpl;
+                if (!offset_is_imm && offset_reg == 15)
+                    goto unimpl;
+                if (writeback) {
+                    if (post_index && (insn & (1 << 21))) goto unimpl;
                     if (base_reg == 15) goto unimpl;
-                    if (is_load && base_reg == data_reg) goto unimpl;
+                    if (is_load && (data_regs >> base_reg & 1)) goto unimpl;
+                    if (is_load && post_index && !offset_is_imm && (data_regs >> offset_reg & 1)) goto unimpl;
                 }
 
-                if (insn & (1 << 22)) {
-                    // Offset is immediate
-                    int offset = (insn & 0x0F) | (insn >> 4 & 0xF0);
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    if (!post_index && offset != 0)
-                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset);
-                } else {
-                    // Offset is register
-                    int offset_reg = insn & 0x0F;
-                    if (offset_reg == 15)
-                        goto unimpl;
-                    if (post_index || pre_index)
-                        goto unimpl;
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    emit_alu_x86reg_armreg(offset_op, REG_ARG1, offset_reg);
+                /* The address goes to EDX if it's needed again after the
+                 * first memory access, which preserves EDX */
+                int addr_reg = (is_double || (writeback && !post_index)) ? EDX : REG_ARG1;
+                if (base_reg == 15)
+                    emit_mov_x86reg_immediate(addr_reg, pc + 8);
+                else
+                    emit_mov_x86reg_armreg(addr_reg, base_reg);
+                if (!post_index) {
+                    if (!offset_is_imm)
+                        emit_alu_x86reg_armreg(offset_op, addr_reg, offset_reg);
+                    else if (offset != 0)
+                        emit_alu_x86reg_immediate(offset_op, addr_reg, offset);
                 }
-
-                if (is_load) {
+                if (addr_reg != REG_ARG1)
+                    emit_mov_x86reg_x86reg(REG_ARG1, addr_reg);
+
+                if (is_double) {
+                    if (is_load) {
+                        /* LDRD: both words are read before either register
+                         * is written, in case the second one aborts */
+                        emit_call_memory((uintptr_t)read_word_asm);
+                        emit_mov_x86reg_x86reg(ECX, EAX);
+                        emit_byte(0x8D); // LEA
+                        emit_modrm_base_offset(REG_ARG1, EDX, 4);
+                        emit_call_memory((uintptr_t)read_word_asm);
+                        emit_mov_armreg_x86reg(data_reg, ECX);
+                        emit_mov_armreg_x86reg(data_reg + 1, EAX);
+                    } else {
+                        /* STRD */
+                        emit_mov_x86reg_armreg(REG_ARG2, data_reg);
+                        emit_call_memory((uintptr_t)write_word_asm);
+                        emit_byte(0x8D); // LEA
+                        emit_modrm_base_offset(REG_ARG1, EDX, 4);
+                        emit_mov_x86reg_armreg(REG_ARG2, data_reg + 1);
+                        emit_call_memory((uintptr_t)write_word_asm);
+                    }
+                } else if (is_load) {
                     if (type == SB) {
-                        emit_call_nosave((uintptr_t)read_byte_asm);
+                        emit_call_memory((uintptr_t)read_byte_asm);
                         // movsx eax,al
                         emit_word(0xBE0F);
                         emit_byte(0xC0);
                     } else {
-                        emit_call_nosave((uintptr_t)read_half_asm);
+                        emit_call_memory((uintptr_t)read_half_asm);
                         if (type == SH) {
                             // cwde
                             emit_byte(0x98);
@@ -520,11 +1580,19 @@ no_condition:
                     emit_mov_armreg_x86reg(data_reg, EAX);
                 } else {
                     emit_mov_x86reg_armreg(REG_ARG2, data_reg);
-                    emit_call_nosave((uintptr_t)write_half_asm);
+                    emit_call_memory((uintptr_t)write_half_asm);
                 }
 
-                if (post_index || pre_index)
-                    emit_alu_armreg_immediate(offset_op, base_reg, ((insn & 0x0F) | (insn >> 4 & 0xF0)));
+                if (writeback) {
+                    if (!post_index) {
+                        emit_mov_armreg_x86reg(base_reg, EDX);
+                    } else if (offset_is_imm) {
+                        emit_alu_armreg_immediate(offset_op, base_reg, offset);
+                    } else {
+                        emit_mov_x86reg_armreg(EAX, offset_reg);
+                        emit_alu_armreg_x86reg(offset_op, base_reg, EAX);
+                    }
+                }
             }
         } else if ((insn & 0xD900000) == 0x1000000) {
             if ((insn & 0xFFFFFD0) == 0x12FFF10) {
@@ -535,7 +1603,7 @@ no_condition:
                 emit_mov_x86reg_armreg(EAX, target_reg);
                 if (insn & 0x20)
                     emit_mov_armreg_immediate(14, pc + 4);
-                emit_jump((uintptr_t)translation_next_bx);
+                emit_leave((uintptr_t)translation_next_bx);
                 stop_here = 1;
             } else if ((insn & 0xFBF0FFF) == 0x10F0000) {
                 /* MRS - move reg <- status */
@@ -564,11 +1632,14 @@ no_condition:
                 if (insn & 0x0020000) mask |= 0x0000FF00;
                 if (insn & 0x0010000) mask |= 0x000000FF;
                 emit_mov_x86reg_immediate(REG_ARG2, mask);
+                emit_reg_writeback();
                 emit_call((insn & 0x0400000) ? (uintptr_t)set_spsr : (uintptr_t)set_cpsr);
+                // The mode and with it the banked registers may have changed
+                emit_reg_load();
                 // If cpsr_c changed, leave translation to check for interrupts
                 if ((insn & 0x0410000) == 0x0010000) {
                     emit_mov_x86reg_immediate(EAX, pc + 4);
-                    emit_jump((uintptr_t)translation_next);
+                    emit_leave((uintptr_t)translation_next);
                 }
             } else if ((insn & 0xFFF0FF0) == 0x16F0F10) {
                 /* CLZ: Count leading zeros */
@@ -576,6 +1647,7 @@ no_condition:
                 int dst_reg = insn >> 12 & 15;
                 if (src_reg == 15 || dst_reg == 15)
                     break;
+                emit_rex_armreg(src_reg);
                 emit_word(0xBD0F); // BSR
                 emit_modrm_armreg(EAX, src_reg);
                 emit_word(5 << 8 | JNZ);
@@ -694,8 +1766,14 @@ simple_shift:
                     if (op == 15)
                         imm = ~imm;
                     emit_mov_armreg_immediate(dest_reg, imm);
-                    if (setcc)
-                        goto unimpl;
+                    if (setcc) {
+                        /* The flags are known now */
+                        defer_mov_flag_immediate(&arm.cpsr_n, imm >> 31);
+                        defer_mov_flag_immediate(&arm.cpsr_z, imm == 0);
+                        if (set_carry >= 0)
+                            defer_mov_flag_immediate(&arm.cpsr_c, set_carry);
+                        setcc = 0;
+                    }
                 } else if (right_is_reg && dest_reg == right_reg) {
                     /* MOV/MVN of a register to itself */
                     if (op == 15) {
@@ -833,17 +1911,20 @@ simple_shift:
             }
 data_proc_done:
             if (setcc) {
-                emit_setcc_flag(SETS, &arm.cpsr_n);
-                emit_setcc_flag(SETZ, &arm.cpsr_z);
+                defer_setcc_flag(SETS, &arm.cpsr_n);
+                defer_setcc_flag(SETZ, &arm.cpsr_z);
                 if (set_carry >= 0) {
                     if (set_carry < 2)
-                        emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
+                        defer_mov_flag_immediate(&arm.cpsr_c, set_carry);
                     else
-                        emit_setcc_flag(set_carry, &arm.cpsr_c);
+                        defer_setcc_flag(set_carry, &arm.cpsr_c);
                 }
                 if (set_overflow >= 0)
-                    emit_setcc_flag(set_overflow, &arm.cpsr_v);
+                    defer_setcc_flag(set_overflow, &arm.cpsr_v);
             }
+        } else if (ba_constant(&analysis, ba_index)) {
+            /* LDR of a literal folded into a constant */
+            emit_mov_armreg_immediate(insn >> 12 & 15, analysis.insns[ba_index].value);
         } else if ((insn & 0xC000000) == 0x4000000) {
             /* Byte/word memory access */
             int post_index = !(insn & (1 << 24));
@@ -855,8 +1936,6 @@ data_proc_done:
             int data_reg = insn >> 12 & 15;
 
             if (pre_index || post_index) {
-                // Pre-indexed addressing is broken (maybe data abort issues?)
-                if (pre_index) break;
                 if (pre_index && post_index) break;
                 if (base_reg == 15) break;
                 if (is_load && base_reg == data_reg) break;
@@ -908,7 +1987,7 @@ data_proc_done:
 
             if (is_load) {
                 /* LDR/LDRB instruction */
-                emit_call_nosave(is_byteop ? (uintptr_t)read_byte_asm : (uintptr_t)read_word_asm);
+                emit_call_memory(is_byteop ? (uintptr_t)read_byte_asm : (uintptr_t)read_word_asm);
                 if (data_reg != 15)
                     emit_mov_armreg_x86reg(data_reg, EAX);
             } else {
@@ -917,7 +1996,7 @@ data_proc_done:
                     emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
                 else
                     emit_mov_x86reg_armreg(REG_ARG2, data_reg);
-                emit_call_nosave(is_byteop ? (uintptr_t)write_byte_asm : (uintptr_t)write_word_asm);
+                emit_call_memory(is_byteop ? (uintptr_t)write_byte_asm : (uintptr_t)write_word_asm);
             }
 
             if (pre_index || post_index) { // Writeback
@@ -928,7 +2007,7 @@ data_proc_done:
             }
 
             if (is_load && data_reg == 15) {
-                emit_jump((uintptr_t)translation_next_bx);
+                emit_leave((uintptr_t)translation_next_bx);
                 stop_here = 1;
             }
         } else if ((insn & 0xE000000) == 0x8000000) {
@@ -937,14 +2016,23 @@ data_proc_done:
             int load      = insn & (1 << 20);
             int reg, offset, wb_offset, count;
             bool loaded_addr_reg = false;
-
-            if (insn & (1 << 22)) // restore CPSR, or use umode regs
-                goto unimpl;
+            bool user_regs = false;
 
             int addr_reg = insn >> 16 & 15;
             if (addr_reg == 15)
                 goto unimpl;
 
+            if (insn & (1 << 22)) {
+                if (load && insn & (1 << 15))
+                    goto unimpl; // restore CPSR
+                if (writeback || (load && insn & (1 << addr_reg)))
+                    goto unimpl;
+                // Use umode regs. Only r8-r14 can differ from the current ones.
+                user_regs = insn & 0x7F00;
+                if (user_regs)
+                    emit_reg_writeback();
+            }
+
             if (writeback && load && insn & (1 << addr_reg))
                 goto unimpl;
 
@@ -967,11 +2055,24 @@ data_proc_done:
             for (reg = 0; reg < 16; reg++) {
                 if (!(insn >> reg & 1))
                     continue;
+                bool user_reg = user_regs && reg >= 8 && reg < 15;
+                if (user_reg && !load) {
+                    emit_mov_x86reg_immediate(REG_ARG1, reg);
+                    emit_call((uintptr_t)user_reg_ptr);
+                    emit_byte(0x8B); // mov (%rax), %esi
+                    emit_modrm_base_offset(REG_ARG2, EAX, 0);
+                }
                 emit_byte(0x8D); // LEA
                 emit_modrm_base_offset(REG_ARG1, EDX, offset);
                 if (load) {
-                    emit_call_nosave((uintptr_t)read_word_asm);
-                    if (reg == addr_reg && (insn & ~0u << reg & 0xFFFF)) {
+                    emit_call_memory((uintptr_t)read_word_asm);
+                    if (user_reg) {
+                        emit_mov_x86reg_x86reg(REG_ARG2, EAX);
+                        emit_mov_x86reg_immediate(REG_ARG1, reg);
+                        emit_call((uintptr_t)user_reg_ptr);
+                        emit_byte(0x89); // mov %esi, (%rax)
+                        emit_modrm_base_offset(REG_ARG2, EAX, 0);
+                    } else if (reg == addr_reg && (insn & ~0u << reg & 0xFFFF)) {
                         // Loading the address register, but there are still more
                         // registers to go. In case they cause a data abort, don't
                         // write to register yet; save it to ECX
@@ -982,13 +2083,19 @@ data_proc_done:
                 } else {
                     if (reg == 15)
                         emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
-                    else
+                    else if (!user_reg)
                         emit_mov_x86reg_armreg(REG_ARG2, reg);
-                    emit_call_nosave((uintptr_t)write_word_asm);
+                    emit_call_memory((uintptr_t)write_word_asm);
                 }
                 offset += 4;
             }
 
+            if (user_regs && load) {
+                // The cached registers may have been loaded behind their back
+                emit_reg_writeback();
+                emit_reg_load();
+            }
+
             if (writeback)
                 emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
 
@@ -997,15 +2104,15 @@ data_proc_done:
 
             if (insn & (1 << 15) && load) {
                 // LDM with PC
-                emit_jump((uintptr_t)translation_next_bx);
+                emit_leave((uintptr_t)translation_next_bx);
                 stop_here = 1;
             }
         } else if ((insn & 0xE000000) == 0xA000000) {
             /* Branch, branch-and-link */
+            uint32_t target = pc + 8 + ((int32_t)(insn << 8) >> 6);
             if (insn & (1 << 24))
                 emit_mov_armreg_immediate(14, pc + 4);
-            emit_mov_x86reg_immediate(EAX, pc + 8 + ((int32_t)(insn << 8) >> 6));
-            emit_jump((uintptr_t)translation_next);
+            emit_exit(target, PAGE_INSN_PTR(target), false);
             stop_here = 1;
         } else {
             break;
@@ -1013,17 +2120,24 @@ data_proc_done:
 
         /* Fill in the conditional jump offset */
         if (cond_jmp_offset) {
-            if (out - cond_jmp_offset > 0x7F)
+            emit_flags_flush(0);
+            if (out - cond_jmp_offset > 0x7F) {
+                end_reason = BLOCK_END_COND_TOO_LONG;
                 goto unimpl; /* yes, this could happen (with large LDM/STM) */
+            }
             cond_jmp_offset[-1] = out - cond_jmp_offset;
+            // Skipping the instruction leaves the registers dirty as before
+            reg_dirty |= insn_dirty;
         }
 
-        RAM_FLAGS(insnp) |= (RF_CODE_TRANSLATED | next_index << RFS_TRANSLATION_INDEX);
         pc += 4;
         insnp++;
+        if (host_cond)
+            *out_host_cond++ = (struct host_cond_entry){ outj, cond_jmp_offset, out, cond, NULL };
         *outj++ = insn_start;
 
         if (stop_here) {
+            end_reason = BLOCK_END_BRANCH;
             if (cond == 0x0E)
                 goto branch_unconditional;
             else
@@ -1032,71 +2146,942 @@ data_proc_done:
     }
 unimpl:
     out = insn_start;
-    RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    reg_dirty = insn_dirty;
+    while (out_exit > exit_scratch && out_exit[-1].code >= insn_start)
+        out_exit--;
+    emit_flags_unkill();
+    flag_no_translate(insnp);
 branch_conditional:
-    emit_mov_x86reg_immediate(EAX, pc);
-    emit_jump((uintptr_t)translation_next);
+    emit_flags_flush(0);
+    emit_exit(pc, PAGE_INSN_PTR(pc), false);
 branch_unconditional:
+    if (!retried && ba_truncate(&analysis, (pc - analysis.pc) >> 2)) {
+        retried = true;
+        retry_pc = analysis.pc;
+        retry_count = analysis.count;
+        retry_reason = end_reason;
+        goto retry;
+    }
+    if (retried)
+        end_reason = retry_reason;
+    if (worker_job) {
+        background_done(insnp, analysis.literals, end_reason);
+        return;
+    }
+    if (fallback_stats_enabled)
+        fallback_stats_block_end(end_reason, insnp, false);
 
     if (pc == start_pc)
         return;
 
-    int index = next_index++;
-
     //jump_table[0] is pointer to code on pc=start_ptr
     //jump_table[1] is pointer to code on pc=start_ptr+4
-    translation_table[index].jump_table = (void**) jtbl_bufptr;
-    translation_table[index].start_ptr  = start_insnp;
-    translation_table[index].end_ptr    = insnp;
+    translation_commit(index, start_pc, start_insnp, insnp, analysis.literals, false);
+}
+
+/* Emits the N and Z flag update for a result in EAX. */
+static void emit_thumb_set_nz() {
+    emit_test_x86reg_x86reg(EAX, EAX);
+    defer_setcc_flag(SETS, &arm.cpsr_n);
+    defer_setcc_flag(SETZ, &arm.cpsr_z);
+}
+
+/* Emits the flag update after an x86 ADD/ADC (carry) or SUB/SBB/CMP (borrow) */
+static void emit_thumb_set_nzcv(bool borrow) {
+    defer_setcc_flag(SETS, &arm.cpsr_n);
+    defer_setcc_flag(SETZ, &arm.cpsr_z);
+    defer_setcc_flag(borrow ? SETAE : SETB, &arm.cpsr_c);
+    defer_setcc_flag(SETO, &arm.cpsr_v);
+}
+
+static void translate_thumb_block(uint32_t start_pc, uint16_t *start_insnp, int index) {
+    bool retried = false;
+    uint32_t retry_pc = 0;
+    int retry_count = 0;
+    enum block_end retry_reason = BLOCK_END_UNIMPLEMENTED;
+retry:;
+    uint32_t pc = start_pc;
+    uint16_t *insnp = start_insnp;
+    uint32_t page_pc = start_pc;
+    uint16_t *page_insnp = start_insnp;
+    int pages = 1;
+
+    code_alloc_restart();
+    reg_alloc(start_insnp, start_pc, true);
+    memset(flags_pending, 0, sizeof flags_pending);
+    ba_build(&analysis, pc, insnp, true, retried && pc == retry_pc ? retry_count : BA_MAX_INSNS, insn_flags);
+
+    /* Flags are per word, so blocks only end on a word boundary unless
+     * there's an untranslatable instruction. An instruction in the second
+     * half of a word after a block exit is translated anyway: it's only
+     * reachable through the jump table. */
+    uint8_t *insn_start;
+    uint16_t insn_dirty = 0;
+    int stop_here = 0, unconditional = 0;
+    enum block_end end_reason = BLOCK_END_UNIMPLEMENTED;
+    while (1) {
+        if (!(pc & 2)) {
+            if (stop_here) {
+                end_reason = BLOCK_END_BRANCH;
+                if (unconditional)
+                    goto branch_unconditional;
+                else
+                    goto branch_conditional;
+            }
+            if (!code_space_left()) {
+                end_reason = BLOCK_END_CODE_SPACE;
+                goto branch_conditional;
+            }
+            if ((pc ^ page_pc) & ~0x3FF) {
+                if (pages == SUPERBLOCK_MAX_PAGES || !superblock_can_continue(pc, insnp)) {
+                    end_reason = BLOCK_END_PAGE;
+                    goto branch_conditional;
+                }
+                emit_page_guard(pc, insnp, true);
+                page_pc = pc;
+                page_insnp = insnp;
+                pages++;
+                ba_build(&analysis, pc, insnp, true, retried && pc == retry_pc ? retry_count : BA_MAX_INSNS, insn_flags);
+            }
+            if (insn_flags(insnp) & DONT_TRANSLATE) {
+                end_reason = dont_translate_reason(insn_flags(insnp));
+                goto branch_conditional;
+            }
+        }
+        uint16_t insn = *insnp;
+        int rd = insn & 7, rn = insn >> 3 & 7;
+        int exits = 0;
+        int ba_index = (pc - analysis.pc) >> 1;
+
+        emit_flags_flush(ba_flags_dead(&analysis, ba_index - 1));
+
+        insn_start = out;
+        insn_dirty = reg_dirty;
+
+        switch (insn >> 11) {
+        case 0x00: case 0x01: case 0x02: { /* LSL/LSR/ASR Rd, Rm, #imm */
+            static const uint8_t shift_table[] = { SHL, SHR, SAR };
+            int count = insn >> 6 & 31;
+            if (count == 0 && insn >> 11 != 0)
+                goto unimpl; // LSR/ASR #32
+            emit_mov_x86reg_armreg(EAX, rn);
+            if (count == 0) {
+                emit_mov_armreg_x86reg(rd, EAX);
+                emit_thumb_set_nz();
+                break;
+            }
+            emit_shift_x86reg(shift_table[insn >> 11], EAX, count);
+            defer_setcc_flag(SETB, &arm.cpsr_c);
+            defer_setcc_flag(SETS, &arm.cpsr_n);
+            defer_setcc_flag(SETZ, &arm.cpsr_z);
+            emit_mov_armreg_x86reg(rd, EAX);
+            break;
+        }
+        case 0x03: { /* ADD/SUB Rd, Rn, Rm/#imm */
+            int aluop = (insn & 0x200) ? SUB : ADD;
+            emit_mov_x86reg_armreg(EAX, rn);
+            if (insn & 0x400)
+                emit_alu_x86reg_immediate(aluop, EAX, insn >> 6 & 7);
+            else
+                emit_alu_x86reg_armreg(aluop, EAX, insn >> 6 & 7);
+            emit_thumb_set_nzcv(aluop == SUB);
+            emit_mov_armreg_x86reg(rd, EAX);
+            break;
+        }
+        case 0x04: /* MOV Rd, #imm */
+            rd = insn >> 8 & 7;
+            emit_mov_armreg_immediate(rd, insn & 0xFF);
+            defer_mov_flag_immediate(&arm.cpsr_n, 0);
+            defer_mov_flag_immediate(&arm.cpsr_z, (insn & 0xFF) == 0);
+            break;
+        case 0x05: case 0x06: case 0x07: { /* CMP/ADD/SUB Rd, #imm */
+            static const uint8_t alu_table[] = { CMP, ADD, SUB };
+            int aluop = alu_table[(insn >> 11) - 5];
+            emit_alu_armreg_immediate(aluop, insn >> 8 & 7, insn & 0xFF);
+            emit_thumb_set_nzcv(aluop != ADD);
+            break;
+        }
+        case 0x08:
+            if (insn < 0x4400) {
+                /* Data processing */
+                switch (insn >> 6 & 15) {
+                    case 0x0: /* AND */
+                    case 0x1: /* EOR */
+                    case 0xC: /* ORR */
+                    case 0xE: /* BIC */ {
+                        static const uint8_t alu_table[] = { [0x0] = AND, [0x1] = XOR, [0xC] = OR, [0xE] = AND };
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        if ((insn >> 6 & 15) == 0xE)
+                            emit_unary_x86reg(NOT, EAX);
+                        emit_alu_armreg_x86reg(alu_table[insn >> 6 & 15], rd, EAX);
+                        defer_setcc_flag(SETS, &arm.cpsr_n);
+                        defer_setcc_flag(SETZ, &arm.cpsr_z);
+                        break;
+                    }
+                    case 0x2: /* LSL */
+                    case 0x3: /* LSR */
+                    case 0x4: /* ASR */
+                    case 0x7: /* ROR */ {
+                        static const uint8_t shift_type[] = { [0x2] = 0, [0x3] = 1, [0x4] = 2, [0x7] = 3 };
+                        emit_mov_x86reg_armreg(ECX, rn);
+                        emit_mov_x86reg_armreg(EAX, rd);
+                        emit_call_nosave(arm_shift_proc[1][shift_type[insn >> 6 & 15]]);
+                        emit_mov_armreg_x86reg(rd, EAX);
+                        emit_thumb_set_nz();
+                        break;
+                    }
+                    case 0x5: /* ADC */
+                        emit_mov_x86reg8_immediate(CL, 0);
+                        emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_alu_armreg_x86reg(ADC, rd, EAX);
+                        emit_thumb_set_nzcv(false);
+                        break;
+                    case 0x6: /* SBC */
+                        emit_cmp_flag_immediate(&arm.cpsr_c, 1);
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_alu_armreg_x86reg(SBB, rd, EAX);
+                        emit_thumb_set_nzcv(true);
+                        break;
+                    case 0x8: /* TST */
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_test_armreg_x86reg(rd, EAX);
+                        defer_setcc_flag(SETS, &arm.cpsr_n);
+                        defer_setcc_flag(SETZ, &arm.cpsr_z);
+                        break;
+                    case 0x9: /* NEG */
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_unary_x86reg(NEG, EAX);
+                        emit_thumb_set_nzcv(true);
+                        emit_mov_armreg_x86reg(rd, EAX);
+                        break;
+                    case 0xA: /* CMP */
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_alu_armreg_x86reg(CMP, rd, EAX);
+                        emit_thumb_set_nzcv(true);
+                        break;
+                    case 0xB: /* CMN */
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_alu_x86reg_armreg(ADD, EAX, rd);
+                        emit_thumb_set_nzcv(false);
+                        break;
+                    case 0xD: /* MUL */
+                        emit_mov_x86reg_armreg(EAX, rd);
+                        emit_unary_armreg(MUL, rn);
+                        emit_mov_armreg_x86reg(rd, EAX);
+                        emit_thumb_set_nz();
+                        break;
+                    case 0xF: /* MVN */
+                        emit_mov_x86reg_armreg(EAX, rn);
+                        emit_unary_x86reg(NOT, EAX);
+                        emit_mov_armreg_x86reg(rd, EAX);
+                        emit_thumb_set_nz();
+                        break;
+                }
+            } else if (insn < 0x4700) {
+                /* ADD/CMP/MOV with high registers */
+                int op = insn >> 8 & 3;
+                rd = (insn >> 4 & 8) | (insn & 7);
+                int rm = insn >> 3 & 15;
+                if (op == 1) {
+                    /* CMP */
+                    if (rd == 15)
+                        goto unimpl;
+                    if (rm == 15) {
+                        emit_alu_armreg_immediate(CMP, rd, pc + 4);
+                    } else {
+                        emit_mov_x86reg_armreg(EAX, rm);
+                        emit_alu_armreg_x86reg(CMP, rd, EAX);
+                    }
+                    emit_thumb_set_nzcv(true);
+                } else if (rd == 15) {
+                    /* ADD PC, Rm / MOV PC, Rm: stays in THUMB state */
+                    if (rm == 15)
+                        emit_mov_x86reg_immediate(EAX, pc + 4);
+                    else
+                        emit_mov_x86reg_armreg(EAX, rm);
+                    if (op == 0)
+                        emit_alu_x86reg_immediate(ADD, EAX, pc + 4);
+                    emit_alu_x86reg_immediate(AND, EAX, ~1);
+                    emit_leave((uintptr_t)translation_next_thumb);
+                    stop_here = exits = 1;
+                } else if (rm == 15) {
+                    if (op == 0)
+                        emit_alu_armreg_immediate(ADD, rd, pc + 4);
+                    else
+                        emit_mov_armreg_immediate(rd, pc + 4);
+                } else {
+                    emit_mov_x86reg_armreg(EAX, rm);
+                    if (op == 0)
+                        emit_alu_armreg_x86reg(ADD, rd, EAX);
+                    else
+                        emit_mov_armreg_x86reg(rd, EAX);
+                }
+            } else {
+                /* BX/BLX Rm */
+                int rm = insn >> 3 & 15;
+                if (rm == 15)
+                    emit_mov_x86reg_immediate(EAX, pc + 4);
+                else
+                    emit_mov_x86reg_armreg(EAX, rm);
+                if (insn & 0x80)
+                    emit_mov_armreg_immediate(14, pc + 3);
+                emit_leave((uintptr_t)translation_next_bx);
+                stop_here = exits = 1;
+            }
+            break;
+        case 0x09: /* LDR Rd, [PC, #imm] */
+            if (ba_constant(&analysis, ba_index)) {
+                emit_mov_armreg_immediate(insn >> 8 & 7, analysis.insns[ba_index].value);
+                break;
+            }
+            emit_mov_x86reg_immediate(REG_ARG1, ((pc + 4) & ~3) + ((insn & 0xFF) << 2));
+            emit_call_memory((uintptr_t)read_word_asm);
+            emit_mov_armreg_x86reg(insn >> 8 & 7, EAX);
+            break;
+        case 0x0A: case 0x0B: { /* Load/store with register offset */
+            static const uintptr_t access_table[] = {
+                (uintptr_t)write_word_asm, (uintptr_t)write_half_asm,
+                (uintptr_t)write_byte_asm, (uintptr_t)read_byte_asm,
+                (uintptr_t)read_word_asm,  (uintptr_t)read_half_asm,
+                (uintptr_t)read_byte_asm,  (uintptr_t)read_half_asm,
+            };
+            int op = insn >> 9 & 7;
+            emit_mov_x86reg_armreg(REG_ARG1, rn);
+            emit_alu_x86reg_armreg(ADD, REG_ARG1, insn >> 6 & 7);
+            if (op < 3)
+                emit_mov_x86reg_armreg(REG_ARG2, rd);
+            emit_call_memory(access_table[op]);
+            if (op == 3) {
+                // movsx eax,al
+                emit_word(0xBE0F);
+                emit_byte(0xC0);
+            } else if (op == 7) {
+                // cwde
+                emit_byte(0x98);
+            }
+            if (op >= 3)
+                emit_mov_armreg_x86reg(rd, EAX);
+            break;
+        }
+        case 0x0C: case 0x0D: case 0x0E: case 0x0F: case 0x10: case 0x11: {
+            /* Load/store with immediate offset */
+            static const uintptr_t access_table[][2] = {
+                { (uintptr_t)write_word_asm, (uintptr_t)read_word_asm },
+                { (uintptr_t)write_byte_asm, (uintptr_t)read_byte_asm },
+                { (uintptr_t)write_half_asm, (uintptr_t)read_half_asm },
+            };
+            static const uint8_t offset_shift[] = { 2, 0, 1 };
+            int type = ((insn >> 11) - 0x0C) >> 1;
+            int is_load = insn >> 11 & 1;
+            emit_mov_x86reg_armreg(REG_ARG1, rn);
+            int offset = (insn >> 6 & 31) << offset_shift[type];
+            if (offset)
+                emit_alu_x86reg_immediate(ADD, REG_ARG1, offset);
+            if (!is_load)
+                emit_mov_x86reg_armreg(REG_ARG2, rd);
+            emit_call_memory(access_table[type][is_load]);
+            if (is_load)
+                emit_mov_armreg_x86reg(rd, EAX);
+            break;
+        }
+        case 0x12: case 0x13: /* STR/LDR Rd, [SP, #imm] */
+            rd = insn >> 8 & 7;
+            emit_mov_x86reg_armreg(REG_ARG1, 13);
+            if (insn & 0xFF)
+                emit_alu_x86reg_immediate(ADD, REG_ARG1, (insn & 0xFF) << 2);
+            if (insn & 0x800) {
+                emit_call_memory((uintptr_t)read_word_asm);
+                emit_mov_armreg_x86reg(rd, EAX);
+            } else {
+                emit_mov_x86reg_armreg(REG_ARG2, rd);
+                emit_call_memory((uintptr_t)write_word_asm);
+            }
+            break;
+        case 0x14: /* ADD Rd, PC, #imm */
+            emit_mov_armreg_immediate(insn >> 8 & 7, ((pc + 4) & ~3) + ((insn & 0xFF) << 2));
+            break;
+        case 0x15: /* ADD Rd, SP, #imm */
+            emit_mov_x86reg_armreg(EAX, 13);
+            if (insn & 0xFF)
+                emit_alu_x86reg_immediate(ADD, EAX, (insn & 0xFF) << 2);
+            emit_mov_armreg_x86reg(insn >> 8 & 7, EAX);
+            break;
+        case 0x16: case 0x17: {
+            int reg, count, offset;
+            if ((insn & 0xFF00) == 0xB000) {
+                /* ADD/SUB SP, #imm */
+                emit_alu_armreg_immediate((insn & 0x80) ? SUB : ADD, 13, (insn & 0x7F) << 2);
+                break;
+            }
+            if ((insn & 0x0600) != 0x0400)
+                goto unimpl; // BKPT or undefined
+
+            for (reg = count = 0; reg < 9; reg++)
+                count += insn >> reg & 1;
+            if (count == 0)
+                goto unimpl;
+
+            emit_mov_x86reg_armreg(EDX, 13);
+            if (!(insn & 0x800)) {
+                /* PUSH {reglist[,LR]} */
+                for (reg = 0, offset = count * -4; reg < 9; reg++) {
+                    if (!(insn >> reg & 1))
+                        continue;
+                    emit_byte(0x8D); // LEA
+                    emit_modrm_base_offset(REG_ARG1, EDX, offset);
+                    emit_mov_x86reg_armreg(REG_ARG2, reg == 8 ? 14 : reg);
+                    emit_call_memory((uintptr_t)write_word_asm);
+                    offset += 4;
+                }
+                emit_alu_armreg_immediate(SUB, 13, count * 4);
+            } else {
+                /* POP {reglist[,PC]} */
+                for (reg = 0, offset = 0; reg < 9; reg++) {
+                    if (!(insn >> reg & 1))
+                        continue;
+                    emit_byte(0x8D); // LEA
+                    emit_modrm_base_offset(REG_ARG1, EDX, offset);
+                    emit_call_memory((uintptr_t)read_word_asm);
+                    if (reg != 8)
+                        emit_mov_armreg_x86reg(reg, EAX);
+                    offset += 4;
+                }
+                emit_alu_armreg_immediate(ADD, 13, count * 4);
+                if (insn & 0x100) {
+                    emit_leave((uintptr_t)translation_next_bx);
+                    stop_here = exits = 1;
+                }
+            }
+            break;
+        }
+        case 0x18: case 0x19: {
+            /* STMIA/LDMIA Rn!, {reglist} */
+            int reg, count, offset;
+            int is_load = insn & 0x800;
+            int base_reg = insn >> 8 & 7;
+            bool loaded_base_reg = false;
+            if (!(insn & 0xFF))
+                goto unimpl;
+            for (reg = count = 0; reg < 8; reg++)
+                count += insn >> reg & 1;
+
+            emit_mov_x86reg_armreg(EDX, base_reg);
+            for (reg = 0, offset = 0; reg < 8; reg++) {
+                if (!(insn >> reg & 1))
+                    continue;
+                emit_byte(0x8D); // LEA
+                emit_modrm_base_offset(REG_ARG1, EDX, offset);
+                if (is_load) {
+                    emit_call_memory((uintptr_t)read_word_asm);
+                    if (reg == base_reg) {
+                        // Written last, so the base is unchanged on a data abort
+                        emit_mov_x86reg_x86reg(ECX, EAX);
+                        loaded_base_reg = true;
+                    } else {
+                        emit_mov_armreg_x86reg(reg, EAX);
+                    }
+                } else {
+                    emit_mov_x86reg_armreg(REG_ARG2, reg);
+                    emit_call_memory((uintptr_t)write_word_asm);
+                }
+                offset += 4;
+            }
+            if (loaded_base_reg)
+                emit_mov_armreg_x86reg(base_reg, ECX);
+            else
+                emit_alu_armreg_immediate(ADD, base_reg, count * 4);
+            break;
+        }
+        case 0x1A: case 0x1B: {
+            /* Conditional branch */
+            int cond = insn >> 8 & 15;
+            if (cond >= 0xE)
+                goto unimpl; // undefined or SWI
+            uint32_t target = pc + 4 + ((int8_t)insn << 1);
+            uint8_t *cond_jmp_offset = emit_cond_skip_host(cond);
+            bool host_cond = cond_jmp_offset != NULL;
+            if (!host_cond)
+                cond_jmp_offset = emit_cond_skip(cond);
+            emit_exit(target, PAGE_INSN_PTR(target), true);
+            if (out - cond_jmp_offset > 0x7F) {
+                end_reason = BLOCK_END_COND_TOO_LONG;
+                goto unimpl;
+            }
+            cond_jmp_offset[-1] = out - cond_jmp_offset;
+            reg_dirty |= insn_dirty;
+            if (host_cond)
+                *out_host_cond++ = (struct host_cond_entry){ outj, cond_jmp_offset, out, cond, NULL };
+            stop_here = 1;
+            break;
+        }
+        case 0x1C: { /* B */
+            uint32_t target = pc + 4 + ((int32_t)insn << 21 >> 20);
+            emit_exit(target, PAGE_INSN_PTR(target), true);
+            stop_here = exits = 1;
+            break;
+        }
+        case 0x1D: /* Second half of BLX */
+            emit_mov_x86reg_armreg(EAX, 14);
+            emit_alu_x86reg_immediate(ADD, EAX, (insn & 0x7FF) << 1);
+            emit_alu_x86reg_immediate(AND, EAX, ~3);
+            emit_mov_armreg_immediate(14, pc + 3);
+            emit_leave((uintptr_t)translation_next_bx);
+            stop_here = exits = 1;
+            break;
+        case 0x1E: /* First half of BL/BLX */
+            emit_mov_armreg_immediate(14, pc + 4 + ((int32_t)insn << 21 >> 9));
+            break;
+        case 0x1F: /* Second half of BL */
+            emit_mov_x86reg_armreg(EAX, 14);
+            emit_alu_x86reg_immediate(ADD, EAX, (insn & 0x7FF) << 1);
+            emit_mov_armreg_immediate(14, pc + 3);
+            emit_leave((uintptr_t)translation_next_thumb);
+            stop_here = exits = 1;
+            break;
+        }
 
-    insn_bufptr = out;
-    jtbl_bufptr = outj;
+        unconditional = exits;
+        pc += 2;
+        insnp++;
+        *outj++ = insn_start;
+    }
+unimpl:
+    out = insn_start;
+    reg_dirty = insn_dirty;
+    while (out_exit > exit_scratch && out_exit[-1].code >= insn_start)
+        out_exit--;
+    emit_flags_unkill();
+    // If the first half of the word is part of this block, the second half
+    // can't start another one anyway
+    if (!(pc & 2) || pc == start_pc)
+        flag_no_translate(insnp);
+    // The previous instruction may have been an unconditional exit
+    if (unconditional)
+        goto branch_unconditional;
+branch_conditional:
+    emit_flags_flush(0);
+    emit_exit(pc, PAGE_INSN_PTR(pc), true);
+branch_unconditional:
+    if (!retried && ba_truncate(&analysis, (pc - analysis.pc) >> 1)) {
+        retried = true;
+        retry_pc = analysis.pc;
+        retry_count = analysis.count;
+        retry_reason = end_reason;
+        goto retry;
+    }
+    if (retried)
+        end_reason = retry_reason;
+    if (worker_job) {
+        background_done(insnp, analysis.literals, end_reason);
+        return;
+    }
+    if (fallback_stats_enabled)
+        fallback_stats_block_end(end_reason, insnp, true);
+
+    if (pc == start_pc)
+        return;
+
+    //jump_table[0] is pointer to code on pc=start_ptr
+    //jump_table[1] is pointer to code on pc=start_ptr+2
+    translation_commit(index, start_pc, start_insnp, insnp, analysis.literals, true);
+}
+
+// Translates the block at start_pc right away
+static void translate_block(uint32_t start_pc, void *start_ptr, bool thumb) {
+    translation_make_room();
+    if (thumb)
+        translate_thumb_block(start_pc, start_ptr, translation_next_index());
+    else
+        translate_arm_block(start_pc, start_ptr, translation_next_index());
+}
+
+/* With FIREBIRD_JIT_THREAD=1, the interpreter doesn't wait for blocks to
+ * be translated: they're queued and translated by a worker thread, while
+ * the interpreter goes on running them. The worker gets a block with the
+ * index and the space in insn_buffer reserved for it, and translates it in
+ * place. The interpreter then checks the words of the block weren't written
+ * in the meantime and enters it between two instructions, see
+ * translate_background_publish. A single block is translated at a time,
+ * the most recently queued one first, as that's the code running now. */
+#define BACKGROUND_QUEUE_SIZE 64
+
+static bool background_enabled;
+static struct background_job background_queue[BACKGROUND_QUEUE_SIZE];
+static int background_queue_count;
+// The job given to the worker, background_busy until it's published
+static struct background_job background_job;
+static bool background_busy;
+bool translation_background_done;
+
+static pthread_t background_thread;
+static pthread_mutex_t background_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_cond = PTHREAD_COND_INITIALIZER;
+static bool background_start, background_quit;
+
+static void *background_worker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&background_mutex);
+    while (1) {
+        while (!background_start && !background_quit)
+            pthread_cond_wait(&background_cond, &background_mutex);
+        if (background_quit)
+            break;
+        background_start = false;
+        pthread_mutex_unlock(&background_mutex);
+
+        worker_job = &background_job;
+        worker_job->no_translate_ptr = NULL;
+        if (worker_job->thumb)
+            translate_thumb_block(worker_job->pc, worker_job->ptr, worker_job->index);
+        else
+            translate_arm_block(worker_job->pc, worker_job->ptr, worker_job->index);
+        worker_job = NULL;
+
+        pthread_mutex_lock(&background_mutex);
+        __atomic_store_n(&translation_background_done, true, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&background_cond);
+    }
+    pthread_mutex_unlock(&background_mutex);
+    return NULL;
+}
+
+// Gives the words reserved for job back
+static void background_unmark(struct background_job *job) {
+    uint32_t *word = (uint32_t *)((uintptr_t)job->ptr & ~3);
+    for (; word < (uint32_t *)job->marked_end; word++)
+        RAM_FLAGS(word) &= ~RF_CODE_NO_TRANSLATE;
+}
+
+// Gives the most recently queued block to the worker, if it's idle
+static void background_issue() {
+    if (background_busy || !background_queue_count)
+        return;
+
+    background_job = background_queue[--background_queue_count];
+    translation_make_room();
+    background_job.index = translation_next_index();
+    translation_take_index(background_job.index);
+    background_job.code_start = out_start;
+    background_busy = true;
+
+    pthread_mutex_lock(&background_mutex);
+    __atomic_store_n(&translation_background_done, false, __ATOMIC_RELAXED);
+    background_start = true;
+    pthread_cond_broadcast(&background_cond);
+    pthread_mutex_unlock(&background_mutex);
+}
+
+static void background_wait() {
+    pthread_mutex_lock(&background_mutex);
+    while (!translation_background_done)
+        pthread_cond_wait(&background_cond, &background_mutex);
+    pthread_mutex_unlock(&background_mutex);
+}
+
+/* Queues the block at pc. Its words up to the end of the page or the first
+ * one which can't be translated get flagged RF_CODE_NO_TRANSLATE, so that
+ * the interpreter doesn't queue them again and writes to them get noticed. */
+static void background_queue_block(uint32_t pc, void *ptr, bool thumb) {
+    if (background_queue_count == BACKGROUND_QUEUE_SIZE) {
+        background_unmark(&background_queue[0]);
+        background_queue_count--;
+        memmove(&background_queue[0], &background_queue[1], background_queue_count * sizeof(*background_queue));
+    }
+
+    struct background_job *job = &background_queue[background_queue_count++];
+    job->pc = pc;
+    job->ptr = ptr;
+    job->thumb = thumb;
+    job->stale = false;
+    uint32_t *start = (uint32_t *)((uintptr_t)ptr & ~3), *word = start;
+    uint32_t *page_end = (uint32_t *)((uintptr_t)start + 0x400 - (pc & 0x3FC));
+    for (; word < page_end && !(RAM_FLAGS(word) & DONT_TRANSLATE); word++)
+        RAM_FLAGS(word) |= RF_CODE_NO_TRANSLATE;
+    job->marked_end = word;
+    protect_code_page(ptr);
+
+    // The block being translated lost these marks by a write
+    if (background_busy && (void *)start < background_job.marked_end
+            && (void *)word > (void *)((uintptr_t)background_job.ptr & ~3))
+        background_job.stale = true;
+
+    background_issue();
+}
+
+void translate_background_publish() {
+    struct background_job *job = &background_job;
+    background_busy = false;
+    __atomic_store_n(&translation_background_done, false, __ATOMIC_RELAXED);
+
+    // The words read by the worker must still be reserved, without other flags
+    bool stale = job->stale;
+    uint32_t *word = (uint32_t *)((uintptr_t)job->ptr & ~3);
+    uint32_t *end = (uint32_t *)((uintptr_t)job->end_ptr & ~3) + 1;
+    if (end > (uint32_t *)job->marked_end)
+        end = job->marked_end;
+    for (; word < end && !stale; word++)
+        stale = (RAM_FLAGS(word) & DONT_TRANSLATE) != RF_CODE_NO_TRANSLATE;
+    for (int n = 0; n < BA_MAX_POOL_WORDS && !stale; n++) {
+        if (!(job->literals >> n & 1))
+            continue;
+        word = literal_word(job->end_ptr, n);
+        stale = word >= (uint32_t *)job->marked_end
+                || (RAM_FLAGS(word) & DONT_TRANSLATE) != RF_CODE_NO_TRANSLATE;
+    }
+    background_unmark(job);
+
+    if (stale) {
+        free_indices[free_index_count++] = job->index;
+        translation_stats.background_stale++;
+    } else {
+        if (job->no_translate_ptr)
+            flag_no_translate(job->no_translate_ptr);
+        if (fallback_stats_enabled)
+            fallback_stats_block_end(job->end_reason, job->end_ptr, job->thumb);
+        if (job->end_ptr == job->ptr) {
+            free_indices[free_index_count++] = job->index;
+        } else {
+            // The code was written by another thread
+            __asm__ __volatile__("cpuid" : : "a"(0) : "rbx", "rcx", "rdx", "memory");
+            code_alloc_mark(job->code_start, job->code_end);
+            translation_add(job->index, job->pc, job->ptr, job->end_ptr, job->literals, job->thumb,
+                            job->jump_table, job->code_end);
+            translation_stats.background++;
+        }
+    }
+
+    background_issue();
+}
+
+// Drops the queued blocks and the one being translated
+static void background_cancel() {
+    if (background_busy) {
+        background_wait();
+        background_busy = false;
+        __atomic_store_n(&translation_background_done, false, __ATOMIC_RELAXED);
+        background_unmark(&background_job);
+        free_indices[free_index_count++] = background_job.index;
+    }
+    while (background_queue_count)
+        background_unmark(&background_queue[--background_queue_count]);
+}
+
+static void background_init() {
+    const char *env = getenv("FIREBIRD_JIT_THREAD");
+    if (background_enabled || !env || !*env || !strcmp(env, "0"))
+        return;
+
+    background_quit = false;
+    if (pthread_create(&background_thread, NULL, background_worker, NULL) != 0) {
+        emuprintf("Could not start the translation thread, translating on the emulation thread.\n");
+        return;
+    }
+    background_enabled = true;
+}
+
+static void background_deinit() {
+    if (!background_enabled)
+        return;
+
+    background_cancel();
+    pthread_mutex_lock(&background_mutex);
+    background_quit = true;
+    pthread_cond_broadcast(&background_cond);
+    pthread_mutex_unlock(&background_mutex);
+    pthread_join(background_thread, NULL);
+    background_enabled = false;
+}
+
+void translate(uint32_t start_pc, uint32_t *start_insnp) {
+    if (background_enabled)
+        background_queue_block(start_pc, start_insnp, false);
+    else
+        translate_block(start_pc, start_insnp, false);
+}
+
+void translate_thumb(uint32_t start_pc, uint16_t *start_insnp) {
+    if (background_enabled)
+        background_queue_block(start_pc, start_insnp, true);
+    else
+        translate_block(start_pc, start_insnp, true);
+}
+
+bool translation_can_enter(void *ptr, uint32_t pc, bool thumb) {
+    int index = RAM_FLAGS((uintptr_t)ptr & ~3) >> RFS_TRANSLATION_INDEX;
+    if (translation_covers(index, ptr, pc, thumb))
+        return true;
+    /* The MMU doesn't map the code where it was when translated anymore.
+     * Drop the translation, so that it gets done again for the new address. */
+    if (translation_covers(index, ptr, translation_ptr_pc(index, ptr), thumb)) {
+        invalidate_translation(index);
+        translation_stats.remaps++;
+    }
+    return false;
+}
+
+// Clears the flags of the words covered by the translation, the ones translation_add set
+static void translation_clear_flags(int index) {
+    // THUMB translations may start or end in the middle of a word
+    void *end_ptr = translation_table[index].end_ptr;
+    uint32_t *start = (uint32_t *)((uintptr_t)translation_table[index].start_ptr & ~3);
+    uint32_t *end   = (uint32_t *)(((uintptr_t)end_ptr + 3) & ~3);
+    for (; start < end; start++)
+        RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+    for (int n = 0; n < BA_MAX_POOL_WORDS; n++) {
+        if (translation_info[index].literals >> n & 1)
+            RAM_FLAGS(literal_word(end_ptr, n)) &= ~(RF_CODE_TRANSLATED | RF_CODE_LITERAL | (~0u << RFS_TRANSLATION_INDEX));
+    }
 }
 
 void flush_translations() {
+    background_cancel();
     int index;
     for (index = 0; index < next_index; index++) {
-        uint32_t *start = translation_table[index].start_ptr;
-        uint32_t *end   = translation_table[index].end_ptr;
-        for (; start < end; start++)
-            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+        if (translation_table[index].start_ptr) {
+            translation_clear_flags(index);
+            page_translations[translation_page(index)] = 0;
+        }
+        translation_table[index].start_ptr = NULL;
     }
     next_index = 0;
+    free_index_count = 0;
+    code_hole_count = 0;
     insn_bufptr = insn_buffer;
-    jtbl_bufptr = jtbl_buffer;
+    evict_ptr = NULL;
+    translation_stats.code_size = 0;
+    translation_stats.live_translations = 0;
+}
+
+size_t translation_entries(struct translation_entry *entries, size_t max) {
+    size_t count = 0;
+    for (int index = 0; index < next_index && count < max; index++) {
+        if (!translation_table[index].start_ptr)
+            continue;
+        entries[count].phys_addr = phys_mem_addr(translation_table[index].start_ptr);
+        entries[count].pc = translation_pc[index] | translation_thumb[index];
+        count++;
+    }
+    return count;
+}
+
+void translate_warm_start(const struct translation_entry *entries, size_t count) {
+    // Translated right away, the blocks may well not run again for a while
+    background_cancel();
+    for (size_t i = 0; i < count; i++) {
+        bool thumb = entries[i].pc & 1;
+        uint32_t pc = entries[i].pc & ~1;
+        void *ptr = phys_mem_ptr(entries[i].phys_addr, thumb ? 2 : 4);
+        // Also skips entries which an earlier one covers already
+        if (!ptr || entries[i].phys_addr & (thumb ? 1 : 3)
+            || RAM_FLAGS((uintptr_t)ptr & ~3) & DONT_TRANSLATE)
+            continue;
+
+        translate_block(pc, ptr, thumb);
+    }
 }
 
 void invalidate_translation(int index) {
     if (in_translation_rsp) {
-        uint32_t flags = RAM_FLAGS(in_translation_pc_ptr);
+        uint32_t flags = RAM_FLAGS((uintptr_t)in_translation_pc_ptr & ~3);
         if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
             error("Cannot modify currently executing code block.");
     }
-    flush_translations();
+
+    struct translation *t = &translation_table[index];
+    if (!t->start_ptr)
+        return;
+
+    translation_clear_flags(index);
+
+    // Undo links to this translation and remove it from the page
+    struct translation_info *info = &translation_info[index];
+    int page = translation_page(index);
+    for (int p = exit_source_page(page); p <= page; p++) {
+        for (int i = page_translations[p]; i; i = translation_info[i - 1].page_next) {
+            struct translation_info *other = &translation_info[i - 1];
+            for (int j = 0; j < other->exit_count; j++) {
+                if (other->exits[j].linked == index)
+                    translation_exit_unlink(&other->exits[j]);
+            }
+        }
+    }
+    if (info->page_prev)
+        translation_info[info->page_prev - 1].page_next = info->page_next;
+    else
+        page_translations[page] = info->page_next;
+    if (info->page_next)
+        translation_info[info->page_next - 1].page_prev = info->page_prev;
+
+    // The code starts with the first instruction and ends with the exits
+    uint8_t *code_end = (uint8_t *)(info->exits + info->exit_count);
+    translation_stats.code_size -= code_end - (uint8_t *)t->jump_table[0];
+    translation_stats.live_translations--;
+    code_free(t->jump_table[0], code_end);
+
+    t->start_ptr = t->end_ptr = NULL;
+    free_indices[free_index_count++] = index;
+}
+
+void *translate_fastmem_fallback(void *rip) {
+    uint8_t *access = rip, *site = access - FASTMEM_BASE_SIZE;
+    if (!fastmem_base || site < insn_buffer || access >= insn_buffer + INSN_BUFFER_SIZE
+            || site[0] != 0x49 || site[1] != 0xB8 || *(uint64_t *)(site + 2) != (uintptr_t)fastmem_base)
+        return NULL;
+
+    for (unsigned int i = 0; i < sizeof(fastmem_insns) / sizeof(*fastmem_insns); i++) {
+        const struct fastmem_insn *insn = &fastmem_insns[i];
+        if (memcmp(access, insn->code, insn->size))
+            continue;
+
+        uint8_t *end = access + insn->size;
+        if (insn->write && !code_page_protection) {
+            end += FASTMEM_FLAGS_TEST_SIZE(insn->aligned_flags);
+            assert(end[0] == JZ);
+            end += 2 + end[1];
+        }
+
+        // Call the function instead and jump over the rest
+        uint8_t *out_save = out;
+        out = site;
+        emit_call_nosave((uintptr_t)insn->function);
+        emit_byte(0xEB);
+        emit_byte(end - (out + 1));
+        out = out_save;
+        translation_stats.fastmem_patches++;
+        return site;
+    }
+    return NULL;
 }
 
 void translate_fix_pc() {
     if (!in_translation_rsp)
         return;
 
-    uint32_t *insnp = in_translation_pc_ptr;
+    uint8_t *insnp = in_translation_pc_ptr;
     void *ret_eip = in_translation_rsp[-1];
-    uint32_t flags = RAM_FLAGS(insnp);
+    uint32_t flags = RAM_FLAGS((uintptr_t)insnp & ~3);
     if (!(flags & RF_CODE_TRANSLATED))
         error("Couldn't get PC for fault");
     int index = flags >> RFS_TRANSLATION_INDEX;
+    uint8_t *start = (uint8_t *) translation_table[index].start_ptr;
+    uint8_t *end = (uint8_t *) translation_table[index].end_ptr;
+    int insn_size = translation_thumb[index] ? 2 : 4;
 
-    assert(insnp >= translation_table[index].start_ptr);
-    assert(insnp < translation_table[index].end_ptr);
+    assert(insnp >= start);
+    assert(insnp < end);
+    assert(!!(arm.cpsr_low28 & 0x20) == translation_thumb[index]);
     // We may have jumped into the middle of a translation
-    arm.reg[15] -= (uint8_t*) insnp - (uint8_t*) translation_table[index].start_ptr;
+    arm.reg[15] -= insnp - start;
 
-    unsigned int translation_insts = translation_table[index].end_ptr - translation_table[index].start_ptr;
-    for(unsigned int i = 0; i < translation_insts && ret_eip > translation_table[index].jump_table[i]; ++i)
-        arm.reg[15] += 4;
+    void **insn_code = translation_info[index].insn_code;
+    if (!insn_code)
+        insn_code = translation_table[index].jump_table;
 
-    cycle_count_delta -= ((uintptr_t)translation_table[index].end_ptr - (uintptr_t)insnp) >> 2;
-    in_translation_rsp = NULL;
+    unsigned int translation_insts = (end - start) / insn_size;
+    for(unsigned int i = 0; i < translation_insts && ret_eip > insn_code[i]; ++i)
+        arm.reg[15] += insn_size;
 
-    assert(!(arm.cpsr_low28 & 0x20));
+    cycle_count_delta -= (end - insnp) / insn_size;
+    in_translation_rsp = NULL;
 }
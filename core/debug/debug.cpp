@@ -15,12 +15,15 @@
 #include "memory/mem.h"
 #include "disassembly/disasm.h"
 #include "memory/mmu.h"
+#include "cpu/fallback_stats.h"
+#include "cpu/lockstep.h"
 #include "cpu/translate.h"
 #include "usb/usblink_queue.h"
 #include "gdbstub.h"
 #include "debug_api.h"
 #include "nspire_log_hook.h"
 #include "os/os.h"
+#include "rewind.h"
 
 std::string ln_target_folder;
 
@@ -78,11 +81,13 @@ int process_debug_cmd(char *cmdline) {
                     "b - stack backtrace\n"
                     "c - continue\n"
                     "d <address> - dump memory\n"
+                    "fs [on|off|reset] - count what keeps code out of the translator\n"
                     "k <address> <+r|+w|+x|-r|-w|-x> - add/remove breakpoint\n"
                     "k - show breakpoints\n"
                     "ln c - connect\n"
                     "ln s <file> - send a file\n"
                     "ln st <dir> - set target directory\n"
+                    "lockstep [on|off|reset] - compare translated blocks with the interpreter\n"
                     "mmu - dump memory mappings\n"
                     "nlog [on|off|scan|status] - TI virtual log hook control\n"
                     "nlog bypass [on|off|status] - bypass OS debug_log filters\n"
@@ -91,10 +96,13 @@ int process_debug_cmd(char *cmdline) {
                     "pw <address> <value> - port or memory write\n"
                     "r - show registers\n"
                     "rs <regnum> <value> - change register value\n"
+                    "rw [on [<interval ms> [<states>]]|off] - keep states to jump back to\n"
+                    "rw <n> - jump back n states\n"
                     "ss <address> <length> <string> - search a string\n"
                     "s - step instruction\n"
                     "t+ - enable instruction translation\n"
                     "t- - disable instruction translation\n"
+                    "ts - show translation cache and TLB statistics\n"
                     "u[a|t] [address] - disassemble memory\n"
                     "wm <file> <start> <size> - write memory to file\n"
                     "wf <file> <start> [size] - write file to memory\n"
@@ -206,8 +214,11 @@ int process_debug_cmd(char *cmdline) {
                             else *flags &= ~RF_READ_BREAKPOINT;
                             break;
                         case 'w':
-                            if (on) *flags |= RF_WRITE_BREAKPOINT;
-                            else *flags &= ~RF_WRITE_BREAKPOINT;
+                            if (on) {
+                                *flags |= RF_WRITE_BREAKPOINT;
+                                protect_code_page(ptr);
+                            } else
+                                *flags &= ~RF_WRITE_BREAKPOINT;
                             break;
                         case 'x':
                             if (on) {
@@ -365,6 +376,73 @@ int process_debug_cmd(char *cmdline) {
     } else if (!strcasecmp(cmd, "t-")) {
         flush_translations();
         do_translate = false;
+    } else if (!strcasecmp(cmd, "ts")) {
+        gui_debug_printf("translations	= %llu\n", (unsigned long long) translation_stats.translations);
+        gui_debug_printf("evictions	= %llu\n", (unsigned long long) translation_stats.evictions);
+        gui_debug_printf("flushes		= %llu\n", (unsigned long long) translation_stats.flushes);
+        gui_debug_printf("flushes avoided	= %llu\n", (unsigned long long) translation_stats.flushes_avoided);
+        gui_debug_printf("remaps		= %llu\n", (unsigned long long) translation_stats.remaps);
+        gui_debug_printf("page crossings	= %llu\n", (unsigned long long) translation_stats.page_crossings);
+        gui_debug_printf("fastmem patches	= %llu\n", (unsigned long long) translation_stats.fastmem_patches);
+        gui_debug_printf("background	= %llu (stale %llu)\n", (unsigned long long) translation_stats.background,
+                         (unsigned long long) translation_stats.background_stale);
+        gui_debug_printf("live		= %u (peak %u)\n", translation_stats.live_translations, translation_stats.live_peak);
+        gui_debug_printf("code size	= %zu (peak %zu) of %u\n", translation_stats.code_size, translation_stats.code_size_peak, INSN_BUFFER_SIZE);
+        gui_debug_printf("tlb misses	= %llu (evictions %llu, capacity %u)\n", (unsigned long long) addr_cache_stats.misses,
+                         (unsigned long long) addr_cache_stats.evictions, addr_cache_stats.capacity);
+        gui_debug_printf("tlb flushes	= %llu (single entries %llu)\n", (unsigned long long) addr_cache_stats.flushes,
+                         (unsigned long long) addr_cache_stats.mva_invalidations);
+        gui_debug_printf("l2 hits		= %llu\n", (unsigned long long) addr_cache_stats.l2_hits);
+    } else if (!strcasecmp(cmd, "fs")) {
+        char *mode = strtok(NULL, " \n\r");
+        if (!mode) {
+            fallback_stats_dump();
+        } else if (!strcasecmp(mode, "on")) {
+            // Translate again, so that the ends of all blocks are counted
+            flush_translations();
+            fallback_stats_reset();
+            fallback_stats_enabled = true;
+        } else if (!strcasecmp(mode, "off")) {
+            fallback_stats_enabled = false;
+        } else if (!strcasecmp(mode, "reset")) {
+            fallback_stats_reset();
+        } else {
+            gui_debug_printf("Usage: fs [on|off|reset]\n");
+        }
+    } else if (!strcasecmp(cmd, "lockstep")) {
+        char *mode = strtok(NULL, " \n\r");
+        if (!mode) {
+            lockstep_dump();
+        } else if (!strcasecmp(mode, "on")) {
+            lockstep_reset();
+            lockstep_enable(true);
+        } else if (!strcasecmp(mode, "off")) {
+            lockstep_enable(false);
+        } else if (!strcasecmp(mode, "reset")) {
+            lockstep_reset();
+        } else {
+            gui_debug_printf("Usage: lockstep [on|off|reset]\n");
+        }
+    } else if (!strcasecmp(cmd, "rw")) {
+        char *mode = strtok(NULL, " \n\r");
+        if (!mode) {
+            rewind_dump();
+        } else if (!strcasecmp(mode, "on")) {
+            char *interval = strtok(NULL, " \n\r"), *count = interval ? strtok(NULL, " \n\r") : NULL;
+            if (!rewind_enable(interval ? strtoul(interval, NULL, 0) : REWIND_DEFAULT_INTERVAL_MS,
+                               count ? strtoul(count, NULL, 0) : REWIND_DEFAULT_STATES))
+                gui_debug_printf("Unsupported interval or number of states\n");
+        } else if (!strcasecmp(mode, "off")) {
+            rewind_disable();
+        } else {
+            unsigned int steps = strtoul(mode, NULL, 0);
+            if (steps < 1 || steps > rewind_count()) {
+                gui_debug_printf("Usage: rw [on [<interval ms> [<states>]]|off|<n>], there are %u states\n", rewind_count());
+                return 0;
+            }
+            rewind_request(steps, true);
+            return 1;
+        }
     } else if (!strcasecmp(cmd, "wm") || !strcasecmp(cmd, "wf")) {
         bool frommem = cmd[1] != 'f';
         char *filename = strtok(NULL, " \n\r");
@@ -435,8 +435,10 @@ bool debug_set_breakpoint(uint32_t addr, bool exec, bool read, bool write)
         }
         if (read)
             *flags |= RF_READ_BREAKPOINT;
-        if (write)
+        if (write) {
             *flags |= RF_WRITE_BREAKPOINT;
+            protect_code_page(ptr);
+        }
     } else if (exec) {
         /* Can't set exec breakpoint on non-RAM (MMIO) address */
         return false;
@@ -747,8 +749,11 @@ bool debug_resume(const emu_snapshot *snapshot)
         /* Restore RAM flags */
         if (m->enabled) {
             void *ptr = virt_mem_ptr(entry.addr & ~3, 4);
-            if (ptr)
+            if (ptr) {
                 RAM_FLAGS(ptr) |= entry.flags;
+                if (entry.flags & RF_WRITE_BREAKPOINT)
+                    protect_code_page(ptr);
+            }
         }
     }
 
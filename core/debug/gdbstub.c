@@ -1671,8 +1671,11 @@ parse_new_pc:
                             break;
                         case '2': // write watchpoint
                         case '4': // access watchpoint
-                            if (set) *flags |= RF_WRITE_BREAKPOINT;
-                            else *flags &= ~RF_WRITE_BREAKPOINT;
+                            if (set) {
+                                *flags |= RF_WRITE_BREAKPOINT;
+                                protect_code_page(ramaddr);
+                            } else
+                                *flags &= ~RF_WRITE_BREAKPOINT;
                             if (*ptr1 != '4')
                                 break;
                             // fallthrough
@@ -3,19 +3,22 @@
 #include <chrono>
 #include <cstdint>
 #include <cctype>
-
-#include <fcntl.h>
-#include <unistd.h>
+#include <thread>
+#include <vector>
 
 #include <zlib.h>
 
 #include "emu.h"
+#include "cpu/lockstep.h"
 #include "cpu/translate.h"
 #include "debug.h"
 #include "debug_api.h"
 #include "memory/mmu.h"
+#include "memory/ram_snapshot.h"
 #include "gdbstub.h"
 #include "nspire_log_hook.h"
+#include "rewind.h"
+#include "snapshot_file.h"
 #include "usb/usblink_queue.h"
 #include "os/os.h"
 #include "timing/schedule.h"
@@ -129,6 +132,7 @@ void error(const char *fmt, ...) {
 
 void return_to_loop()
 {
+    lockstep_cancel();
     emu_longjmp(restart_after_exception);
 }
 
@@ -185,6 +189,8 @@ void throttle_interval_event(int index)
 
     last_throttle = new_last_throttle;
 
+    rewind_tick();
+
     gui_do_stuff(true);
 }
 
@@ -215,45 +221,124 @@ static void emu_reset()
         fastboot_cx_reset();
 }
 
+int snapshot_compression = Z_DEFAULT_COMPRESSION;
+
 bool snapshot_read(const emu_snapshot *snapshot, void *dest, int size)
 {
-    return gzread((gzFile)snapshot->stream_handle, dest, size) == size;
+    return snapshot_file_read((snapshot_file *)snapshot->stream_handle, dest, size);
+}
+
+bool snapshot_read_map(const emu_snapshot *snapshot, void *dest, size_t size)
+{
+    return snapshot_file_read_map((snapshot_file *)snapshot->stream_handle, dest, size);
 }
 
 bool snapshot_write(emu_snapshot *snapshot, const void *src, int size)
 {
-    return gzwrite((gzFile)snapshot->stream_handle, src, size) == size;
+    return snapshot_file_write((snapshot_file *)snapshot->stream_handle, src, size);
+}
+
+uint64_t snapshot_tell(const emu_snapshot *snapshot)
+{
+    return snapshot_file_tell((snapshot_file *)snapshot->stream_handle);
+}
+
+bool snapshot_open(emu_snapshot *snapshot, const char *file, uint64_t offset)
+{
+    snapshot_file *f = snapshot_file_open(file);
+    if(!f)
+        return false;
+
+    if(!snapshot_file_seek(f, offset))
+    {
+        snapshot_file_close(f);
+        return false;
+    }
+
+    snapshot->stream_handle = f;
+    snapshot->path = file;
+    return true;
+}
+
+void snapshot_close(emu_snapshot *snapshot)
+{
+    snapshot_file_close((snapshot_file *)snapshot->stream_handle);
+    snapshot->stream_handle = nullptr;
+}
+
+// Translations to make again when emu_loop starts after resuming a snapshot
+static std::vector<translation_entry> warm_start_entries;
+
+static bool translation_suspend(emu_snapshot *snapshot)
+{
+    std::vector<translation_entry> entries;
+#ifndef NO_TRANSLATION
+    entries.resize(translation_stats.live_translations);
+    entries.resize(translation_entries(entries.data(), entries.size()));
+#endif
+
+    uint32_t count = entries.size();
+    return snapshot_write(snapshot, &count, sizeof(count))
+            && snapshot_write(snapshot, entries.data(), count * sizeof(translation_entry));
+}
+
+static bool translation_resume(const emu_snapshot *snapshot)
+{
+    uint32_t count;
+    if(!snapshot_read(snapshot, &count, sizeof(count)) || count > (1u << 24))
+        return false;
+
+    warm_start_entries.resize(count);
+    return snapshot_read(snapshot, warm_start_entries.data(), count * sizeof(translation_entry));
+}
+
+// Joins the thread when it goes away, a joinable std::thread would call std::terminate
+struct joining_thread {
+    std::thread thread;
+
+    ~joining_thread()
+    {
+        if(thread.joinable())
+            thread.join();
+    }
+};
+
+// Snapshot being written by emu_suspend_async, still written if the process exits first
+static joining_thread suspend_thread;
+static bool suspend_thread_success;
+
+void emu_suspend_wait()
+{
+    if(!suspend_thread.thread.joinable())
+        return;
+
+    suspend_thread.thread.join();
+    // Deltas can't refer to it
+    if(!suspend_thread_success)
+        ram_snapshot_forget_base();
 }
 
 bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapshot_file)
 {
     gui_busy_raii gui_busy;
 
+    // It might be the snapshot to resume
+    emu_suspend_wait();
+
     if(snapshot_file)
     {
         // Open snapshot
-        FILE *fp = fopen_utf8(snapshot_file, "rb");
-        if(!fp)
-            return false;
-
-        int dupfd = dup(fileno(fp));
-        fclose(fp);
-        fp = nullptr;
-
-        // gzdopen takes ownership of the fd
-        gzFile gzf = gzdopen(dupfd, "r");
-        if(!gzf)
-        {
-            close(dupfd);
+        auto *file = snapshot_file_open(snapshot_file);
+        if(!file)
             return false;
-        }
 
         emu_snapshot snapshot = {};
-        snapshot.stream_handle = gzf;
+        snapshot.stream_handle = file;
+        snapshot.path = snapshot_file;
         // Read the header
         if(!snapshot_read(&snapshot, &snapshot.header, sizeof(snapshot.header)))
         {
-            gzclose(gzf);
+            snapshot_file_close(file);
             return false;
         }
 
@@ -267,27 +352,27 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapsh
         path_flash = std::string(snapshot.header.path_flash);
 
         // Resume components
-        uint32_t sdram_size, dummy;
+        uint32_t sdram_size;
         uint32_t snap_ver = snapshot.header.version;
         debug_clear_metadata(); /* Clear stale bp metadata before loading */
         if(snapshot.header.sig != SNAPSHOT_SIG
-                || (snap_ver != 4 && snap_ver != SNAPSHOT_VER)
+                || snap_ver < 4 || snap_ver > SNAPSHOT_VER
                 || !flash_resume(&snapshot)
                 || !flash_read_settings(&sdram_size, &product, &features, &asic_user_flags)
                 || !cpu_resume(&snapshot)
                 || !memory_resume(&snapshot)
                 || !sched_resume(&snapshot)
                 || (snap_ver >= 5 && !debug_resume(&snapshot))
+                || (snap_ver >= 6 && !translation_resume(&snapshot))
                 // Verify that EOF is next
-                || gzread(gzf, &dummy, sizeof(dummy)) != 0
-                || !gzeof(gzf))
+                || !snapshot_file_eof(file))
         {
-            gzclose(gzf);
+            snapshot_file_close(file);
             emu_cleanup();
             return false;
         }
 
-        if(gzclose(gzf) != Z_OK)
+        if(!snapshot_file_close(file))
         {
             emu_cleanup();
             return false;
@@ -376,6 +461,13 @@ void emu_loop(bool reset)
     addr_cache_flush();
     flush_translations();
 
+#ifndef NO_TRANSLATION
+    // Don't wait for the code which was hot before the snapshot to be executed twice
+    if(!reset && do_translate)
+        translate_warm_start(warm_start_entries.data(), warm_start_entries.size());
+#endif
+    warm_start_entries.clear();
+
     sched_update_next_event(0);
 
     exiting = false;
@@ -383,6 +475,7 @@ void emu_loop(bool reset)
     emu_setjmp(restart_after_exception);
 
     while (!exiting) {
+        rewind_process();
         sched_process_pending_events();
         while (!exiting && cycle_count_delta < 0) {
             if (cpu_events & EVENT_RESET) {
@@ -390,6 +483,10 @@ void emu_loop(bool reset)
                 goto reset;
             }
 
+            // See rewind_process
+            if (cpu_events & EVENT_REWIND)
+                break;
+
             if (cpu_events & EVENT_SLEEP) {
                 assert(emulate_cx2);
                 cycle_count_delta = 0;
@@ -423,28 +520,12 @@ void emu_loop(bool reset)
     #endif
 }
 
-bool emu_suspend(const char *file)
+static bool emu_capture(snapshot_file *f, const char *file, bool delta)
 {
-    gui_busy_raii gui_busy;
-
-    FILE *fp = fopen_utf8(file, "wb");
-    if(!fp)
-        return false;
-
-    int dupfd = dup(fileno(fp));
-    fclose(fp);
-    fp = nullptr;
-
-    // gzdopen takes ownership of the fd
-    gzFile gzf = gzdopen(dupfd, "wb");
-    if(!gzf)
-    {
-        close(dupfd);
-        return false;
-    }
-
     emu_snapshot snapshot = {};
-    snapshot.stream_handle = gzf;
+    snapshot.stream_handle = f;
+    snapshot.path = file;
+    snapshot.delta = delta;
 
     snapshot.header.sig = SNAPSHOT_SIG;
     snapshot.header.version = SNAPSHOT_VER;
@@ -452,24 +533,93 @@ bool emu_suspend(const char *file)
     strncpy(snapshot.header.path_boot1, path_boot1.c_str(), sizeof(snapshot.header.path_boot1) - 1);
     strncpy(snapshot.header.path_flash, path_flash.c_str(), sizeof(snapshot.header.path_flash) - 1);
 
-    if(!snapshot_write(&snapshot, &snapshot.header, sizeof(snapshot.header))
-            || !flash_suspend(&snapshot)
-            || !cpu_suspend(&snapshot)
-            || !memory_suspend(&snapshot)
-            || !sched_suspend(&snapshot)
-            || !debug_suspend(&snapshot))
-    {
-        gzclose(gzf);
+    return snapshot_write(&snapshot, &snapshot.header, sizeof(snapshot.header))
+            && flash_suspend(&snapshot)
+            && cpu_suspend(&snapshot)
+            && memory_suspend(&snapshot)
+            && sched_suspend(&snapshot)
+            && debug_suspend(&snapshot)
+            && translation_suspend(&snapshot);
+}
+
+static bool emu_suspend_snapshot(const char *file, bool delta)
+{
+    gui_busy_raii gui_busy;
+
+    emu_suspend_wait();
+
+    // Creating the file would replace a snapshot the delta builds on
+    delta = delta && ram_snapshot_delta_possible(file);
+    snapshot_file *f = snapshot_file_create(file, snapshot_compression);
+    if(!f)
         return false;
+
+    bool success = emu_capture(f, file, delta);
+
+    if(!snapshot_file_close(f))
+        success = false;
+
+    // Deltas can't refer to it
+    if(!success)
+        ram_snapshot_forget_base();
+
+    return success;
+}
+
+bool emu_suspend(const char *file)
+{
+    return emu_suspend_snapshot(file, false);
+}
+
+bool emu_suspend_delta(const char *file)
+{
+    return emu_suspend_snapshot(file, true);
+}
+
+bool emu_suspend_async(const char *file, bool delta, emu_suspend_callback callback, void *user)
+{
+    snapshot_file *f;
+    {
+        gui_busy_raii gui_busy;
+
+        emu_suspend_wait();
+
+        delta = delta && ram_snapshot_delta_possible(file);
+        f = snapshot_file_create_staged(file, snapshot_compression);
+        if(!f)
+            return false;
+
+        if(!emu_capture(f, file, delta))
+        {
+            snapshot_file_close(f);
+            ram_snapshot_forget_base();
+            return false;
+        }
     }
 
-    return gzclose(gzf) == Z_OK;
+    auto finish = [f, callback, user] {
+        suspend_thread_success = snapshot_file_close(f);
+        if(callback)
+            callback(suspend_thread_success, user);
+    };
+
+#ifdef __EMSCRIPTEN__
+    finish();
+    if(!suspend_thread_success)
+        ram_snapshot_forget_base();
+#else
+    suspend_thread.thread = std::thread(finish);
+#endif
+    return true;
 }
 
 void emu_cleanup()
 {
     exiting = true;
 
+    emu_suspend_wait();
+    rewind_forget();
+
     // addr_cache_init is rather expensive and needs to be called once only
     //addr_cache_deinit();
 
@@ -34,6 +34,7 @@ extern uint32_t cpu_events __asm__("cpu_events");
 #define EVENT_DEBUG_STEP 8
 #define EVENT_WAITING 16
 #define EVENT_SLEEP 32
+#define EVENT_REWIND 64 // Set atomically by rewind_request, from any thread
 
 #define EMU_RESET_SOFT 0
 #define EMU_RESET_HARD 1
@@ -243,12 +244,14 @@ typedef void (*debug_input_cb)(const char *input);
 void gui_debugger_request_input(debug_input_cb callback);
 
 #define SNAPSHOT_SIG 0xCAFEBEE0
-#define SNAPSHOT_VER 5
+#define SNAPSHOT_VER 9
 
 // Passed to resume/suspend functions.
 // Use snapshot_(read/write) to access stream contents.
 typedef struct emu_snapshot {
     void *stream_handle;
+    const char *path;
+    bool delta; // Only save RAM pages changed since the last snapshot, see ram_snapshot.h
     struct {
         uint32_t sig; // SNAPSHOT_SIG
         uint32_t version; // SNAPSHOT_VER
@@ -257,12 +260,32 @@ typedef struct emu_snapshot {
     } header;
 } emu_snapshot;
 
+// zlib level snapshots are saved with, 0 to store them uncompressed, see snapshot_file.h
+extern int snapshot_compression;
+
 bool snapshot_read(const emu_snapshot *snapshot, void *dest, int size);
+// Maps what it can of the file instead, see snapshot_file_read_map
+bool snapshot_read_map(const emu_snapshot *snapshot, void *dest, size_t size);
 bool snapshot_write(emu_snapshot *snapshot, const void *src, int size);
+// Position in the uncompressed stream
+uint64_t snapshot_tell(const emu_snapshot *snapshot);
+// Opens another snapshot file for reading, from the position offset
+bool snapshot_open(emu_snapshot *snapshot, const char *file, uint64_t offset);
+void snapshot_close(emu_snapshot *snapshot);
 
 bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapshot);
 void emu_loop(bool reset);
 bool emu_suspend(const char *file);
+// Saves a delta snapshot, which needs the one saved or loaded last to resume
+bool emu_suspend_delta(const char *file);
+typedef void (*emu_suspend_callback)(bool success, void *user);
+/* Captures the state into memory and returns. Compressing and writing the file
+ * happens on another thread, which calls callback with the result. Returns
+ * false without calling callback if the state couldn't be captured.
+ * emu_suspend, emu_start and emu_cleanup wait until the file is written. */
+bool emu_suspend_async(const char *file, bool delta, emu_suspend_callback callback, void *user);
+// Waits until the file of emu_suspend_async is written, call it before exiting
+void emu_suspend_wait();
 void emu_cleanup();
 
 #ifdef __cplusplus
@@ -2,11 +2,13 @@
 #include "debug.h"
 #include "memory/mmu.h"
 #include "memory/mem.h"
+#include "cpu/translate.h"
 
 //TODO: Read breakpoints, alignment checks
 
 #if defined(NO_TRANSLATION)
 void flush_translations() {}
+struct translation_stats translation_stats;
 #endif
 
 uint32_t FASTCALL read_word(uint32_t addr)
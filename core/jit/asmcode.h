@@ -44,6 +44,15 @@ void FASTCALL write_half_asm(uint32_t addr, uint32_t value) __asm__("write_half_
 void FASTCALL write_word_asm(uint32_t addr, uint32_t value) __asm__("write_word_asm");
 #endif
 
+#if defined(__x86_64__)
+// Versions of the write functions which don't check RAM_FLAGS, for code_page_protection
+void FASTCALL write_byte_unchecked_asm(uint32_t addr, uint32_t value) __asm__("write_byte_unchecked_asm");
+void FASTCALL write_half_unchecked_asm(uint32_t addr, uint32_t value) __asm__("write_half_unchecked_asm");
+void FASTCALL write_word_unchecked_asm(uint32_t addr, uint32_t value) __asm__("write_word_unchecked_asm");
+// Calls fastmem_write_action, keeping the registers like the functions above
+void FASTCALL fastmem_write_action_asm(uint32_t addr) __asm__("fastmem_write_action_asm");
+#endif
+
 #ifdef __cplusplus
 }
 #endif
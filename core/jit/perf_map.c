@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "jit/perf_map.h"
+
+struct perf_symbol {
+    uint32_t addr;
+    char *name;
+};
+
+static bool checked, enabled;
+static FILE *map_file;
+static struct perf_symbol *symbols;
+static size_t symbol_count;
+
+static int symbol_compare(const void *a, const void *b) {
+    uint32_t left = ((const struct perf_symbol *)a)->addr, right = ((const struct perf_symbol *)b)->addr;
+    return left < right ? -1 : left > right;
+}
+
+// Reads "address name" or "address type name" lines
+static void load_symbols(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return;
+    }
+
+    size_t capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof line, f)) {
+        char *p;
+        uint32_t addr = strtoul(line, &p, 16);
+        if (p == line)
+            continue;
+
+        char *name = strtok(p, " \t\r\n");
+        char *next = strtok(NULL, " \t\r\n");
+        if (next && strlen(name) == 1)
+            name = next; // Skip the type column of nm
+        if (!name)
+            continue;
+
+        if (symbol_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            struct perf_symbol *grown = realloc(symbols, capacity * sizeof(*symbols));
+            if (!grown)
+                break;
+            symbols = grown;
+        }
+        // strdup isn't declared in strict C11
+        size_t size = strlen(name) + 1;
+        char *copy = malloc(size);
+        if (!copy)
+            break;
+        memcpy(copy, name, size);
+        symbols[symbol_count].addr = addr;
+        symbols[symbol_count].name = copy;
+        symbol_count++;
+    }
+    fclose(f);
+
+    qsort(symbols, symbol_count, sizeof(*symbols), symbol_compare);
+}
+
+// Closest symbol at or before addr
+static const struct perf_symbol *find_symbol(uint32_t addr) {
+    size_t low = 0, high = symbol_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (symbols[mid].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low ? &symbols[low - 1] : NULL;
+}
+
+void perf_map_init() {
+    if (checked)
+        return;
+    checked = true;
+
+#ifdef __linux__
+    const char *env = getenv("FIREBIRD_PERF_MAP");
+    if (!env || !*env || !strcmp(env, "0"))
+        return;
+
+    char filename[64];
+    snprintf(filename, sizeof filename, "/tmp/perf-%d.map", (int) getpid());
+    map_file = fopen(filename, "w");
+    if (!map_file) {
+        perror(filename);
+        return;
+    }
+
+    const char *symbol_file = getenv("FIREBIRD_PERF_SYMBOLS");
+    if (symbol_file && *symbol_file)
+        load_symbols(symbol_file);
+
+    enabled = true;
+#endif
+}
+
+bool perf_map_enabled() {
+    return enabled;
+}
+
+void perf_map_add(const void *code, size_t size, uint32_t start_pc, uint32_t end_pc, bool thumb) {
+    if (!perf_map_enabled())
+        return;
+
+    const char *mode = thumb ? "thumb" : "arm";
+    const struct perf_symbol *sym = find_symbol(start_pc);
+    if (sym)
+        fprintf(map_file, "%lx %zx %s+0x%x %s_%08x_%08x\n", (unsigned long)(uintptr_t) code, size,
+                sym->name, start_pc - sym->addr, mode, start_pc, end_pc);
+    else
+        fprintf(map_file, "%lx %zx %s_%08x_%08x\n", (unsigned long)(uintptr_t) code, size,
+                mode, start_pc, end_pc);
+    // perf may read it while the emulator still runs
+    fflush(map_file);
+}
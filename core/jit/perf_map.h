@@ -0,0 +1,29 @@
+/* Declarations for perf_map.c */
+
+#ifndef PERF_MAP_H
+#define PERF_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Writes /tmp/perf-<pid>.map, so that "perf report" can attribute host time
+ * spent in translations to the guest code they were made from.
+ * Enabled by setting FIREBIRD_PERF_MAP=1. If FIREBIRD_PERF_SYMBOLS names a
+ * file with "address name" lines (nm output works as well), blocks are named
+ * after the closest guest symbol before them. The map stays open until
+ * the process exits, as perf needs the entries for old code as well. */
+// Opens the map if enabled, before any thread translates, see translate_init
+void perf_map_init();
+bool perf_map_enabled();
+void perf_map_add(const void *code, size_t size, uint32_t start_pc, uint32_t end_pc, bool thumb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
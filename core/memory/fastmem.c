@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu.h"
+#include "cpu/translate.h"
+#include "memory/fastmem.h"
+#include "memory/mem.h"
+#include "memory/mmu.h"
+
+uint8_t *fastmem_base = NULL;
+
+#if defined(__linux__) && defined(__x86_64__) && !defined(NO_TRANSLATION)
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#define FASTMEM_SIZE (2 * FASTMEM_FLAGS_OFFSET)
+#define FASTMEM_PAGE_SIZE 0x1000
+// Pages mapped at a time. The oldest one makes room for a new one.
+#define FASTMEM_MAPPED_MAX 512
+
+static uint32_t mapped_pages[FASTMEM_MAPPED_MAX];
+// The page of mem_and_flags each one aliases
+static uint8_t *mapped_ptrs[FASTMEM_MAPPED_MAX];
+static unsigned int mapped_count, mapped_index;
+static struct sigaction old_segv_action;
+
+static void unmap_range(uint8_t *addr, size_t size) {
+    mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+}
+
+static void unmap_page(uint32_t va) {
+    unmap_range(fastmem_base + va, FASTMEM_PAGE_SIZE);
+    unmap_range(fastmem_base + FASTMEM_FLAGS_OFFSET + va, FASTMEM_PAGE_SIZE);
+}
+
+// Makes the page of mem_and_flags at ptr appear at addr as well
+static bool alias_page(uint8_t *addr, uint8_t *ptr, int prot) {
+    // With a size of 0, mremap maps a shared mapping a second time
+    if (mremap(ptr, 0, FASTMEM_PAGE_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, addr) == MAP_FAILED)
+        return false;
+    return mprotect(addr, FASTMEM_PAGE_SIZE, prot) == 0;
+}
+
+/* Maps the host page containing va into the window, if all of it is RAM
+ * mapped contiguously. Returns false if the access has to go through the
+ * memory access functions instead. */
+static bool fastmem_map(uint32_t va, bool writing) {
+    va &= ~(FASTMEM_PAGE_SIZE - 1);
+    uint8_t *ptr = NULL;
+    bool writable = true;
+    // Pages of the guest MMU can be as small as 1 KB
+    for (uint32_t offset = 0; offset < FASTMEM_PAGE_SIZE; offset += 0x400) {
+        uint32_t pa = mmu_translate(va + offset, false, NULL, NULL);
+        uint8_t *p = phys_mem_ptr(pa, 0x400);
+        if (!p || (offset && p != ptr + offset))
+            return false;
+        if (!offset)
+            ptr = p;
+        if (mmu_translate(va + offset, true, NULL, NULL) != pa || code_page_protected(p))
+            writable = false;
+    }
+    if ((ptr - mem_and_flags) & (FASTMEM_PAGE_SIZE - 1))
+        return false;
+    for (uint32_t offset = 0; writable && offset < FASTMEM_PAGE_SIZE; offset += 4) {
+        if (RAM_FLAGS(ptr + offset) & RF_READ_ONLY)
+            writable = false;
+    }
+    if (writing && !writable)
+        return false;
+
+    // The flags are only read, by writes, so they have to be there first
+    if (!alias_page(fastmem_base + FASTMEM_FLAGS_OFFSET + va, ptr + MEM_MAXSIZE, PROT_READ)
+            || !alias_page(fastmem_base + va, ptr, writable ? PROT_READ | PROT_WRITE : PROT_READ)) {
+        unmap_page(va);
+        return false;
+    }
+
+    if (mapped_count < FASTMEM_MAPPED_MAX)
+        mapped_count++;
+    else
+        unmap_page(mapped_pages[mapped_index]);
+    mapped_pages[mapped_index] = va;
+    mapped_ptrs[mapped_index] = ptr;
+    mapped_index = (mapped_index + 1) % FASTMEM_MAPPED_MAX;
+    return true;
+}
+
+SYSVABI void fastmem_write_action(uint32_t va) {
+    // Pages are only in the window while this translation is valid
+    uint8_t *ptr = phys_mem_ptr(mmu_translate(va, true, NULL, NULL), 1);
+    if (ptr)
+        write_action(ptr);
+}
+
+static void fastmem_segv(int sig, siginfo_t *info, void *context) {
+    (void) sig;
+    greg_t *regs = ((ucontext_t *)context)->uc_mcontext.gregs;
+    uintptr_t offset = (uint8_t *)info->si_addr - fastmem_base;
+    if (offset < FASTMEM_FLAGS_OFFSET) {
+        // Bit 1 of the error code is set for writes
+        if (fastmem_map(offset, regs[REG_ERR] & 2))
+            return;
+        void *retry = translate_fastmem_fallback((void *)regs[REG_RIP]);
+        if (retry) {
+            regs[REG_RIP] = (greg_t)retry;
+            return;
+        }
+    }
+
+    // Not caused by fastmem: fault again with the previous handler
+    sigaction(SIGSEGV, &old_segv_action, NULL);
+}
+
+bool fastmem_configured() {
+    const char *env = getenv("FIREBIRD_FASTMEM");
+    return env && *env && strcmp(env, "0");
+}
+
+bool fastmem_init() {
+    if (fastmem_base)
+        return true;
+
+    if (!fastmem_configured())
+        return false;
+
+    /* Aligned to its size, so that translated code gets from an address in
+     * the window to its flags by setting bit 32 */
+    uint8_t *area = mmap(NULL, 2 * FASTMEM_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        emuprintf("Could not reserve the fastmem window, fastmem disabled.\n");
+        return false;
+    }
+    uint8_t *base = (uint8_t *)(((uintptr_t)area + FASTMEM_SIZE - 1) & ~(FASTMEM_SIZE - 1));
+    if (base != area)
+        munmap(area, base - area);
+    munmap(base + FASTMEM_SIZE, area + FASTMEM_SIZE - base);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = fastmem_segv;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &old_segv_action) != 0) {
+        munmap(base, FASTMEM_SIZE);
+        emuprintf("Could not install the fastmem fault handler, fastmem disabled.\n");
+        return false;
+    }
+
+    fastmem_base = base;
+    return true;
+}
+
+void fastmem_flush() {
+    if (!fastmem_base || !mapped_count)
+        return;
+
+    unmap_range(fastmem_base, FASTMEM_SIZE);
+    mapped_count = mapped_index = 0;
+}
+
+void fastmem_flush_range(uint32_t va, uint32_t size) {
+    if (!fastmem_base)
+        return;
+
+    // Their slots stay used, unmapping them again later doesn't hurt
+    for (unsigned int i = 0; i < mapped_count; i++) {
+        if (mapped_pages[i] - va < size)
+            unmap_page(mapped_pages[i]);
+    }
+}
+
+void fastmem_flush_ram(void *ptr) {
+    if (!fastmem_base)
+        return;
+
+    for (unsigned int i = 0; i < mapped_count; i++) {
+        if ((uintptr_t)((uint8_t *)ptr - mapped_ptrs[i]) < FASTMEM_PAGE_SIZE)
+            unmap_page(mapped_pages[i]);
+    }
+}
+
+#else
+
+bool fastmem_configured() {
+    return false;
+}
+
+bool fastmem_init() {
+    return false;
+}
+
+void fastmem_flush() {
+}
+
+void fastmem_flush_range(uint32_t va, uint32_t size) {
+    (void) va;
+    (void) size;
+}
+
+void fastmem_flush_ram(void *ptr) {
+    (void) ptr;
+}
+
+#endif
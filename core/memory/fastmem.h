@@ -0,0 +1,47 @@
+/* Declarations for fastmem.c */
+
+#ifndef _H_FASTMEM
+#define _H_FASTMEM
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu/cpu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* With fastmem, translated code accesses guest memory at fastmem_base + VA
+ * directly instead of calling the memory access functions. The window is
+ * 8 GB of reserved host address space: the first 4 GB mirror the guest
+ * virtual address space, the next 4 GB the RAM_FLAGS of the same pages.
+ * Pages are mapped into it on the first access, like addr_cache entries,
+ * and all of them are unmapped again by addr_cache_flush. Accesses which
+ * can't be done directly (MMIO, aborts, read-only memory) fault, and the
+ * fault handler turns them into calls of the memory access functions.
+ *
+ * Only available on x86_64 Linux. Enabled by setting FIREBIRD_FASTMEM=1.
+ * The faults stop debuggers, "handle SIGSEGV nostop noprint" helps in gdb. */
+#define FASTMEM_FLAGS_OFFSET (1ull << 32)
+
+// NULL if fastmem isn't in use
+extern uint8_t *fastmem_base;
+
+// Whether fastmem_init enables fastmem, without doing it
+bool fastmem_configured();
+bool fastmem_init();
+// Unmaps all pages from the window
+void fastmem_flush();
+// Unmaps the pages in [va, va + size)
+void fastmem_flush_range(uint32_t va, uint32_t size);
+// Unmaps the pages which alias the 1 KB page of mem_and_flags at ptr
+void fastmem_flush_ram(void *ptr);
+// Called by translated code for a write to memory with DO_WRITE_ACTION flags
+void SYSVABI fastmem_write_action(uint32_t va) __asm__("fastmem_write_action");
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
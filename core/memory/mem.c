@@ -17,12 +17,16 @@
 #include "usb/usblink.h"
 #include "usb/usb.h"
 #include "soc/casplus.h"
+#include "memory/fastmem.h"
 #include "memory/mem.h"
+#include "memory/mmu.h"
+#include "memory/ram_snapshot.h"
 #include "debug.h"
 #include "cpu/translate.h"
 #include "usb/usb_cx2.h"
 #include "soc/cx2.h"
 #include "cpu/cpu.h"
+#include "cpu/lockstep.h"
 #include "nspire_log_hook.h"
 
 uint8_t   (*read_byte_map[64])(uint32_t addr);
@@ -100,6 +104,9 @@ static void mmio_trace_write(uint32_t addr, uint32_t value, unsigned size)
 uint8_t *mem_and_flags = NULL;
 struct mem_area_desc mem_areas[5];
 
+bool code_page_protection = false;
+static uint8_t protected_pages[MEM_MAXSIZE >> 10];
+
 void *phys_mem_ptr(uint32_t addr, uint32_t size) {
     unsigned int i;
     for (i = 0; i < sizeof(mem_areas)/sizeof(*mem_areas); i++) {
@@ -144,6 +151,30 @@ SYSVABI void write_action(void *ptr) {
 #endif
 }
 
+void protect_code_page(void *ptr) {
+    size_t page = ((uint8_t *)ptr - mem_and_flags) >> 10;
+    if (!code_page_protection || protected_pages[page])
+        return;
+
+    protected_pages[page] = 1;
+    // There may be cached writes to it already
+    addr_cache_invalidate_writes(mem_and_flags + (page << 10));
+}
+
+bool code_page_protected(void *ptr) {
+    size_t page = ((uint8_t *)ptr - mem_and_flags) >> 10;
+    if (!protected_pages[page])
+        return false;
+
+    uint8_t *start = mem_and_flags + (page << 10);
+    for (uint8_t *p = start; p < start + 0x400; p += 4) {
+        if (RAM_FLAGS(p) & PROTECT_PAGE_FLAGS)
+            return true;
+    }
+    protected_pages[page] = 0;
+    return false;
+}
+
 /* 00000000, 10000000, A4000000: ROM and RAM */
 uint8_t memory_read_byte(uint32_t addr) {
     uint8_t *ptr = phys_mem_ptr(addr, 1);
@@ -169,6 +200,7 @@ void memory_write_byte(uint32_t addr, uint8_t value) {
     uint32_t flags = RAM_FLAGS((size_t)ptr & ~3);
     if (flags & RF_READ_ONLY) { bad_write_byte(addr, value); return; }
     if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if (unlikely(lockstep_recording)) lockstep_record_write(ptr, value, 1);
     *ptr = value;
     nspire_log_hook_on_memory_write(addr, 1);
 }
@@ -178,6 +210,7 @@ void memory_write_half(uint32_t addr, uint16_t value) {
     uint32_t flags = RAM_FLAGS((size_t)ptr & ~3);
     if (flags & RF_READ_ONLY) { bad_write_half(addr, value); return; }
     if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if (unlikely(lockstep_recording)) lockstep_record_write(ptr, value, 2);
     *ptr = value;
     nspire_log_hook_on_memory_write(addr, 2);
 }
@@ -187,6 +220,7 @@ void memory_write_word(uint32_t addr, uint32_t value) {
     uint32_t flags = RAM_FLAGS(ptr);
     if (flags & RF_READ_ONLY) { bad_write_word(addr, value); return; }
     if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if (unlikely(lockstep_recording)) lockstep_record_write(ptr, value, 4);
     *ptr = value;
     nspire_log_hook_on_memory_write(addr, 4);
 }
@@ -238,21 +272,27 @@ void apb_write_word(uint32_t addr, uint32_t value) {
 }
 
 uint32_t FASTCALL mmio_read_byte(uint32_t addr) {
+    if (unlikely(lockstep_recording)) lockstep_io = true;
     return read_byte_map[addr >> 26](addr);
 }
 uint32_t FASTCALL mmio_read_half(uint32_t addr) {
+    if (unlikely(lockstep_recording)) lockstep_io = true;
     return read_half_map[addr >> 26](addr);
 }
 uint32_t FASTCALL mmio_read_word(uint32_t addr) {
+    if (unlikely(lockstep_recording)) lockstep_io = true;
     return read_word_map[addr >> 26](addr);
 }
 void FASTCALL mmio_write_byte(uint32_t addr, uint32_t value) {
+    if (unlikely(lockstep_recording) && write_byte_map[addr >> 26] != memory_write_byte) lockstep_io = true;
     write_byte_map[addr >> 26](addr, value);
 }
 void FASTCALL mmio_write_half(uint32_t addr, uint32_t value) {
+    if (unlikely(lockstep_recording) && write_half_map[addr >> 26] != memory_write_half) lockstep_io = true;
     write_half_map[addr >> 26](addr, value);
 }
 void FASTCALL mmio_write_word(uint32_t addr, uint32_t value) {
+    if (unlikely(lockstep_recording) && write_word_map[addr >> 26] != memory_write_word) lockstep_io = true;
     write_word_map[addr >> 26](addr, value);
 }
 
@@ -311,6 +351,7 @@ bool memory_initialize(uint32_t sdram_size)
         emuprintf("os_reserve failed!\n");
         return false;
     }
+    memset(protected_pages, 0, sizeof(protected_pages));
 
     // Boot ROM
     mem_areas[0].base = 0x0;
@@ -592,7 +633,11 @@ void memory_deinitialize()
     {
         // translation_table uses absolute addresses
         flush_translations();
+        // So does the fastmem window
+        fastmem_flush();
         memset(mem_areas, 0, sizeof(mem_areas));
+        // Its pages might be somewhere else now
+        ram_snapshot_forget_base();
         os_free(mem_and_flags, MEM_MAXSIZE * 2);
         mem_and_flags = NULL;
     }
@@ -1079,7 +1124,7 @@ bool memory_suspend(emu_snapshot *snapshot)
     // TODO: CAS+ and ti84_io?
     return snapshot_write(snapshot, &sdram_size, sizeof(sdram_size))
             // TODO: No flags saved. Only RF_EXEC_BREAKPOINT and maybe RF_READ_ONLY are interesting.
-            && snapshot_write(snapshot, mem_and_flags, MEM_MAXSIZE)
+            && ram_snapshot_suspend(snapshot)
             && misc_suspend(snapshot)
             && keypad_suspend(snapshot)
             && usb_suspend(snapshot)
@@ -1101,8 +1146,9 @@ bool memory_resume(const emu_snapshot *snapshot)
     return snapshot_read(snapshot, &sdram_size, sizeof(sdram_size))
             && memory_initialize(sdram_size)
             && (memory_reset(), true) // To have peripherals register with sched
-            && snapshot_read(snapshot, mem_and_flags, MEM_MAXSIZE)
-            && memset(mem_and_flags + MEM_MAXSIZE, 0, MEM_MAXSIZE) // Set all flags to 0
+            && (snapshot->header.version >= 7 ? ram_snapshot_resume(snapshot)
+                    : (ram_snapshot_forget_base(), snapshot_read(snapshot, mem_and_flags, MEM_MAXSIZE)))
+            && (os_reserve_zero(mem_and_flags + MEM_MAXSIZE, MEM_MAXSIZE), true) // Set all flags to 0
             && misc_resume(snapshot)
             && keypad_resume(snapshot)
             && usb_resume(snapshot)
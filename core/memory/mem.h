@@ -49,12 +49,28 @@ uint32_t phys_mem_addr(void *ptr);
 #define RF_CODE_NO_TRANSLATE 64
 #define RF_READ_ONLY         128
 #define RF_ARMLOADER_CB      256
-#define RFS_TRANSLATION_INDEX 9
+// A literal folded into the translation with the index, not code of it
+#define RF_CODE_LITERAL      512
+#define RFS_TRANSLATION_INDEX 10
 
 #define DO_READ_ACTION (RF_READ_BREAKPOINT)
 #define DO_WRITE_ACTION (RF_WRITE_BREAKPOINT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE | RF_CODE_EXECUTED)
 #define DONT_TRANSLATE (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
 
+/* With code_page_protection, writes through addr_cache and fastmem don't
+ * check the flags of each word. Instead, 1 KB pages with any of these flags
+ * are protected: they're never cached for writing, so writes to them go
+ * through memory_write_*, which does check. Pages are protected when the
+ * flags are set and unprotected lazily, when a write misses addr_cache and
+ * none of the flags are left. Set up by the x86_64 translator. */
+#define PROTECT_PAGE_FLAGS (RF_WRITE_BREAKPOINT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
+
+extern bool code_page_protection;
+// Called after setting any of PROTECT_PAGE_FLAGS for the word at ptr
+void protect_code_page(void *ptr);
+// Whether writes to the page containing ptr have to check the flags
+bool code_page_protected(void *ptr);
+
 uint8_t bad_read_byte(uint32_t addr);
 uint16_t bad_read_half(uint32_t addr);
 uint32_t bad_read_word(uint32_t addr);
@@ -1,8 +1,11 @@
-#include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "cpu/translate.h"
 #include "emu.h"
 #include "cpu/cpu.h"
+#include "cpu/lockstep.h"
+#include "memory/fastmem.h"
 #include "memory/mmu.h"
 #include "memory/mem.h"
 #include "os/os.h"
@@ -10,6 +13,28 @@
 /* Copy of translation table in memory (hack to approximate effect of having a TLB) */
 static uint32_t mmu_translation_table[0x1000];
 
+/* Decoded second-level descriptors, so that misses of addr_cache don't have
+ * to walk the page tables again. They are looked up per 1 KB page, which
+ * also selects the AP bits of a subpage. Like mmu_translation_table, they
+ * are only updated by TLB operations. The domain and the permissions are
+ * still checked on each lookup, as those depend on registers and the mode. */
+#define L2_CACHE_SIZE 1024
+#define L2_CACHE_TAG(addr) (((addr) & ~0x3FF) | 1)
+struct l2_cache_entry {
+    uint32_t tag;       // L2_CACHE_TAG of the VA, 0 if invalid
+    uint32_t base;      // Physical address of the page
+    uint32_t page_size;
+    uint32_t ap;        // Shifted like in mmu_translate
+};
+static struct l2_cache_entry l2_cache[L2_CACHE_SIZE];
+static bool l2_cache_used;
+
+static void l2_cache_flush() {
+    if (l2_cache_used)
+        memset(l2_cache, 0, sizeof(l2_cache));
+    l2_cache_used = false;
+}
+
 void mmu_dump_tables(void) {
     if ((arm.control & 1) == 0) {
         gui_debug_printf("MMU disabled\n");
@@ -85,6 +110,16 @@ uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault, uint8_t *
     uint32_t status = domain << 4;
     uint32_t ap;
 
+    struct l2_cache_entry *cached = &l2_cache[addr >> 10 & (L2_CACHE_SIZE - 1)];
+    if ((entry & 1) && cached->tag == L2_CACHE_TAG(addr)) {
+        addr_cache_stats.l2_hits++;
+        status += 2;
+        entry = cached->base;
+        page_size = cached->page_size;
+        ap = cached->ap;
+        goto section;
+    }
+
     switch (entry & 3) {
         default: /* Invalid */
             if (s_status) *s_status = status + 0x5;
@@ -131,6 +166,11 @@ uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault, uint8_t *
             ap = entry;
             break;
     }
+    cached->tag = L2_CACHE_TAG(addr);
+    cached->base = entry & -page_size;
+    cached->page_size = page_size;
+    cached->ap = ap;
+    l2_cache_used = true;
 section:;
 
     uint32_t domain_access = arm.domain_access_control >> (domain << 1) & 3;
@@ -191,10 +231,21 @@ void mmu_user_access(uint32_t addr, bool writing)
 
 ac_entry *addr_cache = NULL;
 
-// Keep a list of valid entries so we can invalidate everything quickly
-#define AC_VALID_MAX 256
+/* Keep a list of valid entries so we can invalidate everything quickly.
+ * When it's full, the oldest entry makes room for a new one. If that
+ * happens to all of them before the next flush, the pages in use don't fit
+ * and it grows, unless its size is set by FIREBIRD_ADDR_CACHE_ENTRIES. */
+#define AC_VALID_MIN 256
+#define AC_VALID_LIMIT 16384
+static uint32_t ac_valid_max = AC_VALID_MIN;
+static bool ac_valid_fixed;
 static uint32_t ac_valid_index;
-static uint32_t ac_valid_list[AC_VALID_MAX];
+// Offset + 1 of each valid entry, 0 if unused
+static uint32_t ac_valid_list[AC_VALID_LIMIT];
+// Valid entries which made room for others since the last flush
+static uint32_t ac_evicted;
+
+struct addr_cache_stats addr_cache_stats = { .capacity = AC_VALID_MIN };
 
 static void addr_cache_invalidate(unsigned int i) {
     AC_SET_ENTRY_INVALID(addr_cache[i], i >> 1 << 10)
@@ -241,22 +292,117 @@ void *addr_cache_miss(uint32_t virt, bool writing, fault_proc *fault) {
     ac_entry entry;
     uintptr_t phys = mmu_translate(virt, writing, fault, NULL);
     uint8_t *ptr = phys_mem_ptr(phys, 1);
-    if (ptr && !(writing && (RAM_FLAGS((size_t)ptr & ~3) & RF_READ_ONLY))) {
+    // For lockstep testing, all writes have to go through memory_write_*
+    if (ptr && !(writing && ((RAM_FLAGS((size_t)ptr & ~3) & RF_READ_ONLY) || code_page_protected(ptr) || lockstep_enabled))) {
         AC_SET_ENTRY_PTR(entry, virt, ptr)
                 //printf("addr_cache_miss VA=%08x ptr=%p entry=%p\n", virt, ptr, entry);
     } else {
         AC_SET_ENTRY_PHYS(entry, virt, phys)
                 //printf("addr_cache_miss VA=%08x PA=%08x entry=%p\n", virt, phys, entry);
     }
-    uint32_t oldoffset = ac_valid_list[ac_valid_index];
+    addr_cache_stats.misses++;
+    uint32_t old = ac_valid_list[ac_valid_index];
+    if (old && ac_evicted >= ac_valid_max && !ac_valid_fixed && ac_valid_max < AC_VALID_LIMIT) {
+        // Continue in the new, unused part
+        ac_valid_index = ac_valid_max;
+        ac_valid_max *= 2;
+        addr_cache_stats.capacity = ac_valid_max;
+        ac_evicted = 0;
+    } else if (old) {
+        addr_cache_invalidate(old - 1);
+        addr_cache_stats.evictions++;
+        ac_evicted++;
+    }
     uint32_t offset = (virt >> 10) * 2 + writing;
-    addr_cache_invalidate(oldoffset);
     addr_cache[offset] = entry;
-    ac_valid_list[ac_valid_index] = offset;
-    ac_valid_index = (ac_valid_index + 1) % AC_VALID_MAX;
+    ac_valid_list[ac_valid_index] = offset + 1;
+    ac_valid_index = (ac_valid_index + 1) % ac_valid_max;
     return ptr;
 }
 
+void addr_cache_flush_writes() {
+    for (unsigned int i = 0; i < ac_valid_max; i++) {
+        uint32_t offset = ac_valid_list[i] - 1;
+        if (ac_valid_list[i] && (offset & 1)) {
+            addr_cache_invalidate(offset);
+            ac_valid_list[i] = 0;
+        }
+    }
+    // The window is mapped for reading and writing alike
+    fastmem_flush();
+}
+
+void addr_cache_invalidate_writes(void *page) {
+    for (unsigned int i = 0; i < ac_valid_max; i++) {
+        uint32_t offset = ac_valid_list[i] - 1;
+        if (!ac_valid_list[i] || !(offset & 1))
+            continue;
+        // Entries for physical addresses don't lead to RAM directly
+        uint8_t *ptr = &addr_cache[offset][offset >> 1 << 10];
+#ifdef AC_FLAGS
+        if ((uintptr_t)addr_cache[offset] & AC_FLAGS)
+            continue;
+#else
+        if ((uintptr_t)ptr & AC_NOT_PTR)
+            continue;
+#endif
+        if ((uintptr_t)(ptr - (uint8_t *)page) < 0x400) {
+            addr_cache_invalidate(offset);
+            ac_valid_list[i] = 0;
+        }
+    }
+    fastmem_flush_ram(page);
+}
+
+void addr_cache_invalidate_mva(uint32_t mva) {
+    uint32_t section = mva >> 20;
+    if (arm.control & 1) {
+        uint32_t *entry = phys_mem_ptr(arm.translation_table_base + section * 4, 4);
+        if (entry)
+            mmu_translation_table[section] = *entry;
+    }
+
+    // The page mva was in can't be told anymore, it's somewhere in the section
+    for (unsigned int i = 0; i < L2_CACHE_SIZE; i++) {
+        if (l2_cache[i].tag >> 20 == section)
+            l2_cache[i].tag = 0;
+    }
+    for (unsigned int i = 0; i < ac_valid_max; i++) {
+        uint32_t offset = ac_valid_list[i] - 1;
+        if (ac_valid_list[i] && offset >> 11 == section) {
+            addr_cache_invalidate(offset);
+            ac_valid_list[i] = 0;
+        }
+    }
+    fastmem_flush_range(section << 20, 1 << 20);
+    addr_cache_stats.mva_invalidations++;
+
+#if TRANSLATION_CHECKS_PC && !defined(NO_TRANSLATION)
+    translation_stats.flushes_avoided++;
+#else
+    flush_translations();
+#endif
+}
+
+static void addr_cache_configure() {
+    static bool configured = false;
+    if (configured)
+        return;
+    configured = true;
+
+    const char *env = getenv("FIREBIRD_ADDR_CACHE_ENTRIES");
+    if (!env || !*env)
+        return;
+    unsigned long entries = strtoul(env, NULL, 0);
+    if (entries < 1 || entries > AC_VALID_LIMIT) {
+        emuprintf("FIREBIRD_ADDR_CACHE_ENTRIES must be between 1 and %u.\n", AC_VALID_LIMIT);
+        return;
+    }
+    // Called with an empty list
+    ac_valid_max = addr_cache_stats.capacity = entries;
+    ac_valid_fixed = true;
+}
+
 void addr_cache_flush() {
     if (arm.control & 1) {
         void *table = phys_mem_ptr(arm.translation_table_base, 0x4000);
@@ -264,11 +410,21 @@ void addr_cache_flush() {
             error("Bad translation table base register: %x", arm.translation_table_base);
         memcpy(mmu_translation_table, table, 0x4000);
     }
+    l2_cache_flush();
 
-    for (unsigned int i = 0; i < AC_VALID_MAX; i++) {
-        uint32_t offset = ac_valid_list[i];
-        addr_cache_invalidate(offset);
+    for (unsigned int i = 0; i < ac_valid_max; i++) {
+        if (ac_valid_list[i])
+            addr_cache_invalidate(ac_valid_list[i] - 1);
+        ac_valid_list[i] = 0;
     }
+    ac_valid_index = ac_evicted = 0;
+    addr_cache_configure();
+    addr_cache_stats.flushes++;
+    fastmem_flush();
 
+#if TRANSLATION_CHECKS_PC && !defined(NO_TRANSLATION)
+    translation_stats.flushes_avoided++;
+#else
     flush_translations();
+#endif
 }
@@ -69,6 +69,22 @@ extern ac_entry *addr_cache __asm__("addr_cache");
 bool addr_cache_pagefault(void *addr);
 void *addr_cache_miss(uint32_t addr, bool writing, fault_proc *fault) __asm__("addr_cache_miss");
 void addr_cache_flush();
+// Invalidates the entries for writing only
+void addr_cache_flush_writes();
+// Invalidates the entries for writing to the 1 KB page of RAM at page, see protect_code_page
+void addr_cache_invalidate_writes(void *page);
+// Invalidates what was cached from the TLB entry for the address mva
+void addr_cache_invalidate_mva(uint32_t mva);
+
+struct addr_cache_stats {
+    uint64_t misses;            // Entries filled by addr_cache_miss
+    uint64_t evictions;         // Valid entries dropped to make room for others
+    uint64_t flushes;           // Calls to addr_cache_flush
+    uint64_t mva_invalidations; // Calls to addr_cache_invalidate_mva
+    uint64_t l2_hits;           // Second-level descriptors found already decoded
+    uint32_t capacity;          // How many entries can be valid at a time
+};
+extern struct addr_cache_stats addr_cache_stats;
 void mmu_dump_tables(void);
 
 #ifdef __cplusplus
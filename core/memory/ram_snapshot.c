@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu.h"
+#include "os/os.h"
+#include "memory/fastmem.h"
+#include "memory/mem.h"
+#include "memory/ram_snapshot.h"
+
+#define RAM_PAGE_SIZE 0x1000
+#define RAM_PAGES (MEM_MAXSIZE / RAM_PAGE_SIZE)
+// Limits the files opened to resume a delta snapshot, and cycles
+#define RAM_MAX_CHAIN 256
+/* The indices of all pages come first, then the pages, starting at a multiple
+ * of RAM_PAGE_SIZE in the stream, so that they can be mapped from the file.
+ * Without it, as in older snapshots, each page follows its index. */
+#define RAM_IMAGE_ALIGNED 1
+
+struct ram_image_header {
+    uint64_t id;            // Digest of the contents of all pages, never 0
+    uint64_t base_id;       // id of the base of a delta, 0 if it's a full image
+    uint64_t base_offset;   // Position of the base's header in its uncompressed stream
+    uint32_t page_count;    // Followed by the uint32_t index of each page and the pages
+    uint32_t flags;         // RAM_IMAGE_*
+    char base_path[512];
+};
+
+/* Digests of the pages as the base has them, NULL if there's no base or
+ * they weren't made yet, see load_base_digests */
+static uint64_t *base_digests;
+static uint64_t base_id, base_offset;
+static char base_path[512];
+
+static uint64_t digest(const void *data, size_t size) {
+    const uint64_t *words = data;
+    uint64_t h = 0;
+    for (size_t i = 0; i < size / 8; i++) {
+        h = (h ^ words[i]) * 0x9E3779B97F4A7C15ull;
+        h = h << 29 | h >> 35;
+    }
+    return h;
+}
+
+static bool page_zero(const uint8_t *page) {
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t any = 0;
+    for (unsigned int i = 0; i < RAM_PAGE_SIZE / 8; i++)
+        any |= words[i];
+    return !any;
+}
+
+// Returns the id of the RAM contents
+static uint64_t digest_pages(const uint8_t *ram, uint64_t *digests) {
+    for (unsigned int i = 0; i < RAM_PAGES; i++)
+        digests[i] = digest(ram + i * RAM_PAGE_SIZE, RAM_PAGE_SIZE);
+    uint64_t id = digest(digests, RAM_PAGES * sizeof(uint64_t));
+    return id ? id : 1;
+}
+
+// Takes ownership of digests, which can be NULL
+static void set_base(const char *path, uint64_t offset, uint64_t id, uint64_t *digests) {
+    ram_snapshot_forget_base();
+    if (!path || strlen(path) >= sizeof(base_path)) {
+        free(digests);
+        return;
+    }
+    strcpy(base_path, path);
+    base_offset = offset;
+    base_id = id;
+    base_digests = digests;
+}
+
+void ram_snapshot_forget_base() {
+    free(base_digests);
+    base_digests = NULL;
+    base_id = 0;
+}
+
+/* Reads the image at the current position of snapshot into ram, after the
+ * chain of bases it's a delta of. With map set, pages are mapped from the
+ * files where possible, ram has to be mem_and_flags then. */
+static bool ram_image_read(const emu_snapshot *snapshot, uint64_t id, int depth, uint8_t *ram, bool map, uint64_t *read_id) {
+    struct ram_image_header header;
+    if (!snapshot_read(snapshot, &header, sizeof(header)) || (id && header.id != id) || header.page_count > RAM_PAGES)
+        return false;
+
+    if (header.base_id) {
+        header.base_path[sizeof(header.base_path) - 1] = '\0';
+        emu_snapshot base = {0};
+        if (depth >= RAM_MAX_CHAIN || !snapshot_open(&base, header.base_path, header.base_offset)) {
+            emuprintf("Could not open base snapshot %s\n", header.base_path);
+            return false;
+        }
+        bool success = ram_image_read(&base, header.base_id, depth + 1, ram, map, NULL);
+        snapshot_close(&base);
+        if (!success) {
+            emuprintf("Base snapshot %s was changed or is damaged\n", header.base_path);
+            return false;
+        }
+    }
+
+    if (!(header.flags & RAM_IMAGE_ALIGNED)) {
+        for (uint32_t i = 0; i < header.page_count; i++) {
+            uint32_t page;
+            if (!snapshot_read(snapshot, &page, sizeof(page)) || page >= RAM_PAGES
+                    || !snapshot_read(snapshot, ram + page * RAM_PAGE_SIZE, RAM_PAGE_SIZE))
+                return false;
+        }
+    } else {
+        // One more, malloc(0) may return NULL
+        uint32_t *pages = malloc((header.page_count + 1) * sizeof(uint32_t));
+        uint8_t padding[RAM_PAGE_SIZE];
+        bool success = pages && snapshot_read(snapshot, pages, header.page_count * sizeof(uint32_t))
+                && snapshot_read(snapshot, padding, -snapshot_tell(snapshot) & (RAM_PAGE_SIZE - 1));
+
+        // Runs of consecutive pages at once
+        for (uint32_t i = 0, count; success && i < header.page_count; i += count) {
+            for (count = 1; i + count < header.page_count && pages[i + count] == pages[i] + count; count++);
+            uint8_t *dest = ram + pages[i] * RAM_PAGE_SIZE;
+            success = pages[i] < RAM_PAGES && pages[i] + count <= RAM_PAGES
+                    && (map ? snapshot_read_map(snapshot, dest, count * RAM_PAGE_SIZE)
+                            : snapshot_read(snapshot, dest, count * RAM_PAGE_SIZE));
+        }
+        free(pages);
+        if (!success)
+            return false;
+    }
+
+    if (read_id)
+        *read_id = header.id;
+    return true;
+}
+
+/* Resuming doesn't make the digests of the base, that would read all pages.
+ * The first delta makes them from the base's file instead, as RAM changed
+ * since. Returns false if that's not possible anymore. */
+static bool load_base_digests() {
+    if (base_digests)
+        return true;
+
+    uint8_t *ram = calloc(MEM_MAXSIZE, 1);
+    uint64_t *digests = malloc(RAM_PAGES * sizeof(uint64_t));
+    emu_snapshot base = {0};
+    bool success = ram && digests && snapshot_open(&base, base_path, base_offset);
+    if (success) {
+        success = ram_image_read(&base, base_id, 0, ram, false, NULL)
+                && digest_pages(ram, digests) == base_id;
+        snapshot_close(&base);
+    }
+    free(ram);
+
+    if (!success) {
+        emuprintf("Base snapshot %s changed, saving a full snapshot\n", base_path);
+        free(digests);
+        ram_snapshot_forget_base();
+        return false;
+    }
+    base_digests = digests;
+    return true;
+}
+
+bool ram_snapshot_delta_possible(const char *path) {
+    if (!base_id)
+        return false;
+
+    /* Walks the chain from the base, as ram_image_read does. Creating the
+     * snapshot replaces the file at path, so it must not be any of them. */
+    char chain_path[sizeof(base_path)];
+    uint64_t offset = base_offset;
+    strcpy(chain_path, base_path);
+    for (int depth = 0; depth < RAM_MAX_CHAIN; depth++) {
+        if (os_same_file(path, chain_path))
+            return false;
+
+        struct ram_image_header header;
+        emu_snapshot base = {0};
+        if (!snapshot_open(&base, chain_path, offset))
+            return false;
+        bool success = snapshot_read(&base, &header, sizeof(header));
+        snapshot_close(&base);
+        if (!success)
+            return false;
+        if (!header.base_id)
+            return true;
+
+        header.base_path[sizeof(header.base_path) - 1] = '\0';
+        strcpy(chain_path, header.base_path);
+        offset = header.base_offset;
+    }
+    return false;
+}
+
+bool ram_snapshot_suspend(emu_snapshot *snapshot) {
+    // Snapshots kept in memory have no path, they don't become the base
+    bool in_memory = !snapshot->path;
+    uint64_t *digests = in_memory ? NULL : malloc(RAM_PAGES * sizeof(uint64_t));
+    uint32_t *pages = malloc(RAM_PAGES * sizeof(uint32_t));
+    if ((!in_memory && !digests) || !pages) {
+        free(digests);
+        free(pages);
+        return false;
+    }
+
+    // ram_snapshot_delta_possible was checked before the file was created
+    bool delta = snapshot->delta && base_id && !in_memory && load_base_digests();
+    struct ram_image_header header = {0};
+    header.id = in_memory ? 1 : digest_pages(mem_and_flags, digests);
+    header.flags = RAM_IMAGE_ALIGNED;
+    if (delta) {
+        header.base_id = base_id;
+        header.base_offset = base_offset;
+        strcpy(header.base_path, base_path);
+    }
+    for (uint32_t i = 0; i < RAM_PAGES; i++) {
+        if (delta ? digests[i] != base_digests[i] : !page_zero(mem_and_flags + i * RAM_PAGE_SIZE))
+            pages[header.page_count++] = i;
+    }
+
+    static const uint8_t padding[RAM_PAGE_SIZE];
+    uint64_t offset = snapshot_tell(snapshot);
+    bool success = snapshot_write(snapshot, &header, sizeof(header))
+            && snapshot_write(snapshot, pages, header.page_count * sizeof(uint32_t))
+            && snapshot_write(snapshot, padding, -snapshot_tell(snapshot) & (RAM_PAGE_SIZE - 1));
+    for (uint32_t i = 0, count; success && i < header.page_count; i += count) {
+        for (count = 1; i + count < header.page_count && pages[i + count] == pages[i] + count; count++);
+        success = snapshot_write(snapshot, mem_and_flags + pages[i] * RAM_PAGE_SIZE, count * RAM_PAGE_SIZE);
+    }
+    free(pages);
+
+    if (success && !in_memory)
+        set_base(snapshot->path, offset, header.id, digests);
+    else
+        free(digests);
+    return success;
+}
+
+bool ram_snapshot_resume(const emu_snapshot *snapshot) {
+    // The base stays the snapshot file it was, see ram_snapshot_suspend
+    if (!snapshot->path) {
+        memset(mem_and_flags, 0, MEM_MAXSIZE);
+        return ram_image_read(snapshot, 0, 0, mem_and_flags, false, NULL);
+    }
+
+    /* Fastmem maps pages of RAM a second time, which only works for the
+     * shared mapping from os_reserve, not for one of a file */
+    uint64_t offset = snapshot_tell(snapshot), id;
+    os_reserve_zero(mem_and_flags, MEM_MAXSIZE);
+    if (!ram_image_read(snapshot, 0, 0, mem_and_flags, !fastmem_configured(), &id))
+        return false;
+
+    set_base(snapshot->path, offset, id, NULL);
+    return true;
+}
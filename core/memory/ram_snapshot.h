@@ -0,0 +1,48 @@
+/* Declarations for ram_snapshot.c */
+
+#ifndef _H_RAM_SNAPSHOT
+#define _H_RAM_SNAPSHOT
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "emu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Snapshots store mem_and_flags as a list of 4 KB pages. A full snapshot
+ * has all pages which aren't zero. A delta snapshot only has the pages which
+ * differ from its base, the snapshot saved or loaded last, and refers to it
+ * by path. Resuming it reads the chain of bases first, so they must stay
+ * where they are, or be consolidated into a full snapshot by resuming and
+ * saving it again.
+ *
+ * Guest RAM is written by translated code, fastmem, DMA and the debugger
+ * without going through a common function, so changed pages are found by
+ * comparing a digest of each page with the one it had in the base.
+ *
+ * Resuming maps the pages of snapshots stored uncompressed from the files,
+ * so that they are only read when accessed, and copied when written. The
+ * digests of the base are made from its file when the first delta is saved.
+ *
+ * Snapshots without a path, like those of rewind.h, are always full and
+ * leave the base as it is. */
+
+/* Whether a delta snapshot can be saved to path. It can't if there's no
+ * base, or if path is the base or any snapshot in the chain of the base,
+ * compared with os_same_file. Creating it would replace a file which the
+ * delta needs to be resumed. Has to be called before the file is created. */
+bool ram_snapshot_delta_possible(const char *path);
+// Writes the pages, only those changed since the base if snapshot->delta is set
+bool ram_snapshot_suspend(emu_snapshot *snapshot);
+bool ram_snapshot_resume(const emu_snapshot *snapshot);
+// Makes the next delta snapshot a full one
+void ram_snapshot_forget_base();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
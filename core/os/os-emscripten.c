@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -51,6 +52,40 @@ void os_unmap_cow(void *addr, size_t size)
     free(addr);
 }
 
+void *os_map_file(const char *filename, size_t *size)
+{
+    (void) filename;
+    (void) size;
+    return NULL;
+}
+
+void os_unmap_file(void *addr, size_t size)
+{
+    (void) addr;
+    (void) size;
+}
+
+bool os_map_file_at(void *addr, size_t size, const char *filename, uint64_t offset)
+{
+    (void) addr;
+    (void) size;
+    (void) filename;
+    (void) offset;
+    return false;
+}
+
+void os_reserve_zero(void *addr, size_t size)
+{
+    memset(addr, 0, size);
+}
+
+bool os_same_file(const char *a, const char *b)
+{
+    struct stat st_a, st_b;
+    return stat(a, &st_a) == 0 && stat(b, &st_b) == 0
+            && st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
 void addr_cache_init()
 {
     // Only run this if not already initialized
@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #ifdef __APPLE__
     #include <pthread.h>
@@ -127,6 +128,60 @@ void os_unmap_cow(void *addr, size_t size)
     munmap(addr, size);
 }
 
+void *os_map_file(const char *filename, size_t *size)
+{
+    FILE *f = fopen_utf8(filename, "rb");
+    if(!f)
+        return NULL;
+
+    void *ret = MAP_FAILED;
+    struct stat st;
+    if(fstat(fileno(f), &st) == 0 && st.st_size > 0)
+    {
+        *size = st.st_size;
+        ret = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    }
+
+    fclose(f);
+    return ret == MAP_FAILED ? NULL : ret;
+}
+
+void os_unmap_file(void *addr, size_t size)
+{
+    munmap(addr, size);
+}
+
+bool os_map_file_at(void *addr, size_t size, const char *filename, uint64_t offset)
+{
+    uintptr_t mask = sysconf(_SC_PAGE_SIZE) - 1;
+    if(((uintptr_t)addr | size | offset) & mask)
+        return false;
+
+    FILE *f = fopen_utf8(filename, "rb");
+    if(!f)
+        return false;
+
+    void *ret = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(f), offset);
+    fclose(f);
+    return ret != MAP_FAILED;
+}
+
+void os_reserve_zero(void *addr, size_t size)
+{
+    // A new mapping drops the pages of the old one
+    uintptr_t mask = sysconf(_SC_PAGE_SIZE) - 1;
+    if(((uintptr_t)addr | size) & mask
+            || mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED)
+        memset(addr, 0, size);
+}
+
+bool os_same_file(const char *a, const char *b)
+{
+    struct stat st_a, st_b;
+    return stat(a, &st_a) == 0 && stat(b, &st_b) == 0
+            && st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
 __attribute__((unused)) static void make_writable(void *addr)
 {
     uintptr_t ps = sysconf(_SC_PAGE_SIZE);
@@ -6,6 +6,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <share.h>
 
@@ -95,6 +96,78 @@ void os_unmap_cow(void *addr, size_t size)
     _close(flash_fd);
 }
 
+void *os_map_file(const char *filename, size_t *size)
+{
+    wchar_t filename_w[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, filename, -1, filename_w, MAX_PATH);
+
+    HANDLE file = CreateFileW(filename_w, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    void *map = NULL;
+    LARGE_INTEGER file_size;
+    if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+    {
+        // The view keeps the file and the mapping open
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(mapping)
+        {
+            map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = file_size.QuadPart;
+    }
+
+    CloseHandle(file);
+    return map;
+}
+
+void os_unmap_file(void *addr, size_t size)
+{
+    (void)size;
+    UnmapViewOfFile(addr);
+}
+
+bool os_map_file_at(void *addr, size_t size, const char *filename, uint64_t offset)
+{
+    // Views can't be placed within memory from VirtualAlloc
+    (void) addr;
+    (void) size;
+    (void) filename;
+    (void) offset;
+    return false;
+}
+
+void os_reserve_zero(void *addr, size_t size)
+{
+    memset(addr, 0, size);
+}
+
+// Identifies the file by its volume and index, returns false if it can't be opened
+static bool file_id(const char *filename, BY_HANDLE_FILE_INFORMATION *info)
+{
+    wchar_t filename_w[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, filename, -1, filename_w, MAX_PATH);
+
+    HANDLE file = CreateFileW(filename_w, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool success = GetFileInformationByHandle(file, info);
+    CloseHandle(file);
+    return success;
+}
+
+bool os_same_file(const char *a, const char *b)
+{
+    BY_HANDLE_FILE_INFORMATION info_a, info_b;
+    return file_id(a, &info_a) && file_id(b, &info_b)
+            && info_a.dwVolumeSerialNumber == info_b.dwVolumeSerialNumber
+            && info_a.nFileIndexHigh == info_b.nFileIndexHigh
+            && info_a.nFileIndexLow == info_b.nFileIndexLow;
+}
+
 void addr_cache_init() {
     // Don't run more than once
     if(addr_cache)
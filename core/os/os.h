@@ -1,6 +1,7 @@
 #ifndef OS_H
 #define OS_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -54,6 +55,17 @@ void os_sparse_decommit(void *page, size_t size);
 
 void *os_map_cow(const char *filename, size_t size);
 void os_unmap_cow(void *addr, size_t size);
+// Maps all of a file read-only and sets size, returns NULL if that's not possible
+void *os_map_file(const char *filename, size_t *size);
+void os_unmap_file(void *addr, size_t size);
+/* Replaces size bytes at addr, within memory from os_reserve, with a private
+ * copy-on-write mapping of filename from offset. Returns false, changing
+ * nothing, if that's not possible, like if they aren't page aligned. */
+bool os_map_file_at(void *addr, size_t size, const char *filename, uint64_t offset);
+// Sets size bytes at addr, within memory from os_reserve, to zero, without touching the pages
+void os_reserve_zero(void *addr, size_t size);
+// Whether both paths exist and refer to the same file, also through links or other spellings
+bool os_same_file(const char *a, const char *b);
 
 void addr_cache_init();
 void addr_cache_deinit();
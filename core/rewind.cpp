@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <zlib.h>
+
+#include "cpu/cpu.h"
+#include "cpu/translate.h"
+#include "debug_api.h"
+#include "emu.h"
+#include "memory/mem.h"
+#include "memory/mmu.h"
+#include "rewind.h"
+#include "snapshot_file.h"
+#include "timing/schedule.h"
+
+// States are compared in blocks of this size
+#define REWIND_BLOCK_SIZE 0x1000
+#define REWIND_TICK_MS 10
+#define REWIND_MAX_STATES 100000
+
+struct rewind_state {
+    uint64_t time_ms;               // Emulated time when it was taken
+    size_t size;                    // Of its stream
+    size_t delta_size;              // Of delta, uncompressed
+    bool compressed;
+    std::vector<uint8_t> delta;     // Its blocks which differ from the next state
+};
+
+// Oldest first. The newest one has no delta, its stream is in newest.
+static std::deque<rewind_state> states;
+static std::vector<uint8_t> newest;
+static unsigned int interval_ms, max_states;
+static uint64_t elapsed_ms, next_ms;
+// Set while restoring, events can be processed meanwhile
+static bool restoring;
+
+static std::atomic<unsigned int> requested_steps;
+static std::atomic<bool> requested_debug, forget_requested;
+
+static void rewind_configure()
+{
+    static bool configured = false;
+    if(configured)
+        return;
+    configured = true;
+
+    const char *env = getenv("FIREBIRD_REWIND");
+    if(!env || !*env)
+        return;
+
+    char *end;
+    unsigned long interval = strtoul(env, &end, 0), count = REWIND_DEFAULT_STATES;
+    if(*end == ',')
+        count = strtoul(end + 1, &end, 0);
+    if(*end || !rewind_enable(interval, count))
+        emuprintf("FIREBIRD_REWIND must be <interval in ms>[,<states>], with up to %u states.\n", REWIND_MAX_STATES);
+}
+
+static void drop_states()
+{
+    states.clear();
+    std::vector<uint8_t>().swap(newest);
+}
+
+bool rewind_enable(unsigned int interval, unsigned int count)
+{
+    if(interval < REWIND_TICK_MS || count < 1 || count > REWIND_MAX_STATES)
+        return false;
+
+    interval_ms = interval;
+    max_states = count;
+    while(states.size() > max_states)
+        states.pop_front();
+    next_ms = elapsed_ms;
+    return true;
+}
+
+void rewind_disable()
+{
+    interval_ms = 0;
+    drop_states();
+}
+
+unsigned int rewind_count()
+{
+    return states.size();
+}
+
+static emu_snapshot memory_snapshot(snapshot_file *file)
+{
+    // No path, so that RAM is saved in full and the base of delta snapshots stays
+    emu_snapshot snapshot = {};
+    snapshot.stream_handle = file;
+    snapshot.header.sig = SNAPSHOT_SIG;
+    snapshot.header.version = SNAPSHOT_VER;
+    strncpy(snapshot.header.path_flash, path_flash.c_str(), sizeof(snapshot.header.path_flash) - 1);
+    return snapshot;
+}
+
+// Sets the delta of state to the blocks of its stream old which differ from cur
+static void make_delta(rewind_state &state, const std::vector<uint8_t> &old, const uint8_t *cur, size_t cur_size)
+{
+    std::vector<uint8_t> raw;
+    for(size_t offset = 0; offset < old.size(); offset += REWIND_BLOCK_SIZE)
+    {
+        size_t n = std::min<size_t>(REWIND_BLOCK_SIZE, old.size() - offset);
+        if(offset + n <= cur_size && memcmp(old.data() + offset, cur + offset, n) == 0)
+            continue;
+
+        uint32_t block = offset / REWIND_BLOCK_SIZE;
+        raw.insert(raw.end(), reinterpret_cast<const uint8_t *>(&block), reinterpret_cast<const uint8_t *>(&block + 1));
+        raw.insert(raw.end(), old.data() + offset, old.data() + offset + n);
+    }
+
+    uLongf size = compressBound(raw.size());
+    state.delta.resize(size);
+    state.delta_size = raw.size();
+    state.compressed = compress2(state.delta.data(), &size, raw.data(), raw.size(), Z_BEST_SPEED) == Z_OK
+            && size < raw.size();
+    if(state.compressed)
+    {
+        state.delta.resize(size);
+        state.delta.shrink_to_fit();
+    }
+    else
+        state.delta.swap(raw);
+}
+
+// Turns stream, the one of the state after state, into its own
+static bool apply_delta(const rewind_state &state, std::vector<uint8_t> &stream)
+{
+    std::vector<uint8_t> raw;
+    if(state.compressed)
+    {
+        uLongf size = state.delta_size;
+        raw.resize(size);
+        if(uncompress(raw.data(), &size, state.delta.data(), state.delta.size()) != Z_OK || size != state.delta_size)
+            return false;
+    }
+
+    const std::vector<uint8_t> &delta = state.compressed ? raw : state.delta;
+    stream.resize(state.size);
+    for(size_t pos = 0; pos < delta.size();)
+    {
+        uint32_t block;
+        if(delta.size() - pos < sizeof(block))
+            return false;
+        memcpy(&block, delta.data() + pos, sizeof(block));
+        pos += sizeof(block);
+
+        size_t offset = size_t(block) * REWIND_BLOCK_SIZE;
+        if(offset >= stream.size())
+            return false;
+        size_t n = std::min<size_t>(REWIND_BLOCK_SIZE, stream.size() - offset);
+        if(delta.size() - pos < n)
+            return false;
+        memcpy(stream.data() + offset, delta.data() + pos, n);
+        pos += n;
+    }
+
+    return true;
+}
+
+static void rewind_capture()
+{
+    snapshot_file *file = snapshot_file_create_memory(newest.size());
+    emu_snapshot snapshot = memory_snapshot(file);
+    // Within the current second, events are relative to it
+    uint32_t cputick = sched.next_cputick + cycle_count_delta;
+    if(!flash_suspend(&snapshot)
+            || !cpu_suspend(&snapshot)
+            || !memory_suspend(&snapshot)
+            || !sched_suspend(&snapshot)
+            || !snapshot_write(&snapshot, &cputick, sizeof(cputick)))
+    {
+        snapshot_file_close(file);
+        return;
+    }
+
+    size_t size;
+    const uint8_t *data = static_cast<const uint8_t *>(snapshot_file_memory(file, &size));
+    if(!states.empty())
+        make_delta(states.back(), newest, data, size);
+    newest.assign(data, data + size);
+    snapshot_file_close(file);
+
+    states.push_back({elapsed_ms, size, 0, false, {}});
+    while(states.size() > max_states)
+        states.pop_front();
+}
+
+void rewind_tick()
+{
+    rewind_configure();
+
+    if(forget_requested.exchange(false))
+        drop_states();
+
+    if(!interval_ms || restoring)
+        return;
+
+    if(elapsed_ms >= next_ms)
+    {
+        rewind_capture();
+        next_ms = elapsed_ms + interval_ms;
+    }
+    elapsed_ms += REWIND_TICK_MS;
+}
+
+void rewind_request(unsigned int steps, bool debug)
+{
+    requested_debug = debug;
+    requested_steps = steps;
+    /* Leave the CPU loop, emu_loop calls rewind_process then. The emulation
+     * thread changes cpu_events as well, so only ever with atomic ORs here. */
+    __atomic_fetch_or(&cpu_events, EVENT_REWIND, __ATOMIC_SEQ_CST);
+}
+
+// Loads the stream of a state, keeping the breakpoints
+static bool restore(const std::vector<uint8_t> &stream)
+{
+    snapshot_file *debug_file = snapshot_file_create_memory(0);
+    emu_snapshot debug_snapshot = memory_snapshot(debug_file);
+    bool success = debug_suspend(&debug_snapshot);
+
+    // RAM flags get cleared
+    flush_translations();
+
+    snapshot_file *file = snapshot_file_open_memory(stream.data(), stream.size());
+    emu_snapshot snapshot = memory_snapshot(file);
+    uint32_t cputick;
+    success = success
+            && flash_resume(&snapshot)
+            && cpu_resume(&snapshot)
+            && memory_resume(&snapshot)
+            && sched_resume(&snapshot)
+            && snapshot_read(&snapshot, &cputick, sizeof(cputick))
+            && snapshot_file_eof(file);
+    snapshot_file_close(file);
+
+    addr_cache_flush();
+
+    if(success)
+    {
+        size_t size;
+        const void *data = snapshot_file_memory(debug_file, &size);
+        snapshot_file *breakpoints = snapshot_file_open_memory(data, size);
+        emu_snapshot breakpoints_snapshot = memory_snapshot(breakpoints);
+        success = debug_resume(&breakpoints_snapshot);
+        snapshot_file_close(breakpoints);
+        sched_update_next_event(cputick);
+    }
+    snapshot_file_close(debug_file);
+    return success;
+}
+
+void rewind_process()
+{
+    // Before taking the request, a later one sets it again
+    if(cpu_events & EVENT_REWIND)
+        __atomic_fetch_and(&cpu_events, ~EVENT_REWIND, __ATOMIC_SEQ_CST);
+
+    unsigned int steps = requested_steps.exchange(0);
+    if(!steps)
+        return;
+
+    if(forget_requested.exchange(false))
+        drop_states();
+
+    if(requested_debug)
+        cpu_events |= EVENT_DEBUG_STEP;
+
+    if(steps > states.size())
+    {
+        gui_debug_printf("Can't rewind %u states, there are %u\n", steps, unsigned(states.size()));
+        return;
+    }
+
+    // From the newest back to the requested one
+    size_t target = states.size() - steps;
+    for(size_t i = states.size() - 1; i-- > target;)
+    {
+        if(!apply_delta(states[i], newest))
+        {
+            gui_debug_printf("Rewind state is damaged\n");
+            drop_states();
+            return;
+        }
+    }
+    states.erase(states.begin() + target + 1, states.end());
+    std::vector<uint8_t>().swap(states.back().delta);
+    elapsed_ms = states.back().time_ms;
+    next_ms = elapsed_ms + interval_ms;
+
+    restoring = true;
+    bool success = restore(newest);
+    restoring = false;
+    if(!success)
+    {
+        gui_debug_printf("Rewinding failed, resetting\n");
+        drop_states();
+        emu_request_reset_hard();
+        return;
+    }
+
+    // The restored state has its own
+    if(requested_debug)
+        cpu_events |= EVENT_DEBUG_STEP;
+}
+
+void rewind_forget()
+{
+    forget_requested = true;
+}
+
+void rewind_dump()
+{
+    size_t bytes = newest.size();
+    for(auto &state : states)
+        bytes += state.delta.size();
+
+    if(!interval_ms)
+        gui_debug_printf("Rewind is off\n");
+    else
+        gui_debug_printf("Rewind every %u ms, up to %u states\n", interval_ms, max_states);
+    if(!states.empty())
+        gui_debug_printf("%u states back to %.2f s ago, %.1f MB\n", unsigned(states.size()),
+                         (elapsed_ms - states.front().time_ms) / 1000.0, bytes / 1048576.0);
+}
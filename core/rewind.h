@@ -0,0 +1,49 @@
+/* Declarations for rewind.cpp */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Rewinding keeps a ring of states in memory, taken every interval of
+ * emulated time by the same *_suspend functions which save snapshots, but
+ * into memory. Only the newest state is kept as it is, each older one only
+ * has the 4 KB blocks which differ from the state after it, compressed.
+ * Jumping back rebuilds the state from the newest one and drops all states
+ * after it. Breakpoints are kept as they are when jumping.
+ *
+ * Enabled by the debugger command "rw on" or by FIREBIRD_REWIND=<interval
+ * in ms>[,<states>] in the environment. Saving the flash image drops all
+ * states, as they only have the blocks changed since it was loaded. */
+
+#define REWIND_DEFAULT_INTERVAL_MS 1000
+#define REWIND_DEFAULT_STATES 300
+
+// Returns false if the interval or number of states isn't supported
+bool rewind_enable(unsigned int interval_ms, unsigned int states);
+void rewind_disable();
+// States which can be jumped back to
+unsigned int rewind_count();
+// Called every 10 ms of emulated time
+void rewind_tick();
+/* Jumps back to the state taken steps states ago, 1 being the newest, before
+ * emu_loop runs on. Can be called from any thread: the request is atomic
+ * and EVENT_REWIND in cpu_events makes the emulation thread take it. With
+ * debug set, the debugger is entered afterwards. */
+void rewind_request(unsigned int steps, bool debug);
+// Called by emu_loop before processing events
+void rewind_process();
+// Drops all states, can be called from any thread
+void rewind_forget();
+void rewind_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
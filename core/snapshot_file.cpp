@@ -0,0 +1,563 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "os/os.h"
+#include "snapshot_file.h"
+
+#define CHUNK_SIZE (1u << 20)
+/* Chunks start at this offset in the file, and stored ones at a multiple
+ * of it, so that they can be mapped */
+#define DATA_OFFSET 0x1000
+// Compressed chunks waiting to be written or read, per worker thread
+#define CHUNKS_AHEAD 2
+
+static const char container_magic[8] = { 'F', 'B', 'S', 'N', 'A', 'P', 'C', 'K' };
+
+// At the start of the file. Written last, so that incomplete files aren't recognized.
+struct container_header {
+    char magic[8];
+    uint32_t chunk_size;    // Uncompressed size of each chunk but the last
+    uint32_t chunk_count;
+    uint64_t size;          // Of the uncompressed stream
+    uint64_t index_offset;  // Position of the chunk_entry of each chunk in the file
+};
+
+struct chunk_entry {
+    uint64_t offset;        // In the file
+    uint32_t stored_size;   // Equal to size if it's stored uncompressed
+    uint32_t size;
+};
+
+struct chunk {
+    chunk_entry entry;
+    std::vector<uint8_t> data, compressed;
+    bool submitted = false, done = false, ok = false;
+};
+
+// Runs jobs on a few threads, started when the first job comes in
+class worker_pool {
+public:
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // Nobody waits for them anymore
+            jobs.clear();
+            stopping = true;
+        }
+        job_cv.notify_all();
+        for(auto &thread : threads)
+            thread.join();
+    }
+
+    unsigned int size() const
+    {
+        return std::max(1u, std::min(std::thread::hardware_concurrency(), 8u));
+    }
+
+    void submit(std::function<void()> job)
+    {
+#ifdef __EMSCRIPTEN__
+        job();
+#else
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+            if(threads.empty())
+            {
+                for(unsigned int i = 0; i < size(); i++)
+                    threads.emplace_back([this] { work(); });
+            }
+        }
+        job_cv.notify_one();
+#endif
+    }
+
+    // Called by a job when it's done with what wait waits for
+    void finish(bool &done)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        done_cv.notify_all();
+    }
+
+    void wait(const bool &done)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return done; });
+    }
+
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            job_cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable job_cv, done_cv;
+    bool stopping = false;
+};
+
+struct snapshot_file {
+    gzFile gz = nullptr; // Reading a snapshot older than version 8
+    uint64_t pos = 0;
+
+    // Writing
+    FILE *fp = nullptr;
+    int level = 0;
+    bool staged = false;
+    bool in_memory = false; // Only writes into buffer
+    bool failed = false;
+    uint64_t file_offset = 0;
+    std::vector<uint8_t> buffer;
+    std::deque<std::unique_ptr<chunk>> pending;
+    std::vector<chunk_entry> index;
+
+    // Reading
+    std::string filename;
+    const uint8_t *memory = nullptr; // From snapshot_file_open_memory
+    size_t memory_size = 0;
+    container_header header = {};
+    const uint8_t *map = nullptr;
+    size_t map_size = 0;
+    std::vector<uint8_t> contents; // If the file couldn't be mapped
+    std::vector<chunk> chunks;
+    size_t last_chunk = SIZE_MAX;
+
+    // Last, so that the jobs are done before anything they use goes away
+    worker_pool pool;
+};
+
+static const uint8_t zero_padding[DATA_OFFSET] = {};
+
+static void write_file(snapshot_file *file, const void *src, size_t size)
+{
+    if(fwrite(src, 1, size, file->fp) != size)
+        file->failed = true;
+    file->file_offset += size;
+}
+
+// Writes the oldest pending chunk, once it's compressed
+static void write_pending(snapshot_file *file)
+{
+    chunk *c = file->pending.front().get();
+    file->pool.wait(c->done);
+
+    c->entry.size = c->data.size();
+    if(c->ok && c->compressed.size() < c->data.size())
+    {
+        c->entry.offset = file->file_offset;
+        c->entry.stored_size = c->compressed.size();
+        write_file(file, c->compressed.data(), c->compressed.size());
+    }
+    else
+    {
+        write_file(file, zero_padding, -file->file_offset & (DATA_OFFSET - 1));
+        c->entry.offset = file->file_offset;
+        c->entry.stored_size = c->data.size();
+        write_file(file, c->data.data(), c->data.size());
+    }
+
+    file->index.push_back(c->entry);
+    file->pending.pop_front();
+}
+
+static void compress_chunk(snapshot_file *file, chunk *c)
+{
+    if(file->level == 0)
+    {
+        c->done = true;
+        return;
+    }
+
+    int level = file->level;
+    worker_pool *pool = &file->pool;
+    pool->submit([c, level, pool] {
+        uLongf size = compressBound(c->data.size());
+        c->compressed.resize(size);
+        c->ok = compress2(c->compressed.data(), &size, c->data.data(), c->data.size(), level) == Z_OK;
+        c->compressed.resize(size);
+        pool->finish(c->done);
+    });
+}
+
+static void flush_chunk(snapshot_file *file)
+{
+    std::unique_ptr<chunk> c(new chunk);
+    c->data.swap(file->buffer);
+    file->buffer.reserve(CHUNK_SIZE);
+
+    // Staged chunks wait for snapshot_file_close
+    if(!file->staged)
+        compress_chunk(file, c.get());
+
+    file->pending.push_back(std::move(c));
+    while(!file->staged && file->pending.size() > file->pool.size() * CHUNKS_AHEAD)
+        write_pending(file);
+}
+
+static snapshot_file *create(const char *filename, int level, bool staged)
+{
+#ifndef _WIN32
+    /* RAM might still be mapped from the file, see snapshot_file_read_map.
+     * A new file leaves those pages as they are, truncating it wouldn't. */
+    unlink(filename);
+#endif
+
+    FILE *fp = fopen_utf8(filename, "wb");
+    if(!fp)
+        return nullptr;
+
+    snapshot_file *file = new snapshot_file;
+    file->fp = fp;
+    file->level = level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION ? Z_DEFAULT_COMPRESSION : level;
+    file->staged = staged;
+    file->buffer.reserve(CHUNK_SIZE);
+    write_file(file, zero_padding, sizeof(zero_padding));
+    return file;
+}
+
+snapshot_file *snapshot_file_create(const char *filename, int level)
+{
+    return create(filename, level, false);
+}
+
+snapshot_file *snapshot_file_create_staged(const char *filename, int level)
+{
+    return create(filename, level, true);
+}
+
+snapshot_file *snapshot_file_create_memory(size_t size_hint)
+{
+    snapshot_file *file = new snapshot_file;
+    file->in_memory = true;
+    file->buffer.reserve(size_hint);
+    return file;
+}
+
+const void *snapshot_file_memory(const snapshot_file *file, size_t *size)
+{
+    *size = file->buffer.size();
+    return file->buffer.data();
+}
+
+bool snapshot_file_write(snapshot_file *file, const void *src, size_t size)
+{
+    if(file->in_memory)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(src);
+        file->buffer.insert(file->buffer.end(), p, p + size);
+        file->pos += size;
+        return true;
+    }
+
+    const uint8_t *p = static_cast<const uint8_t *>(src);
+    while(size)
+    {
+        size_t n = std::min<size_t>(size, CHUNK_SIZE - file->buffer.size());
+        file->buffer.insert(file->buffer.end(), p, p + n);
+        if(file->buffer.size() == CHUNK_SIZE)
+            flush_chunk(file);
+
+        p += n;
+        size -= n;
+        file->pos += n;
+    }
+
+    return !file->failed;
+}
+
+static bool open_container(snapshot_file *file, const char *filename)
+{
+    file->map = static_cast<const uint8_t *>(os_map_file(filename, &file->map_size));
+    if(!file->map)
+    {
+        FILE *fp = fopen_utf8(filename, "rb");
+        if(!fp)
+            return false;
+
+        uint8_t block[65536];
+        size_t n;
+        while((n = fread(block, 1, sizeof(block), fp)) > 0)
+            file->contents.insert(file->contents.end(), block, block + n);
+        fclose(fp);
+        file->map_size = file->contents.size();
+    }
+
+    const uint8_t *contents = file->map ? file->map : file->contents.data();
+    container_header &header = file->header;
+    if(file->map_size < sizeof(header))
+        return false;
+
+    memcpy(&header, contents, sizeof(header));
+    if(header.chunk_size == 0
+            || header.index_offset > file->map_size
+            || (file->map_size - header.index_offset) / sizeof(chunk_entry) < header.chunk_count
+            || (header.size + header.chunk_size - 1) / header.chunk_size != header.chunk_count)
+        return false;
+
+    file->chunks = std::vector<chunk>(header.chunk_count);
+    for(uint32_t i = 0; i < header.chunk_count; i++)
+    {
+        chunk_entry &entry = file->chunks[i].entry;
+        memcpy(&entry, contents + header.index_offset + i * sizeof(entry), sizeof(entry));
+        uint32_t size = i == header.chunk_count - 1 ? header.size - uint64_t(i) * header.chunk_size : header.chunk_size;
+        if(entry.size != size || entry.offset > file->map_size || file->map_size - entry.offset < entry.stored_size)
+            return false;
+    }
+
+    return true;
+}
+
+snapshot_file *snapshot_file_open_memory(const void *data, size_t size)
+{
+    snapshot_file *file = new snapshot_file;
+    file->memory = static_cast<const uint8_t *>(data);
+    file->memory_size = size;
+    return file;
+}
+
+snapshot_file *snapshot_file_open(const char *filename)
+{
+    FILE *fp = fopen_utf8(filename, "rb");
+    if(!fp)
+        return nullptr;
+
+    char magic[sizeof(container_magic)];
+    bool container = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, container_magic, sizeof(magic)) == 0;
+
+    snapshot_file *file = new snapshot_file;
+    if(container)
+    {
+        fclose(fp);
+        file->filename = filename;
+        if(!open_container(file, filename))
+        {
+            snapshot_file_close(file);
+            return nullptr;
+        }
+
+        return file;
+    }
+
+    int dupfd = dup(fileno(fp));
+    fclose(fp);
+
+    // gzdopen takes ownership of the fd, which shares the position read above
+    file->gz = dupfd >= 0 && lseek(dupfd, 0, SEEK_SET) == 0 ? gzdopen(dupfd, "rb") : nullptr;
+    if(!file->gz)
+    {
+        if(dupfd >= 0)
+            close(dupfd);
+        delete file;
+        return nullptr;
+    }
+
+    return file;
+}
+
+// Returns the uncompressed contents of a chunk, decompressing the following ones meanwhile
+static const uint8_t *chunk_data(snapshot_file *file, size_t index)
+{
+    const uint8_t *contents = file->map ? file->map : file->contents.data();
+    chunk &c = file->chunks[index];
+    if(c.entry.stored_size == c.entry.size)
+        return contents + c.entry.offset;
+
+    // Only the one being read is kept
+    if(file->last_chunk != index && file->last_chunk < file->chunks.size())
+    {
+        chunk &last = file->chunks[file->last_chunk];
+        if(last.done)
+        {
+            std::vector<uint8_t>().swap(last.data);
+            last.submitted = last.done = false;
+        }
+    }
+    file->last_chunk = index;
+
+    size_t end = std::min(file->chunks.size(), index + file->pool.size() * CHUNKS_AHEAD);
+    for(size_t i = index; i < end; i++)
+    {
+        chunk *job = &file->chunks[i];
+        if(job->submitted || job->entry.stored_size == job->entry.size)
+            continue;
+
+        job->submitted = true;
+        const uint8_t *src = contents + job->entry.offset;
+        worker_pool *pool = &file->pool;
+        pool->submit([job, src, pool] {
+            uLongf size = job->entry.size;
+            job->data.resize(size);
+            job->ok = uncompress(job->data.data(), &size, src, job->entry.stored_size) == Z_OK
+                    && size == job->entry.size;
+            pool->finish(job->done);
+        });
+    }
+
+    file->pool.wait(c.done);
+    return c.ok ? c.data.data() : nullptr;
+}
+
+bool snapshot_file_read(snapshot_file *file, void *dest, size_t size)
+{
+    if(file->gz)
+    {
+        // gzread takes an unsigned int
+        return size <= INT32_MAX && gzread(file->gz, dest, size) == int(size);
+    }
+
+    if(file->memory)
+    {
+        if(size > file->memory_size - file->pos)
+            return false;
+
+        memcpy(dest, file->memory + file->pos, size);
+        file->pos += size;
+        return true;
+    }
+
+    uint8_t *p = static_cast<uint8_t *>(dest);
+    while(size)
+    {
+        if(file->pos >= file->header.size)
+            return false;
+
+        size_t index = file->pos / file->header.chunk_size, offset = file->pos % file->header.chunk_size;
+        const uint8_t *data = chunk_data(file, index);
+        if(!data)
+            return false;
+
+        size_t n = std::min<size_t>(size, file->chunks[index].entry.size - offset);
+        memcpy(p, data + offset, n);
+        p += n;
+        size -= n;
+        file->pos += n;
+    }
+
+    return true;
+}
+
+bool snapshot_file_read_map(snapshot_file *file, void *dest, size_t size)
+{
+    if(file->filename.empty())
+        return snapshot_file_read(file, dest, size);
+
+    uint8_t *p = static_cast<uint8_t *>(dest);
+    while(size)
+    {
+        if(file->pos >= file->header.size)
+            return false;
+
+        size_t index = file->pos / file->header.chunk_size, offset = file->pos % file->header.chunk_size;
+        const chunk_entry &entry = file->chunks[index].entry;
+        size_t n = std::min<size_t>(size, entry.size - offset);
+        if(entry.stored_size == entry.size && os_map_file_at(p, n, file->filename.c_str(), entry.offset + offset))
+            file->pos += n;
+        else if(!snapshot_file_read(file, p, n))
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+uint64_t snapshot_file_tell(const snapshot_file *file)
+{
+    return file->gz ? gztell(file->gz) : file->pos;
+}
+
+bool snapshot_file_seek(snapshot_file *file, uint64_t offset)
+{
+    // Skipping ahead in a gzip stream decompresses everything before
+    if(file->gz)
+        return gzseek(file->gz, offset, SEEK_SET) == z_off_t(offset);
+
+    if(file->fp || file->in_memory || offset > (file->memory ? file->memory_size : file->header.size))
+        return false;
+
+    file->pos = offset;
+    return true;
+}
+
+bool snapshot_file_eof(snapshot_file *file)
+{
+    if(file->gz)
+    {
+        uint32_t dummy;
+        return gzread(file->gz, &dummy, sizeof(dummy)) == 0 && gzeof(file->gz);
+    }
+
+    return file->pos == (file->memory ? file->memory_size : file->header.size);
+}
+
+bool snapshot_file_close(snapshot_file *file)
+{
+    bool success = true;
+    if(file->gz)
+        success = gzclose(file->gz) == Z_OK;
+    else if(file->fp)
+    {
+        if(!file->buffer.empty())
+            flush_chunk(file);
+        if(file->staged)
+        {
+            for(auto &c : file->pending)
+                compress_chunk(file, c.get());
+        }
+        while(!file->pending.empty())
+            write_pending(file);
+
+        container_header &header = file->header;
+        memcpy(header.magic, container_magic, sizeof(header.magic));
+        header.chunk_size = CHUNK_SIZE;
+        header.chunk_count = file->index.size();
+        header.size = file->pos;
+        header.index_offset = file->file_offset;
+        write_file(file, file->index.data(), file->index.size() * sizeof(chunk_entry));
+
+        if(fseek(file->fp, 0, SEEK_SET) != 0)
+            file->failed = true;
+        write_file(file, &header, sizeof(header));
+        success = fclose(file->fp) == 0 && !file->failed;
+    }
+
+    if(file->map)
+        os_unmap_file(const_cast<uint8_t *>(file->map), file->map_size);
+
+    delete file;
+    return success;
+}
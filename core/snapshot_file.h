@@ -0,0 +1,56 @@
+/* Declarations for snapshot_file.cpp */
+
+#ifndef SNAPSHOT_FILE_H
+#define SNAPSHOT_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Snapshot files since version 8 split the stream into chunks of 1 MB,
+ * which get compressed and decompressed independently on worker threads.
+ * An index of the chunks at the end allows seeking without decompressing
+ * everything before. With level 0 the chunks are stored as they are, and
+ * the file is read through a mapping of it. Chunks which are stored, with
+ * level 0 or because compressing didn't make them smaller, start page
+ * aligned, so that their contents can be mapped into memory directly.
+ * Compressed chunks are written back to back.
+ * Older snapshots, a single gzip stream, can still be read. */
+typedef struct snapshot_file snapshot_file;
+
+// level is a zlib compression level, 0 stores the chunks uncompressed
+snapshot_file *snapshot_file_create(const char *filename, int level);
+/* Only keeps the stream in memory until snapshot_file_close compresses and
+ * writes it, which may be called on another thread. */
+snapshot_file *snapshot_file_create_staged(const char *filename, int level);
+snapshot_file *snapshot_file_open(const char *filename);
+// Writes into memory only, see snapshot_file_memory
+snapshot_file *snapshot_file_create_memory(size_t size_hint);
+// What was written to a file from snapshot_file_create_memory, valid until it's closed
+const void *snapshot_file_memory(const snapshot_file *file, size_t *size);
+// Reads from data, which must stay valid until the file is closed
+snapshot_file *snapshot_file_open_memory(const void *data, size_t size);
+bool snapshot_file_write(snapshot_file *file, const void *src, size_t size);
+bool snapshot_file_read(snapshot_file *file, void *dest, size_t size);
+/* Like snapshot_file_read, but maps the parts of the file which are stored
+ * uncompressed and page aligned to dest, see os_map_file_at. dest must be
+ * within memory from os_reserve. Pages are only read when accessed. */
+bool snapshot_file_read_map(snapshot_file *file, void *dest, size_t size);
+// Position in the uncompressed stream
+uint64_t snapshot_file_tell(const snapshot_file *file);
+// Only while reading
+bool snapshot_file_seek(snapshot_file *file, uint64_t offset);
+// Whether all of the stream was read
+bool snapshot_file_eof(snapshot_file *file);
+// Returns false if anything couldn't be written
+bool snapshot_file_close(snapshot_file *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,6 +12,7 @@
 #include "memory/mem.h"
 #include "cpu/cpu.h"
 #include "os/os.h"
+#include "rewind.h"
 
 nand_state nand;
 static uint8_t *nand_data = NULL;
@@ -661,6 +662,9 @@ bool flash_save_changes()
         }
     }
     fflush(flash_file);
+    // Their states only have the blocks modified before
+    if (count)
+        rewind_forget();
     gui_status_printf("Flash: Saved %d modified blocks", count);
     return true;
 }
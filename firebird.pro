@@ -184,9 +184,13 @@ SOURCES += $$ASMCODE_IMPL \
     core/cpu/arm_interpreter.cpp \
     core/cpu/coproc.cpp \
     core/cpu/cpu.cpp \
+    core/cpu/fallback_stats.c \
+    core/cpu/lockstep.cpp \
     core/cpu/thumb_interpreter.cpp \
+    core/cpu/translate_analysis.c \
     core/usb/usblink_queue.cpp \
     core/jit/armsnippets_loader.c \
+    core/jit/perf_map.c \
     core/soc/casplus.c \
     core/crypto/des.c \
     core/disassembly/disasm.c \
@@ -196,9 +200,11 @@ SOURCES += $$ASMCODE_IMPL \
     core/peripherals/keypad.cpp \
     core/peripherals/lcd.c \
     core/peripherals/link.c \
+    core/memory/fastmem.c \
     core/memory/mem.c \
     core/peripherals/misc.c \
     core/memory/mmu.c \
+    core/memory/ram_snapshot.c \
     core/debug/nspire_log_hook.cpp \
     core/timing/schedule.c \
     core/peripherals/serial.c \
@@ -217,6 +223,8 @@ SOURCES += $$ASMCODE_IMPL \
     core/storage/flash.cpp \
     core/storage/nand_fs.cpp \
     core/emu.cpp \
+    core/rewind.cpp \
+    core/snapshot_file.cpp \
     transfer/usblinktreewidget.cpp \
     ui/models/kitmodel.cpp \
     dialogs/fbaboutdialog.cpp \
@@ -292,14 +300,20 @@ HEADERS += \
     core/jit/armcode_bin.h \
     core/jit/armsnippets.h \
     core/jit/asmcode.h \
+    core/jit/perf_map.h \
     core/cpu/bitfield.h \
     core/soc/casplus.h \
     core/cpu/cpu.h \
     core/cpu/cpudefs.h \
+    core/cpu/fallback_stats.h \
+    core/cpu/lockstep.h \
+    core/cpu/translate_analysis.h \
     core/debug/debug.h \
     core/crypto/des.h \
     core/disassembly/disasm.h \
     core/emu.h \
+    core/rewind.h \
+    core/snapshot_file.h \
     core/storage/flash.h \
     core/debug/gdbstub.h \
     core/gif.h \
@@ -307,9 +321,11 @@ HEADERS += \
     core/peripherals/keypad.h \
     core/peripherals/lcd.h \
     core/peripherals/link.h \
+    core/memory/fastmem.h \
     core/memory/mem.h \
     core/peripherals/misc.h \
     core/memory/mmu.h \
+    core/memory/ram_snapshot.h \
     core/debug/nspire_log_hook.h \
     core/timing/schedule.h \
     core/crypto/sha256.h \
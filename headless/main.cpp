@@ -1,13 +1,21 @@
 #include <errno.h>
 
+#include "core/cpu/fallback_stats.h"
+#include "core/cpu/lockstep.h"
 #include "core/debug/debug.h"
 #include "core/emu.h"
 #include "core/memory/mem.h"
 #include "core/memory/mmu.h"
 #include "core/usb/usblink_queue.h"
 
+// Throttle intervals of 10 ms emulated time left until exiting, -1 = unlimited
+static long long run_intervals_left = -1;
+
 void gui_do_stuff(bool wait)
 {
+	// wait is only set once per throttle interval, see throttle_interval_event
+	if(wait && run_intervals_left > 0 && --run_intervals_left == 0)
+		exiting = true;
 }
 
 void do_stuff(int i)
@@ -68,12 +76,17 @@ void throttle_timer_wait(unsigned int usec) {}
 static const char OPT_BOOT1[]              = "--boot1";
 static const char OPT_FLASH[]              = "--flash";
 static const char OPT_SNAPSHOT[]           = "--snapshot";
+static const char OPT_CONSOLIDATE[]        = "--consolidate";
+static const char OPT_COMPRESSION[]        = "--snapshot-compression";
 static const char OPT_RAMPAYLOAD[]         = "--rampayload";
 static const char OPT_RAMPAYLOAD_ADDR[]    = "--rampayload-address";
 static const char OPT_DEBUG_ON_START[]     = "--debug-on-start";
 static const char OPT_DEBUG_ON_WARN[]      = "--debug-on-warn";
 static const char OPT_PRINT_ON_WARN[]      = "--print-on-warn";
 static const char OPT_DIAGS[]              = "--diags";
+static const char OPT_FALLBACK_STATS[]     = "--fallback-stats";
+static const char OPT_LOCKSTEP[]           = "--lockstep";
+static const char OPT_RUN_FOR[]            = "--run-for";
 static const char OPT_HELP[]               = "--help";
 static const uint32_t default_rampayload_base = 0x10000000;
 
@@ -84,6 +97,8 @@ void show_help_menu(void)
 	fprintf(stderr, "  %-24s Path to Boot1 image (required)\n", OPT_BOOT1);
 	fprintf(stderr, "  %-24s Path to Flash image (required)\n", OPT_FLASH);
 	fprintf(stderr, "  %-24s Path to snapshot image (optional)\n", OPT_SNAPSHOT);
+	fprintf(stderr, "  %-24s Save the snapshot and its bases as one full snapshot to this path and exit\n", OPT_CONSOLIDATE);
+	fprintf(stderr, "  %-24s zlib level for saved snapshots, 0 stores them uncompressed\n", OPT_COMPRESSION);
 	fprintf(stderr, "  %-24s Path to RAM payload (optional)\n", OPT_RAMPAYLOAD);
 	fprintf(stderr, "  %-24s Address to load RAM payload at (default: 0x%x)\n",
 	       OPT_RAMPAYLOAD_ADDR, default_rampayload_base);
@@ -91,11 +106,16 @@ void show_help_menu(void)
 	fprintf(stderr, "  %-24s Enter debugger on warnings\n", OPT_DEBUG_ON_WARN);
 	fprintf(stderr, "  %-24s Print warnings to console\n", OPT_PRINT_ON_WARN);
 	fprintf(stderr, "  %-24s Use diagnostics boot order\n", OPT_DIAGS);
+	fprintf(stderr, "  %-24s Count what keeps code out of the translator, print on exit\n", OPT_FALLBACK_STATS);
+	fprintf(stderr, "  %-24s Run translated blocks with the interpreter as well and compare,\n", OPT_LOCKSTEP);
+	fprintf(stderr, "  %-24s exit with status 1 if any block diverged\n", "");
+	fprintf(stderr, "  %-24s Exit after this many ms of emulated time, with status 0 if nothing\n", OPT_RUN_FOR);
+	fprintf(stderr, "  %-24s diverged in %s, for unattended runs\n", "", OPT_LOCKSTEP);
 }
 
 int main(int argc, char *argv[])
 {
-	const char *boot1 = nullptr, *flash = nullptr, *snapshot = nullptr, *rampayload = nullptr;
+	const char *boot1 = nullptr, *flash = nullptr, *snapshot = nullptr, *rampayload = nullptr, *consolidate = nullptr;
 	uint32_t rampayload_base = default_rampayload_base;
 
 	for(int argi = 1; argi < argc; ++argi)
@@ -106,6 +126,10 @@ int main(int argc, char *argv[])
 			flash = argv[++argi];
 		else if(strcmp(argv[argi], OPT_SNAPSHOT) == 0)
 			snapshot = argv[++argi];
+		else if(strcmp(argv[argi], OPT_CONSOLIDATE) == 0)
+			consolidate = argv[++argi];
+		else if(strcmp(argv[argi], OPT_COMPRESSION) == 0)
+			snapshot_compression = strtol(argv[++argi], nullptr, 0);
 		else if(strcmp(argv[argi], OPT_RAMPAYLOAD) == 0)
 			rampayload = argv[++argi];
 		else if(strcmp(argv[argi], OPT_RAMPAYLOAD_ADDR) == 0)
@@ -118,6 +142,21 @@ int main(int argc, char *argv[])
 			print_on_warn = true;
 		else if(strcmp(argv[argi], OPT_DIAGS) == 0)
 			boot_order = ORDER_DIAGS;
+		else if(strcmp(argv[argi], OPT_FALLBACK_STATS) == 0)
+			fallback_stats_enabled = true;
+		else if(strcmp(argv[argi], OPT_LOCKSTEP) == 0)
+			lockstep_enabled = true;
+		else if(strcmp(argv[argi], OPT_RUN_FOR) == 0)
+		{
+			long long ms = argi + 1 < argc ? strtoll(argv[++argi], nullptr, 0) : 0;
+			if(ms <= 0)
+			{
+				fprintf(stderr, "%s needs a positive number of milliseconds.\n", OPT_RUN_FOR);
+				return 2;
+			}
+			// Rounded up to whole throttle intervals
+			run_intervals_left = (ms + 9) / 10;
+		}
 		else if (strcmp(argv[argi], OPT_HELP) == 0)
 		{
 			show_help_menu();
@@ -141,9 +180,18 @@ int main(int argc, char *argv[])
 	path_boot1 = boot1;
 	path_flash = flash;
 
+	if(consolidate && !snapshot)
+	{
+		fprintf(stderr, "%s needs a snapshot to consolidate.\n", OPT_CONSOLIDATE);
+		return 2;
+	}
+
 	if(!emu_start(0, 0, snapshot))
 		return 1;
 
+	if(consolidate)
+		return emu_suspend(consolidate) ? 0 : 1;
+
 	if(rampayload)
 	{
 		FILE *f = fopen(rampayload, "rb");
@@ -178,6 +226,18 @@ int main(int argc, char *argv[])
 
 	turbo_mode = true;
 	emu_loop(false);
+	// A snapshot may still be written in the background
+	emu_suspend_wait();
+
+	if(fallback_stats_enabled)
+		fallback_stats_dump();
+
+	if(lockstep_enabled)
+	{
+		lockstep_dump();
+		if(lockstep_stats.diverged)
+			return 1;
+	}
 
 	return 0;
 }